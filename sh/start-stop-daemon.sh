@@ -50,10 +50,11 @@ ssd_start()
 		$_background $start_stop_daemon_args \
 		-- $command_args $command_args_background
 	if eend $? "Failed to start ${name:-$RC_SVCNAME}"; then
-		service_set_value "command" "${command}"
-		[ -n "${chroot}" ] && service_set_value "chroot" "${chroot}"
-		[ -n "${pidfile}" ] && service_set_value "pidfile" "${pidfile}"
-		[ -n "${procname}" ] && service_set_value "procname" "${procname}"
+		set -- "command" "${command}"
+		[ -n "${chroot}" ] && set -- "$@" "chroot" "${chroot}"
+		[ -n "${pidfile}" ] && set -- "$@" "pidfile" "${pidfile}"
+		[ -n "${procname}" ] && set -- "$@" "procname" "${procname}"
+		service_set_value "$@"
 		return 0
 	fi
 	if yesno "$start_inactive"; then
@@ -34,8 +34,10 @@ supervise_start()
 		-- $command_args $command_args_foreground
 	rc=$?
 	if [ $rc = 0 ]; then
-		[ -n "${chroot}" ] && service_set_value "chroot" "${chroot}"
-		[ -n "${pidfile}" ] && service_set_value "pidfile" "${pidfile}"
+		set --
+		[ -n "${chroot}" ] && set -- "$@" "chroot" "${chroot}"
+		[ -n "${pidfile}" ] && set -- "$@" "pidfile" "${pidfile}"
+		[ $# -eq 0 ] || service_set_value "$@"
 	fi
 	eend $rc "failed to start ${name:-$RC_SVCNAME}"
 }
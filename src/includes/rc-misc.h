@@ -32,6 +32,8 @@
 #define RC_LEVEL_DEFAULT        "default"
 
 #define RC_DEPTREE_CACHE        RC_SVCDIR "/deptree"
+#define RC_DEPTREE_BIN          RC_SVCDIR "/deptree.bin"
+#define RC_DEPCACHE             RC_SVCDIR "/depcache"
 #define RC_DEPTREE_SKEWED	RC_SVCDIR "/clock-skewed"
 #define RC_KRUNLEVEL            RC_SVCDIR "/krunlevel"
 #define RC_STARTING             RC_SVCDIR "/rc.starting"
@@ -65,6 +67,10 @@ int parse_mode(mode_t *, char *);
 /* Handy function so we can wrap einfo around our deptree */
 RC_DEPTREE *_rc_deptree_load (int, int *);
 
+/* Which of the services the service waits for by the dependency types */
+RC_STRINGLIST *waits_for(const RC_DEPTREE *, const RC_STRINGLIST *,
+    const char *, RC_STRINGLIST *);
+
 /* Test to see if we can see pid 1 or not */
 bool _rc_can_find_pids(void);
 
@@ -15,14 +15,108 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#include <sys/mman.h>
 #include <sys/utsname.h>
 
+#include <sys/file.h>
+
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+
 #include "queue.h"
 #include "librc.h"
 
 #define GENDEP          RC_LIBEXECDIR "/sh/gendepends.sh"
 
 #define RC_DEPCONFIG    RC_SVCDIR "/depconfig"
+#define RC_DEPMANIFEST  RC_SVCDIR "/depmanifest"
+#define RC_DEPPLAN      RC_SVCDIR "/plan"
+#define RC_DEPLOCK      RC_SVCDIR "/deptree.lock"
+
+/* Largest cache file we read in one go */
+#define FILE_MAX_SIZE   (64 * 1024 * 1024)
+
+/* The binary deptree cache.
+ * The text cache stays as a human readable export, but parsing it costs
+ * an allocation per edge on every load. So we also save an image of the
+ * compiled tree which we can map read only and use in place.
+ * Every name is interned to an integer id, services first followed by
+ * names which are only ever depended on. Each dependency type has an
+ * adjacency array indexed by service id which points into the edges,
+ * so looking up the services of a given type is O(1).
+ * All offsets are relative to the start of the image and all numbers are
+ * in host byte order as the cache never leaves this machine.
+ * Bump DEPTREE_VERSION whenever the layout changes, or what it holds, as
+ * version 3 added the digest and version 5 what scripts set for
+ * rc_service_description and rc_service_extra_commands. */
+#define DEPTREE_MAGIC   "OpenRCdt"
+#define DEPTREE_VERSION 5
+#define DEPTREE_NONE    UINT32_MAX
+
+typedef struct deptree_header
+{
+	char magic[8];
+	uint32_t version;
+	/* Size of the whole image */
+	uint32_t size;
+	/* Names with dependency info, they come first */
+	uint32_t nservices;
+	uint32_t nnames;
+	uint32_t ntypes;
+	uint32_t nedges;
+	uint32_t nhash;
+	/* Offsets of our tables */
+	uint32_t names;
+	uint32_t types;
+	uint32_t adj;
+	uint32_t edges;
+	uint32_t hash;
+	uint32_t strings;
+	uint32_t strings_size;
+	/* Where rc_deptree_update found each service */
+	uint32_t paths;
+	/* Which init_dirs existed then */
+	uint32_t paths_dirs;
+	/* When it started looking, 0 if it didn't */
+	int64_t paths_time;
+	/* Hash of the dependencies alone, so the same dependencies have
+	 * the same digest however they were loaded */
+	uint32_t digest;
+	uint32_t pad;
+} DEPTREE_HEADER;
+
+/* names and types are string table offsets.
+ * adj holds ntypes rows of nservices + 1 edge offsets, so the edges of
+ * service s for type t run from adj[t][s] to adj[t][s + 1].
+ * edges are name ids.
+ * hash is an open addressed table of name id + 1, 0 being empty.
+ * paths are string table offsets of the script of each service as
+ * rc_service_resolve would find it in the init directories, or 0 if it
+ * wasn't found. */
+struct rc_deptree
+{
+	char *data;
+	size_t size;
+	/* true if data is mapped from the binary cache */
+	bool mapped;
+	const DEPTREE_HEADER *header;
+	const uint32_t *names;
+	const uint32_t *types;
+	const uint32_t *adj;
+	const uint32_t *edges;
+	const uint32_t *hash;
+	const uint32_t *paths;
+	const char *strings;
+	/* Types we need to look up a lot */
+	uint32_t iprovide;
+	uint32_t providedby;
+};
+
+#define DT_NAME(dt, id)         ((dt)->strings + (dt)->names[id])
+
+#define BIT_SET(b, i)           ((b)[(i) / CHAR_BIT] |= 1 << ((i) % CHAR_BIT))
+#define BIT_ISSET(b, i)         ((b)[(i) / CHAR_BIT] & (1 << ((i) % CHAR_BIT)))
 
 static const char *bootlevel = NULL;
 
@@ -44,24 +138,41 @@ get_shell_value(char *string)
 	if (*e == '\'')
 		*e-- = 0;
 
+	/* Undo how we save quotes, '\'' */
+	for (e = p; (e = strstr(e, "'\\''")); e++)
+		memmove(e + 1, e + 4, strlen(e + 4) + 1);
+
 	if (*p != 0)
 		return p;
 
 	return NULL;
 }
 
-void
-rc_deptree_free(RC_DEPTREE *deptree)
+/* Save a value so get_shell_value and the shell read it back as is */
+static void
+put_shell_value(FILE *fp, const char *value)
+{
+	fputc('\'', fp);
+	for (; *value; value++)
+		if (*value == '\'')
+			fputs("'\\''", fp);
+		else
+			fputc(*value, fp);
+	fputs("'\n", fp);
+}
+
+static void
+deplist_free(RC_DEPLIST *deplist)
 {
 	RC_DEPINFO *di;
 	RC_DEPINFO *di2;
 	RC_DEPTYPE *dt;
 	RC_DEPTYPE *dt2;
 
-	if (!deptree)
+	if (!deplist)
 		return;
 
-	di = TAILQ_FIRST(deptree);
+	di = TAILQ_FIRST(deplist);
 	while (di) {
 		di2 = TAILQ_NEXT(di, entries);
 		dt = TAILQ_FIRST(&di->depends);
@@ -76,20 +187,22 @@ rc_deptree_free(RC_DEPTREE *deptree)
 		free(di);
 		di = di2;
 	}
-	free(deptree);
+	free(deplist);
 }
-librc_hidden_def(rc_deptree_free)
 
-static RC_DEPINFO *
-get_depinfo(const RC_DEPTREE *deptree, const char *service)
+void
+rc_deptree_free(RC_DEPTREE *deptree)
 {
-	RC_DEPINFO *di;
+	if (!deptree)
+		return;
 
-	TAILQ_FOREACH(di, deptree, entries)
-		if (strcmp(di->service, service) == 0)
-			return di;
-	return NULL;
+	if (deptree->mapped)
+		munmap(deptree->data, deptree->size);
+	else
+		free(deptree->data);
+	free(deptree);
 }
+librc_hidden_def(rc_deptree_free)
 
 static RC_DEPTYPE *
 get_deptype(const RC_DEPINFO *depinfo, const char *type)
@@ -102,31 +215,703 @@ get_deptype(const RC_DEPINFO *depinfo, const char *type)
 	return NULL;
 }
 
+static uint32_t
+str_hash(const char *str)
+{
+	uint32_t h = 2166136261U;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+/* Carry on an FNV-1a hash over len bytes */
+static uint32_t
+fnv_hash(uint32_t h, const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)data[i]) * 16777619U;
+	return h;
+}
+
+/* Return the id of a name, or DEPTREE_NONE */
+static uint32_t
+get_name(const RC_DEPTREE *deptree, const char *name)
+{
+	uint32_t mask = deptree->header->nhash - 1;
+	uint32_t i = str_hash(name) & mask;
+
+	while (deptree->hash[i]) {
+		if (strcmp(DT_NAME(deptree, deptree->hash[i] - 1), name) == 0)
+			return deptree->hash[i] - 1;
+		i = (i + 1) & mask;
+	}
+	return DEPTREE_NONE;
+}
+
+static uint32_t
+get_service(const RC_DEPTREE *deptree, const char *service)
+{
+	uint32_t id = get_name(deptree, service);
+
+	if (id >= deptree->header->nservices)
+		return DEPTREE_NONE;
+	return id;
+}
+
+static uint32_t
+get_type(const RC_DEPTREE *deptree, const char *type)
+{
+	uint32_t i;
+
+	for (i = 0; i < deptree->header->ntypes; i++)
+		if (strcmp(deptree->strings + deptree->types[i], type) == 0)
+			return i;
+	return DEPTREE_NONE;
+}
+
+/* Return the edges of a service for a type, setting n to how many */
+static const uint32_t *
+get_edges(const RC_DEPTREE *deptree, uint32_t service, uint32_t type,
+	  uint32_t *n)
+{
+	const uint32_t *row;
+
+	if (type == DEPTREE_NONE) {
+		*n = 0;
+		return NULL;
+	}
+	row = deptree->adj + (size_t)type * (deptree->header->nservices + 1);
+	*n = row[service + 1] - row[service];
+	return deptree->edges + row[service];
+}
+
+/* Intern strings to ids while we compile the deptree */
+typedef struct nametab
+{
+	const char **names;
+	uint32_t count;
+	uint32_t size;
+	/* Open addressed hash of id + 1, 0 being empty */
+	uint32_t *slots;
+	uint32_t nslots;
+} NAMETAB;
+
+static uint32_t
+nametab_find(const NAMETAB *nt, const char *name, uint32_t *slot)
+{
+	uint32_t i;
+
+	if (!nt->nslots)
+		return DEPTREE_NONE;
+	i = str_hash(name) & (nt->nslots - 1);
+	while (nt->slots[i]) {
+		if (strcmp(nt->names[nt->slots[i] - 1], name) == 0)
+			return nt->slots[i] - 1;
+		i = (i + 1) & (nt->nslots - 1);
+	}
+	if (slot)
+		*slot = i;
+	return DEPTREE_NONE;
+}
+
+static void
+nametab_grow(NAMETAB *nt)
+{
+	uint32_t *old = nt->slots;
+	uint32_t nold = nt->nslots;
+	uint32_t i, j;
+
+	nt->nslots = nold ? nold * 2 : 256;
+	nt->slots = xmalloc(sizeof(*nt->slots) * nt->nslots);
+	memset(nt->slots, 0, sizeof(*nt->slots) * nt->nslots);
+	for (i = 0; i < nold; i++) {
+		if (!old[i])
+			continue;
+		j = str_hash(nt->names[old[i] - 1]) & (nt->nslots - 1);
+		while (nt->slots[j])
+			j = (j + 1) & (nt->nslots - 1);
+		nt->slots[j] = old[i];
+	}
+	free(old);
+}
+
+static uint32_t
+nametab_add(NAMETAB *nt, const char *name)
+{
+	uint32_t id, slot;
+
+	if ((nt->count + 1) * 2 > nt->nslots)
+		nametab_grow(nt);
+	if ((id = nametab_find(nt, name, &slot)) != DEPTREE_NONE)
+		return id;
+	if (nt->count == nt->size) {
+		nt->size = nt->size ? nt->size * 2 : 256;
+		nt->names = xrealloc(nt->names, sizeof(*nt->names) * nt->size);
+	}
+	nt->names[nt->count] = name;
+	nt->slots[slot] = ++nt->count;
+	return nt->count - 1;
+}
+
+static void
+nametab_free(NAMETAB *nt)
+{
+	free(nt->names);
+	free(nt->slots);
+	memset(nt, 0, sizeof(*nt));
+}
+
+/* Index our build list by service, so each phase can find a service
+ * without scanning the whole list */
+typedef struct depindex
+{
+	NAMETAB names;
+	/* Service of each name id, or NULL if it was removed */
+	RC_DEPINFO **info;
+} DEPINDEX;
+
+static RC_DEPINFO *
+get_depinfo(const DEPINDEX *index, const char *service)
+{
+	uint32_t id = nametab_find(&index->names, service, NULL);
+
+	return id == DEPTREE_NONE ? NULL : index->info[id];
+}
+
+/* Index a service unless one of the same name is already there */
+static void
+depindex_add(DEPINDEX *index, RC_DEPINFO *depinfo)
+{
+	uint32_t size = index->names.size;
+	uint32_t id = nametab_find(&index->names, depinfo->service, NULL);
+
+	if (id == DEPTREE_NONE) {
+		id = nametab_add(&index->names, depinfo->service);
+		if (index->names.size != size)
+			index->info = xrealloc(index->info,
+			    sizeof(*index->info) * index->names.size);
+		index->info[id] = NULL;
+	}
+	if (!index->info[id]) {
+		index->names.names[id] = depinfo->service;
+		index->info[id] = depinfo;
+	}
+}
+
+/* Remove a service from the index, it must outlive the index */
+static void
+depindex_del(DEPINDEX *index, const RC_DEPINFO *depinfo)
+{
+	uint32_t id = nametab_find(&index->names, depinfo->service, NULL);
+
+	if (id != DEPTREE_NONE && index->info[id] == depinfo)
+		index->info[id] = NULL;
+}
+
+static void
+depindex_free(DEPINDEX *index)
+{
+	nametab_free(&index->names);
+	free(index->info);
+	index->info = NULL;
+}
+
+/* Note a dependency in a set of keys we hold, returning false if it's
+ * already there */
+static bool
+depset_add(NAMETAB *set, RC_STRINGLIST *keys, const char *service,
+	   const char *type, const char *depend)
+{
+	size_t l = strlen(service) + strlen(type) + strlen(depend) + 3;
+	char *key = xmalloc(l);
+	bool added = false;
+
+	snprintf(key, l, "%s %s %s", service, type, depend);
+	if (nametab_find(set, key, NULL) == DEPTREE_NONE) {
+		nametab_add(set, rc_stringlist_add(keys, key)->value);
+		added = true;
+	}
+	free(key);
+	return added;
+}
+
+/* Point our tables into the image, making sure that everything
+ * lies within it so we can trust it from then on. */
+static bool
+deptree_init(RC_DEPTREE *deptree)
+{
+	const DEPTREE_HEADER *h = (const DEPTREE_HEADER *)deptree->data;
+	uint64_t nadj;
+	uint32_t i;
+
+	if (deptree->size < sizeof(*h) ||
+	    memcmp(h->magic, DEPTREE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != DEPTREE_VERSION ||
+	    h->size != deptree->size ||
+	    h->nservices > h->nnames ||
+	    h->nhash <= h->nnames ||
+	    (h->nhash & (h->nhash - 1)) != 0)
+		return false;
+
+	nadj = (uint64_t)h->ntypes * (h->nservices + 1);
+#define DT_FITS(o, n, s) \
+	((o) % sizeof(uint32_t) == 0 && (o) <= deptree->size && \
+	 (n) <= (deptree->size - (o)) / (s))
+	if (!DT_FITS(h->names, h->nnames, sizeof(uint32_t)) ||
+	    !DT_FITS(h->types, h->ntypes, sizeof(uint32_t)) ||
+	    !DT_FITS(h->adj, nadj, sizeof(uint32_t)) ||
+	    !DT_FITS(h->edges, h->nedges, sizeof(uint32_t)) ||
+	    !DT_FITS(h->hash, h->nhash, sizeof(uint32_t)) ||
+	    !DT_FITS(h->paths, h->nservices, sizeof(uint32_t)) ||
+	    !DT_FITS(h->strings, h->strings_size, 1) ||
+	    h->strings_size == 0 ||
+	    deptree->data[h->strings + h->strings_size - 1] != '\0')
+		return false;
+#undef DT_FITS
+
+	deptree->header = h;
+	deptree->names = (const uint32_t *)(deptree->data + h->names);
+	deptree->types = (const uint32_t *)(deptree->data + h->types);
+	deptree->adj = (const uint32_t *)(deptree->data + h->adj);
+	deptree->edges = (const uint32_t *)(deptree->data + h->edges);
+	deptree->hash = (const uint32_t *)(deptree->data + h->hash);
+	deptree->paths = (const uint32_t *)(deptree->data + h->paths);
+	deptree->strings = deptree->data + h->strings;
+
+	for (i = 0; i < h->nnames; i++)
+		if (deptree->names[i] >= h->strings_size)
+			return false;
+	for (i = 0; i < h->ntypes; i++)
+		if (deptree->types[i] >= h->strings_size)
+			return false;
+	/* One ascending run of offsets keeps every row in range */
+	for (i = 0; i < nadj; i++)
+		if ((i == 0 && deptree->adj[i] != 0) ||
+		    (i > 0 && deptree->adj[i] < deptree->adj[i - 1]) ||
+		    deptree->adj[i] > h->nedges)
+			return false;
+	for (i = 0; i < h->nedges; i++)
+		if (deptree->edges[i] >= h->nnames)
+			return false;
+	for (i = 0; i < h->nhash; i++)
+		if (deptree->hash[i] > h->nnames)
+			return false;
+	for (i = 0; i < h->nservices; i++)
+		if (deptree->paths[i] >= h->strings_size)
+			return false;
+
+	deptree->iprovide = get_type(deptree, "iprovide");
+	deptree->providedby = get_type(deptree, "providedby");
+	return true;
+}
+
+/* Where gendepends.sh looks for init scripts */
+static const char *const init_dirs[] = {
+	RC_INITDIR,
+#ifdef RC_PKG_INITDIR
+	RC_PKG_INITDIR,
+#endif
+#ifdef RC_LOCAL_INITDIR
+	RC_LOCAL_INITDIR,
+#endif
+	NULL
+};
+
+/* Compile our build list into an image we can query and save.
+ * If since is given, it's when we started looking at the init scripts and
+ * we note where each service is. */
+static RC_DEPTREE *
+deptree_compile(const RC_DEPLIST *deplist, time_t since)
+{
+	RC_DEPTREE *deptree;
+	DEPTREE_HEADER *h;
+	RC_DEPINFO *di;
+	RC_DEPTYPE *dt;
+	RC_STRING *s;
+	RC_DEPINFO **services = NULL;
+	NAMETAB names, types;
+	uint32_t *adj, *edges, *hash, *cursor;
+	uint32_t nservices, nedges = 0, nhash, id, t, i, j;
+	uint32_t dirs = 0;
+	uint64_t nadj;
+	size_t size, l, depsize;
+	char *p;
+	char **found = NULL;
+	struct stat st;
+
+	memset(&names, 0, sizeof(names));
+	memset(&types, 0, sizeof(types));
+
+	/* Services get the first ids. If there are duplicate services
+	 * then only the first can ever be found, so just drop the rest */
+	i = 0;
+	TAILQ_FOREACH(di, deplist, entries)
+		i++;
+	if (i)
+		services = xmalloc(sizeof(*services) * i);
+	TAILQ_FOREACH(di, deplist, entries)
+		if (nametab_find(&names, di->service, NULL) == DEPTREE_NONE)
+			services[nametab_add(&names, di->service)] = di;
+	nservices = names.count;
+
+	/* Anything changing since we started looking stops the paths,
+	 * and what we found the scripts set, being used */
+	if (nservices)
+		found = xmalloc(sizeof(*found) * nservices);
+	if (since) {
+		for (i = 0; init_dirs[i]; i++)
+			if (stat(init_dirs[i], &st) == 0 && S_ISDIR(st.st_mode))
+				dirs |= 1U << i;
+	}
+	for (i = 0; i < nservices; i++)
+		found[i] = since ? librc_service_find(names.names[i]) : NULL;
+
+	/* Now intern our types and anything else we depend on.
+	 * Again, only the first type of a given name can be found */
+	for (i = 0; i < nservices; i++)
+		TAILQ_FOREACH(dt, &services[i]->depends, entries) {
+			if (get_deptype(services[i], dt->type) != dt)
+				continue;
+			nametab_add(&types, dt->type);
+			TAILQ_FOREACH(s, dt->services, entries) {
+				nametab_add(&names, s->value);
+				nedges++;
+			}
+		}
+
+	nadj = (uint64_t)types.count * (nservices + 1);
+	for (nhash = 16; nhash <= names.count * 2; nhash *= 2)
+		;
+	size = sizeof(*h) + sizeof(uint32_t) *
+	    (names.count + types.count + nadj + nedges + nhash + nservices);
+	l = 1;
+	for (i = 0; i < names.count; i++)
+		l += strlen(names.names[i]) + 1;
+	for (i = 0; i < types.count; i++)
+		l += strlen(types.names[i]) + 1;
+	for (i = 0; i < nservices; i++)
+		if (found[i])
+			l += strlen(found[i]) + 1;
+
+	deptree = xmalloc(sizeof(*deptree));
+	deptree->mapped = false;
+	deptree->size = size + l;
+	deptree->data = xmalloc(deptree->size);
+	memset(deptree->data, 0, deptree->size);
+
+	h = (DEPTREE_HEADER *)deptree->data;
+	memcpy(h->magic, DEPTREE_MAGIC, sizeof(h->magic));
+	h->version = DEPTREE_VERSION;
+	h->size = deptree->size;
+	h->nservices = nservices;
+	h->nnames = names.count;
+	h->ntypes = types.count;
+	h->nedges = nedges;
+	h->nhash = nhash;
+	h->names = sizeof(*h);
+	h->types = h->names + sizeof(uint32_t) * names.count;
+	h->adj = h->types + sizeof(uint32_t) * types.count;
+	h->edges = h->adj + sizeof(uint32_t) * nadj;
+	h->hash = h->edges + sizeof(uint32_t) * nedges;
+	h->paths = h->hash + sizeof(uint32_t) * nhash;
+	h->strings = h->paths + sizeof(uint32_t) * nservices;
+	h->strings_size = l;
+	h->paths_dirs = dirs;
+	h->paths_time = since;
+
+	/* The string table starts with an empty string */
+	p = deptree->data + h->strings + 1;
+	for (i = 0; i < names.count; i++) {
+		((uint32_t *)(deptree->data + h->names))[i] =
+		    p - (deptree->data + h->strings);
+		l = strlen(names.names[i]) + 1;
+		memcpy(p, names.names[i], l);
+		p += l;
+	}
+	for (i = 0; i < types.count; i++) {
+		((uint32_t *)(deptree->data + h->types))[i] =
+		    p - (deptree->data + h->strings);
+		l = strlen(types.names[i]) + 1;
+		memcpy(p, types.names[i], l);
+		p += l;
+	}
+	depsize = p - (deptree->data + h->strings);
+	for (i = 0; i < nservices; i++) {
+		if (!found[i])
+			continue;
+		((uint32_t *)(deptree->data + h->paths))[i] =
+		    p - (deptree->data + h->strings);
+		l = strlen(found[i]) + 1;
+		memcpy(p, found[i], l);
+		p += l;
+		free(found[i]);
+	}
+	free(found);
+
+	/* Count the edges of each row, then turn that into offsets */
+	adj = (uint32_t *)(deptree->data + h->adj);
+	edges = (uint32_t *)(deptree->data + h->edges);
+	for (i = 0; i < nservices; i++)
+		TAILQ_FOREACH(dt, &services[i]->depends, entries) {
+			if (get_deptype(services[i], dt->type) != dt)
+				continue;
+			t = nametab_find(&types, dt->type, NULL);
+			TAILQ_FOREACH(s, dt->services, entries)
+				adj[t * (nservices + 1) + i + 1]++;
+		}
+	for (j = 1; j < nadj; j++)
+		adj[j] += adj[j - 1];
+
+	if (nadj) {
+		cursor = xmalloc(sizeof(*cursor) * nadj);
+		memcpy(cursor, adj, sizeof(*cursor) * nadj);
+		for (i = 0; i < nservices; i++)
+			TAILQ_FOREACH(dt, &services[i]->depends, entries) {
+				if (get_deptype(services[i], dt->type) != dt)
+					continue;
+				t = nametab_find(&types, dt->type, NULL);
+				TAILQ_FOREACH(s, dt->services, entries)
+					edges[cursor[t * (nservices + 1) + i]++] =
+					    nametab_find(&names, s->value, NULL);
+			}
+		free(cursor);
+	}
+
+	hash = (uint32_t *)(deptree->data + h->hash);
+	for (id = 0; id < names.count; id++) {
+		j = str_hash(names.names[id]) & (nhash - 1);
+		while (hash[j])
+			j = (j + 1) & (nhash - 1);
+		hash[j] = id + 1;
+	}
+
+	/* The names, types and edges and the strings they use */
+	h->digest = fnv_hash(2166136261U, deptree->data + h->names,
+	    h->hash - h->names);
+	h->digest = fnv_hash(h->digest, deptree->data + h->strings, depsize);
+
+	free(services);
+	nametab_free(&names);
+	nametab_free(&types);
+	deptree_init(deptree);
+	return deptree;
+}
+
+/* Map a binary deptree read only */
+static RC_DEPTREE *
+deptree_map(int fd)
+{
+	RC_DEPTREE *deptree;
+	struct stat st;
+	void *data;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DEPTREE_HEADER))
+		return NULL;
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	deptree = xmalloc(sizeof(*deptree));
+	deptree->data = data;
+	deptree->size = st.st_size;
+	deptree->mapped = true;
+	if (!deptree_init(deptree)) {
+		rc_deptree_free(deptree);
+		errno = EINVAL;
+		return NULL;
+	}
+	return deptree;
+}
+
+/* Save the image to a temporary file and rename it over the old one
+ * so that nobody ever maps a partially written deptree. */
+static bool
+deptree_save(const RC_DEPTREE *deptree, const char *file)
+{
+	char tmp[PATH_MAX];
+	const char *p = deptree->data;
+	size_t left = deptree->size;
+	ssize_t r;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+	if ((fd = mkstemp(tmp)) == -1)
+		return false;
+	while (left) {
+		r = write(fd, p, left);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += r;
+		left -= r;
+	}
+	if (left || fchmod(fd, 0644) != 0 || close(fd) != 0) {
+		if (left)
+			close(fd);
+		unlink(tmp);
+		return false;
+	}
+	if (rename(tmp, file) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/* rc_deptree_update notes where it found each service, which holds
+ * while none of the init directories have changed since. We check them
+ * the first time we're asked, then keep the deptree mapped. */
+static RC_DEPTREE *paths_tree;
+static bool paths_checked;
+
+static RC_DEPTREE *
+paths_load(void)
+{
+	RC_DEPTREE *deptree;
+	struct stat st;
+	uint32_t dirs = 0;
+	size_t i;
+	int fd;
+
+	if ((fd = open(RC_DEPTREE_BIN, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	deptree = deptree_map(fd);
+	close(fd);
+	if (!deptree)
+		return NULL;
+	if (deptree->header->paths_time) {
+		for (i = 0; init_dirs[i]; i++) {
+			if (stat(init_dirs[i], &st) != 0 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+			dirs |= 1U << i;
+			if (st.st_mtime >= deptree->header->paths_time)
+				break;
+		}
+		if (!init_dirs[i] && dirs == deptree->header->paths_dirs)
+			return deptree;
+	}
+	rc_deptree_free(deptree);
+	return NULL;
+}
+
+const char *
+librc_deptree_path(const char *service)
+{
+	uint32_t id;
+
+	if (!paths_checked) {
+		paths_tree = paths_load();
+		paths_checked = true;
+	}
+	if (!paths_tree ||
+	    (id = get_service(paths_tree, service)) == DEPTREE_NONE ||
+	    !paths_tree->paths[id])
+		return NULL;
+	return paths_tree->strings + paths_tree->paths[id];
+}
+
+/* rc_deptree_update also notes what each script sets for
+ * rc_service_description and rc_service_extra_commands. That holds for
+ * the script at path if it's the one it found, and neither it nor
+ * anything sourced with it has changed since. */
+static bool
+changed_since(const char *file, time_t since)
+{
+	struct stat st;
+
+	return stat(file, &st) == 0 && st.st_mtime >= since;
+}
+
+const RC_DEPTREE *
+librc_deptree_meta(const char *service, const char *path)
+{
+	const char *found = librc_deptree_path(service);
+	const char *base = basename_c(path);
+	const char *p;
+	char conf[PATH_MAX];
+	int dl = (int)(base - path);
+	time_t since;
+
+	if (!found || strcmp(found, path) != 0 || !exists(path))
+		return NULL;
+	since = paths_tree->header->paths_time;
+	if (changed_since(path, since) || changed_since(RC_CONF, since))
+		return NULL;
+
+	/* Match how gendepends.sh finds conf.d files */
+	snprintf(conf, sizeof(conf), "%.*s../conf.d/%s", dl, path, base);
+	if (changed_since(conf, since))
+		return NULL;
+	p = strchr(base, '.');
+	if (p && p != base) {
+		snprintf(conf, sizeof(conf), "%.*s../conf.d/%.*s",
+		    dl, path, (int)(p - base), base);
+		if (changed_since(conf, since))
+			return NULL;
+	}
+	return paths_tree;
+}
+
 RC_DEPTREE *
 rc_deptree_load(void) {
+	RC_DEPTREE *deptree = NULL;
+	struct stat st, bst;
+	int fd;
+
+	/* Use the binary cache if it's as new as the text one */
+	if (stat(RC_DEPTREE_CACHE, &st) == 0 &&
+	    (fd = open(RC_DEPTREE_BIN, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		if (fstat(fd, &bst) == 0 && bst.st_mtime >= st.st_mtime)
+			deptree = deptree_map(fd);
+		close(fd);
+		if (deptree)
+			return deptree;
+	}
 	return rc_deptree_load_file(RC_DEPTREE_CACHE);
 }
 librc_hidden_def(rc_deptree_load)
 
+static void break_cycles(const DEPINDEX *);
+
 RC_DEPTREE *
 rc_deptree_load_file(const char *deptree_file)
 {
 	FILE *fp;
 	RC_DEPTREE *deptree;
+	RC_DEPLIST *deplist;
 	RC_DEPINFO *depinfo = NULL;
 	RC_DEPTYPE *deptype = NULL;
+	DEPINDEX index;
 	char *line = NULL;
 	size_t len = 0;
 	char *type;
 	char *p;
 	char *e;
 	int i;
+	char magic[sizeof(DEPTREE_MAGIC) - 1];
 
 	if (!(fp = fopen(deptree_file, "r")))
 		return NULL;
 
-	deptree = xmalloc(sizeof(*deptree));
-	TAILQ_INIT(deptree);
+	/* We can be handed either format */
+	if (fread(magic, sizeof(magic), 1, fp) == 1 &&
+	    memcmp(magic, DEPTREE_MAGIC, sizeof(magic)) == 0)
+	{
+		deptree = deptree_map(fileno(fp));
+		fclose(fp);
+		return deptree;
+	}
+	rewind(fp);
+
+	deplist = xmalloc(sizeof(*deplist));
+	TAILQ_INIT(deplist);
 	while ((rc_getline(&line, &len, fp)))
 	{
 		p = line;
@@ -136,7 +921,9 @@ rc_deptree_load_file(const char *deptree_file)
 		e = strsep(&p, "_");
 		if (!e || sscanf(e, "%d", &i) != 1)
 			continue;
-		if (!(type = strsep(&p, "_=")))
+		/* Types can have an underscore in them, the index can't */
+		type = strsep(&p, "=");
+		if (!type || !p)
 			continue;
 		if (strcmp(type, "service") == 0) {
 			/* Sanity */
@@ -146,13 +933,13 @@ rc_deptree_load_file(const char *deptree_file)
 			depinfo = xmalloc(sizeof(*depinfo));
 			TAILQ_INIT(&depinfo->depends);
 			depinfo->service = xstrdup(e);
-			TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+			TAILQ_INSERT_TAIL(deplist, depinfo, entries);
 			deptype = NULL;
 			continue;
 		}
-		e = strsep(&p, "=");
-		if (!e || sscanf(e, "%d", &i) != 1)
+		if (!(e = strrchr(type, '_')) || sscanf(e + 1, "%d", &i) != 1)
 			continue;
+		*e = '\0';
 		/* Sanity */
 		e = get_shell_value(p);
 		if (!e || *e == '\0')
@@ -168,10 +955,57 @@ rc_deptree_load_file(const char *deptree_file)
 	fclose(fp);
 	free(line);
 
+	/* A deptree we wrote has no cycles left, but one written by hand
+	 * or by an older version may */
+	memset(&index, 0, sizeof(index));
+	TAILQ_FOREACH(depinfo, deplist, entries)
+		depindex_add(&index, depinfo);
+	break_cycles(&index);
+	depindex_free(&index);
+
+	deptree = deptree_compile(deplist, 0);
+	deplist_free(deplist);
 	return deptree;
 }
 librc_hidden_def(rc_deptree_load_file)
 
+/* While we compile a start plan we resolve against a model of the state
+ * the services will be in when rc gets to the runlevel, instead of their
+ * state now, and note every service whose state we looked at. */
+#define PLAN_STATES (RC_SERVICE_STARTED | RC_SERVICE_STARTING | \
+		     RC_SERVICE_STOPPING | RC_SERVICE_INACTIVE | \
+		     RC_SERVICE_HOTPLUGGED)
+
+typedef struct plan_model
+{
+	/* Services we assume are started, the rest are stopped */
+	const NAMETAB *started;
+	/* Services we looked at, in order, and an index of them */
+	RC_STRINGLIST *seen;
+	NAMETAB seen_index;
+} PLAN_MODEL;
+
+static PLAN_MODEL *plan_model = NULL;
+
+/* Service states to use instead of RC_SVCDIR, if any */
+static const RC_SNAPSHOT *snapshot = NULL;
+
+static RC_SERVICE
+service_state(const char *service)
+{
+	if (!plan_model) {
+		if (snapshot)
+			return rc_snapshot_state(snapshot, service);
+		return rc_service_state(service);
+	}
+	if (nametab_find(&plan_model->seen_index, service, NULL) ==
+	    DEPTREE_NONE)
+		nametab_add(&plan_model->seen_index,
+		    rc_stringlist_add(plan_model->seen, service)->value);
+	return nametab_find(plan_model->started, service, NULL) !=
+	    DEPTREE_NONE ? RC_SERVICE_STARTED : RC_SERVICE_STOPPED;
+}
+
 static bool
 valid_service(const char *runlevel, const char *service, const char *type)
 {
@@ -196,7 +1030,7 @@ valid_service(const char *runlevel, const char *service, const char *type)
 			return true;
 	}
 
-	state = rc_service_state(service);
+	state = service_state(service);
 	if (state & RC_SERVICE_HOTPLUGGED ||
 	    state & RC_SERVICE_STARTED)
 		return true;
@@ -206,19 +1040,19 @@ valid_service(const char *runlevel, const char *service, const char *type)
 
 static bool
 get_provided1(const char *runlevel, RC_STRINGLIST *providers,
-	      RC_DEPTYPE *deptype, const char *level,
-	      bool hotplugged, RC_SERVICE state)
+	      const RC_DEPTREE *deptree, const uint32_t *edges, uint32_t n,
+	      const char *level, bool hotplugged, RC_SERVICE state)
 {
-	RC_STRING *service;
 	RC_SERVICE st;
 	bool retval = false;
 	bool ok;
 	const char *svc;
+	uint32_t i;
 
-	TAILQ_FOREACH(service, deptype->services, entries) {
+	for (i = 0; i < n; i++) {
 		ok = true;
-		svc = service->value;
-		st = rc_service_state(svc);
+		svc = DT_NAME(deptree, edges[i]);
+		st = service_state(svc);
 
 		if (level)
 			ok = rc_service_in_runlevel(svc, level);
@@ -261,34 +1095,38 @@ get_provided1(const char *runlevel, RC_STRINGLIST *providers,
    provided dependancy can change depending on runlevel state.
    */
 static RC_STRINGLIST *
-get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
+get_provided(const RC_DEPTREE *deptree, uint32_t service,
+	     const char *runlevel, int options)
 {
-	RC_DEPTYPE *dt;
 	RC_STRINGLIST *providers = rc_stringlist_new();
-	RC_STRING *service;
+	const uint32_t *dt;
+	const char *svc;
+	uint32_t i, n;
 
-	dt = get_deptype(depinfo, "providedby");
-	if (!dt)
+	dt = get_edges(deptree, service, deptree->providedby, &n);
+	if (!n)
 		return providers;
 
 	/* If we are stopping then all depends are true, regardless of state.
 	   This is especially true for net services as they could force a restart
 	   of the local dns resolver which may depend on net. */
 	if (options & RC_DEP_STOP) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			rc_stringlist_add(providers, service->value);
+		for (i = 0; i < n; i++)
+			rc_stringlist_add(providers, DT_NAME(deptree, dt[i]));
 		return providers;
 	}
 
 	/* If we're strict or starting, then only use what we have in our
 	 * runlevel and bootlevel. If we starting then check hotplugged too. */
 	if (options & RC_DEP_STRICT || options & RC_DEP_START) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			if (rc_service_in_runlevel(service->value, runlevel) ||
-			    rc_service_in_runlevel(service->value, bootlevel) ||
+		for (i = 0; i < n; i++) {
+			svc = DT_NAME(deptree, dt[i]);
+			if (rc_service_in_runlevel(svc, runlevel) ||
+			    rc_service_in_runlevel(svc, bootlevel) ||
 			    (options & RC_DEP_START &&
-			     rc_service_state(service->value) & RC_SERVICE_HOTPLUGGED))
-				rc_stringlist_add(providers, service->value);
+			     service_state(svc) & RC_SERVICE_HOTPLUGGED))
+				rc_stringlist_add(providers, svc);
+		}
 		if (TAILQ_FIRST(providers))
 			return providers;
 	}
@@ -313,112 +1151,159 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 	}
 
 	/* Anything running has to come first */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTED))
+	if (get_provided1(runlevel, providers, deptree, dt, n, runlevel, false, RC_SERVICE_STARTED))
 	{ DO }
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STARTED))
+	if (get_provided1(runlevel, providers, deptree, dt, n, NULL, true, RC_SERVICE_STARTED))
 	{ DO }
 	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTED))
+	    get_provided1(runlevel, providers, deptree, dt, n, bootlevel, false, RC_SERVICE_STARTED))
 	{ DO }
-	if (get_provided1(runlevel, providers, dt, NULL, false, RC_SERVICE_STARTED))
+	if (get_provided1(runlevel, providers, deptree, dt, n, NULL, false, RC_SERVICE_STARTED))
 	{ DO }
 
 	/* Check starting services */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STARTING))
+	if (get_provided1(runlevel, providers, deptree, dt, n, runlevel, false, RC_SERVICE_STARTING))
 		return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STARTING))
+	if (get_provided1(runlevel, providers, deptree, dt, n, NULL, true, RC_SERVICE_STARTING))
 		return providers;
 	if (bootlevel && strcmp(runlevel, bootlevel) != 0 &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STARTING))
+	    get_provided1(runlevel, providers, deptree, dt, n, bootlevel, false, RC_SERVICE_STARTING))
 	    return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, false, RC_SERVICE_STARTING))
+	if (get_provided1(runlevel, providers, deptree, dt, n, NULL, false, RC_SERVICE_STARTING))
 		return providers;
 
 	/* Nothing started then. OK, lets get the stopped services */
-	if (get_provided1(runlevel, providers, dt, runlevel, false, RC_SERVICE_STOPPED))
+	if (get_provided1(runlevel, providers, deptree, dt, n, runlevel, false, RC_SERVICE_STOPPED))
 		return providers;
-	if (get_provided1(runlevel, providers, dt, NULL, true, RC_SERVICE_STOPPED))
+	if (get_provided1(runlevel, providers, deptree, dt, n, NULL, true, RC_SERVICE_STOPPED))
 	{ DO }
 	if (bootlevel && (strcmp(runlevel, bootlevel) != 0) &&
-	    get_provided1(runlevel, providers, dt, bootlevel, false, RC_SERVICE_STOPPED))
+	    get_provided1(runlevel, providers, deptree, dt, n, bootlevel, false, RC_SERVICE_STOPPED))
 		return providers;
 
 	/* Still nothing? OK, list our first provided service. */
-	service = TAILQ_FIRST(dt->services);
-	if (service != NULL)
-		rc_stringlist_add(providers, service->value);
+	rc_stringlist_add(providers, DT_NAME(deptree, dt[0]));
 
 	return providers;
 }
 
-static void
+/* Edges followed while visiting services for rc_deptree_closure, with
+ * the position of the type which followed them */
+typedef struct reached
+{
+	uint32_t *from;
+	uint32_t *to;
+	unsigned char *type;
+	size_t count;
+	size_t size;
+} REACHED;
+
+static void
+reached_add(REACHED *reached, uint32_t from, uint32_t to, uint32_t type)
+{
+	if (!reached)
+		return;
+	if (reached->count == reached->size) {
+		reached->size = reached->size ? reached->size * 2 : 64;
+		reached->from = xrealloc(reached->from,
+		    sizeof(*reached->from) * reached->size);
+		reached->to = xrealloc(reached->to,
+		    sizeof(*reached->to) * reached->size);
+		reached->type = xrealloc(reached->type,
+		    sizeof(*reached->type) * reached->size);
+	}
+	reached->from[reached->count] = from;
+	reached->to[reached->count] = to;
+	reached->type[reached->count++] = type;
+}
+
+static void
 visit_service(const RC_DEPTREE *deptree,
 	      const RC_STRINGLIST *types,
+	      const uint32_t *typeids,
 	      RC_STRINGLIST *sorted,
-	      RC_STRINGLIST *visited,
-	      const RC_DEPINFO *depinfo,
-	      const char *runlevel, int options)
+	      unsigned char *visited,
+	      uint32_t depinfo,
+	      const char *runlevel, int options,
+	      REACHED *reached)
 {
 	RC_STRING *type;
-	RC_STRING *service;
-	RC_DEPTYPE *dt;
-	RC_DEPINFO *di;
+	const uint32_t *dt;
+	uint32_t di;
 	RC_STRINGLIST *provided;
 	RC_STRING *p;
 	const char *svcname;
+	const char *service;
+	uint32_t i, n, t = 0;
 
 	/* Check if we have already visited this service or not */
-	TAILQ_FOREACH(type, visited, entries)
-		if (strcmp(type->value, depinfo->service) == 0)
-			return;
+	if (BIT_ISSET(visited, depinfo))
+		return;
 	/* Add ourselves as a visited service */
-	rc_stringlist_add(visited, depinfo->service);
+	BIT_SET(visited, depinfo);
 
 	TAILQ_FOREACH(type, types, entries)
 	{
-		if (!(dt = get_deptype(depinfo, type->value)))
-			continue;
+		dt = get_edges(deptree, depinfo, typeids[t], &n);
 
-		TAILQ_FOREACH(service, dt->services, entries) {
+		for (i = 0; i < n; i++) {
+			service = DT_NAME(deptree, dt[i]);
 			if (!(options & RC_DEP_TRACE) ||
 			    strcmp(type->value, "iprovide") == 0)
 			{
-				rc_stringlist_add(sorted, service->value);
+				if (dt[i] < deptree->header->nservices)
+					reached_add(reached, depinfo, dt[i], t);
+				rc_stringlist_add(sorted, service);
 				continue;
 			}
 
-			if (!(di = get_depinfo(deptree, service->value)))
+			if ((di = dt[i]) >= deptree->header->nservices)
 				continue;
-			provided = get_provided(di, runlevel, options);
+			provided = get_provided(deptree, di, runlevel, options);
 
 			if (TAILQ_FIRST(provided)) {
 				TAILQ_FOREACH(p, provided, entries) {
-					di = get_depinfo(deptree, p->value);
-					if (di && valid_service(runlevel, di->service, type->value))
-						visit_service(deptree, types, sorted, visited, di,
-							      runlevel, options | RC_DEP_TRACE);
+					di = get_service(deptree, p->value);
+					if (di != DEPTREE_NONE &&
+					    valid_service(runlevel, p->value, type->value))
+					{
+						reached_add(reached, depinfo, di, t);
+						visit_service(deptree, types, typeids,
+							      sorted, visited, di,
+							      runlevel, options | RC_DEP_TRACE,
+							      reached);
+					}
 				}
 			}
-			else if (di && valid_service(runlevel, service->value, type->value))
-				visit_service(deptree, types, sorted, visited, di,
-					      runlevel, options | RC_DEP_TRACE);
+			else if (valid_service(runlevel, service, type->value)) {
+				reached_add(reached, depinfo, di, t);
+				visit_service(deptree, types, typeids,
+					      sorted, visited, di,
+					      runlevel, options | RC_DEP_TRACE,
+					      reached);
+			}
 
 			rc_stringlist_free(provided);
 		}
+		t++;
 	}
 
 	/* Now visit the stuff we provide for */
-	if (options & RC_DEP_TRACE &&
-	    (dt = get_deptype(depinfo, "iprovide")))
-	{
-		TAILQ_FOREACH(service, dt->services, entries) {
-			if (!(di = get_depinfo(deptree, service->value)))
+	if (options & RC_DEP_TRACE) {
+		dt = get_edges(deptree, depinfo, deptree->iprovide, &n);
+		for (i = 0; i < n; i++) {
+			if ((di = dt[i]) >= deptree->header->nservices)
 				continue;
-			provided = get_provided(di, runlevel, options);
+			provided = get_provided(deptree, di, runlevel, options);
 			TAILQ_FOREACH(p, provided, entries)
-				if (strcmp(p->value, depinfo->service) == 0) {
-					visit_service(deptree, types, sorted, visited, di,
-						       runlevel, options | RC_DEP_TRACE);
+				if (strcmp(p->value, DT_NAME(deptree, depinfo)) == 0) {
+					/* We reach it as strongly as we
+					 * were reached ourselves */
+					reached_add(reached, depinfo, di, 0);
+					visit_service(deptree, types, typeids,
+						      sorted, visited, di,
+						      runlevel, options | RC_DEP_TRACE,
+						      reached);
 					break;
 				}
 			rc_stringlist_free(provided);
@@ -428,9 +1313,10 @@ visit_service(const RC_DEPTREE *deptree,
 	/* We've visited everything we need, so add ourselves unless we
 	   are also the service calling us or we are provided by something */
 	svcname = getenv("RC_SVCNAME");
-	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
-		if (!get_deptype(depinfo, "providedby"))
-			rc_stringlist_add(sorted, depinfo->service);
+	if (!svcname || strcmp(svcname, DT_NAME(deptree, depinfo)) != 0) {
+		get_edges(deptree, depinfo, deptree->providedby, &n);
+		if (!n)
+			rc_stringlist_add(sorted, DT_NAME(deptree, depinfo));
 	}
 }
 
@@ -438,22 +1324,21 @@ RC_STRINGLIST *
 rc_deptree_depend(const RC_DEPTREE *deptree,
 		  const char *service, const char *type)
 {
-	RC_DEPINFO *di;
-	RC_DEPTYPE *dt;
 	RC_STRINGLIST *svcs;
-	RC_STRING *svc;
+	const uint32_t *dt = NULL;
+	uint32_t di, i, n = 0;
 
 	svcs = rc_stringlist_new();
-	if (!(di = get_depinfo(deptree, service)) ||
-	    !(dt = get_deptype(di, type)))
-	{
+	if ((di = get_service(deptree, service)) != DEPTREE_NONE)
+		dt = get_edges(deptree, di, get_type(deptree, type), &n);
+	if (!n) {
 		errno = ENOENT;
 		return svcs;
 	}
 
 	/* For consistency, we copy the array */
-	TAILQ_FOREACH(svc, dt->services, entries)
-		rc_stringlist_add(svcs, svc->value);
+	for (i = 0; i < n; i++)
+		rc_stringlist_add(svcs, DT_NAME(deptree, dt[i]));
 	return svcs;
 }
 librc_hidden_def(rc_deptree_depend)
@@ -465,27 +1350,200 @@ rc_deptree_depends(const RC_DEPTREE *deptree,
 		   const char *runlevel, int options)
 {
 	RC_STRINGLIST *sorted = rc_stringlist_new();
-	RC_STRINGLIST *visited = rc_stringlist_new();
-	RC_DEPINFO *di;
+	unsigned char *visited = NULL;
+	uint32_t *typeids = NULL;
 	const RC_STRING *service;
+	uint32_t di, n = 0;
+	size_t l;
 
 	bootlevel = getenv("RC_BOOTLEVEL");
 	if (!bootlevel)
 		bootlevel = RC_LEVEL_BOOT;
+	if (types) {
+		TAILQ_FOREACH(service, types, entries)
+			n++;
+		typeids = xmalloc(sizeof(*typeids) * (n + 1));
+		n = 0;
+		TAILQ_FOREACH(service, types, entries)
+			typeids[n++] = get_type(deptree, service->value);
+		l = deptree->header->nservices / CHAR_BIT + 1;
+		visited = xmalloc(l);
+		memset(visited, 0, l);
+	}
+	librc_runlevel_hold(true);
 	TAILQ_FOREACH(service, services, entries) {
-		if (!(di = get_depinfo(deptree, service->value))) {
+		if ((di = get_service(deptree, service->value)) == DEPTREE_NONE) {
 			errno = ENOENT;
 			continue;
 		}
 		if (types)
-			visit_service(deptree, types, sorted, visited,
-				      di, runlevel, options);
+			visit_service(deptree, types, typeids, sorted, visited,
+				      di, runlevel, options, NULL);
 	}
-	rc_stringlist_free(visited);
+	librc_runlevel_hold(false);
+	free(typeids);
+	free(visited);
 	return sorted;
 }
 librc_hidden_def(rc_deptree_depends)
 
+RC_STRINGLIST *
+rc_deptree_depends_snapshot(const RC_DEPTREE *deptree,
+			    const RC_STRINGLIST *types,
+			    const RC_STRINGLIST *services,
+			    const char *runlevel, int options,
+			    const RC_SNAPSHOT *snap)
+{
+	const RC_SNAPSHOT *old = snapshot;
+	RC_STRINGLIST *sorted;
+
+	snapshot = snap;
+	sorted = rc_deptree_depends(deptree, types, services, runlevel,
+	    options);
+	snapshot = old;
+	return sorted;
+}
+librc_hidden_def(rc_deptree_depends_snapshot)
+
+/* A service is in the closure of the first k types when a path of those
+ * types reaches it, so we walk the graph once following all the types
+ * and then label each service with the least k that reaches it. */
+RC_DEPENDLIST *
+rc_deptree_closure(const RC_DEPTREE *deptree,
+		   const RC_STRINGLIST *types,
+		   const RC_STRINGLIST *services,
+		   const char *runlevel, int options)
+{
+	RC_DEPENDLIST *closure = xmalloc(sizeof(*closure));
+	RC_DEPEND *dep;
+	RC_STRINGLIST *sorted = rc_stringlist_new();
+	REACHED reached;
+	unsigned char *visited;
+	uint32_t *typeids, *level, *first, *to, *queue;
+	unsigned char *type;
+	const RC_STRING *s;
+	uint32_t nservices = deptree->header->nservices;
+	uint32_t di, k, n = 0, head, tail, i;
+	size_t e, l;
+
+	TAILQ_INIT(closure);
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+	TAILQ_FOREACH(s, types, entries)
+		n++;
+	if (!n || n > UCHAR_MAX) {
+		rc_stringlist_free(sorted);
+		errno = EINVAL;
+		return closure;
+	}
+	typeids = xmalloc(sizeof(*typeids) * n);
+	n = 0;
+	TAILQ_FOREACH(s, types, entries)
+		typeids[n++] = get_type(deptree, s->value);
+	l = nservices / CHAR_BIT + 1;
+	visited = xmalloc(l);
+	memset(visited, 0, l);
+	level = xmalloc(sizeof(*level) * (nservices + 1));
+	for (di = 0; di < nservices; di++)
+		level[di] = n;
+	memset(&reached, 0, sizeof(reached));
+
+	librc_runlevel_hold(true);
+	TAILQ_FOREACH(s, services, entries) {
+		if ((di = get_service(deptree, s->value)) == DEPTREE_NONE) {
+			errno = ENOENT;
+			continue;
+		}
+		level[di] = 0;
+		visit_service(deptree, types, typeids, sorted, visited, di,
+			      runlevel, options | RC_DEP_TRACE, &reached);
+	}
+	librc_runlevel_hold(false);
+
+	/* Group the edges we followed by where they came from */
+	first = xmalloc(sizeof(*first) * (nservices + 1));
+	memset(first, 0, sizeof(*first) * (nservices + 1));
+	for (e = 0; e < reached.count; e++)
+		first[reached.from[e] + 1]++;
+	for (di = 0; di < nservices; di++)
+		first[di + 1] += first[di];
+	to = xmalloc(sizeof(*to) * (reached.count + 1));
+	type = xmalloc(reached.count + 1);
+	queue = xmalloc(sizeof(*queue) * (nservices + 1));
+	memset(queue, 0, sizeof(*queue) * (nservices + 1));
+	for (e = 0; e < reached.count; e++) {
+		i = first[reached.from[e]] + queue[reached.from[e]]++;
+		to[i] = reached.to[e];
+		type[i] = reached.type[e];
+	}
+
+	/* Spread each level from what the stronger ones reached */
+	for (k = 0; k < n; k++) {
+		head = tail = 0;
+		for (di = 0; di < nservices; di++)
+			if (level[di] <= k)
+				queue[tail++] = di;
+		while (head < tail) {
+			di = queue[head++];
+			for (i = first[di]; i < first[di + 1]; i++)
+				if (type[i] <= k && level[to[i]] > k) {
+					level[to[i]] = k;
+					queue[tail++] = to[i];
+				}
+		}
+	}
+
+	TAILQ_FOREACH(s, sorted, entries) {
+		dep = xmalloc(sizeof(*dep));
+		dep->service = xstrdup(s->value);
+		di = get_service(deptree, s->value);
+		dep->type = di != DEPTREE_NONE && level[di] < n ?
+		    (int)level[di] : (int)n - 1;
+		TAILQ_INSERT_TAIL(closure, dep, entries);
+	}
+
+	free(queue);
+	free(type);
+	free(to);
+	free(first);
+	free(reached.from);
+	free(reached.to);
+	free(reached.type);
+	free(level);
+	free(visited);
+	free(typeids);
+	rc_stringlist_free(sorted);
+	return closure;
+}
+librc_hidden_def(rc_deptree_closure)
+
+void
+rc_dependlist_free(RC_DEPENDLIST *list)
+{
+	RC_DEPEND *d1, *d2;
+
+	if (!list)
+		return;
+	d1 = TAILQ_FIRST(list);
+	while (d1) {
+		d2 = TAILQ_NEXT(d1, entries);
+		free(d1->service);
+		free(d1);
+		d1 = d2;
+	}
+	free(list);
+}
+librc_hidden_def(rc_dependlist_free)
+
+static RC_STRINGLIST *
+services_in_state(RC_SERVICE state)
+{
+	if (snapshot)
+		return rc_services_in_state_snapshot(snapshot, state);
+	return rc_services_in_state(state);
+}
+
 RC_STRINGLIST *
 rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 {
@@ -502,11 +1560,11 @@ rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 	if (strcmp(runlevel, RC_LEVEL_SINGLE) == 0 ||
 	    strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0)
 	{
-		list = rc_services_in_state(RC_SERVICE_STARTED);
-		list2 = rc_services_in_state(RC_SERVICE_INACTIVE);
+		list = services_in_state(RC_SERVICE_STARTED);
+		list2 = services_in_state(RC_SERVICE_INACTIVE);
 		TAILQ_CONCAT(list, list2, entries);
 		free(list2);
-		list2 = rc_services_in_state(RC_SERVICE_STARTING);
+		list2 = services_in_state(RC_SERVICE_STARTING);
 		TAILQ_CONCAT(list, list2, entries);
 		free(list2);
 	} else {
@@ -515,7 +1573,7 @@ rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 			list2 = rc_services_in_runlevel(runlevel);
 			TAILQ_CONCAT(list, list2, entries);
 			free(list2);
-			list2 = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+			list2 = services_in_state(RC_SERVICE_HOTPLUGGED);
 			TAILQ_CONCAT(list, list2, entries);
 			free(list2);
 			/* If we're not the boot runlevel then add that too */
@@ -542,76 +1600,182 @@ rc_deptree_order(const RC_DEPTREE *deptree, const char *runlevel, int options)
 }
 librc_hidden_def(rc_deptree_order)
 
+RC_STRINGLIST *
+rc_deptree_order_snapshot(const RC_DEPTREE *deptree, const char *runlevel,
+			  int options, const RC_SNAPSHOT *snap)
+{
+	const RC_SNAPSHOT *old = snapshot;
+	RC_STRINGLIST *services;
+
+	snapshot = snap;
+	services = rc_deptree_order(deptree, runlevel, options);
+	snapshot = old;
+	return services;
+}
+librc_hidden_def(rc_deptree_order_snapshot)
+
+/* Read a regular text file of up to max bytes into a string */
+static char *
+file_read(const char *path, off_t max)
+{
+	FILE *fp;
+	struct stat st;
+	char *text;
+	size_t len;
+
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size > max)
+	{
+		fclose(fp);
+		return NULL;
+	}
+	text = xmalloc(st.st_size + 1);
+	len = fread(text, 1, st.st_size, fp);
+	text[len] = '\0';
+	fclose(fp);
+	/* Text has no NULs, and we could not treat one the way the shell
+	 * would when parsing scripts */
+	if (strlen(text) != len) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+/* Key a file by its inode, mode, size and mtime so we notice any change */
+static void
+stat_key(char *buf, size_t len, const char *path, const struct stat *st)
+{
+	if (st)
+		snprintf(buf, len, "%s %ju:%ju:%o:%jd:%jd.%09ld", path,
+		    (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+		    (unsigned int)st->st_mode, (intmax_t)st->st_size,
+		    (intmax_t)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+	else
+		snprintf(buf, len, "%s -", path);
+}
+
+/* Does the key part of a stat_key still match a file? */
 static bool
-mtime_check(const char *source, const char *target, bool newer,
-	    time_t *rel, char *file)
+stat_match(const char *key, const struct stat *st)
 {
-	struct stat buf;
-	time_t mtime;
-	bool retval = true;
+	char *p;
+
+	if (!st)
+		return strcmp(key, "-") == 0;
+	return strtoumax(key, &p, 10) == (uintmax_t)st->st_dev &&
+	    *p++ == ':' &&
+	    strtoumax(p, &p, 10) == (uintmax_t)st->st_ino && *p++ == ':' &&
+	    strtoul(p, &p, 8) == (unsigned long)st->st_mode && *p++ == ':' &&
+	    strtoimax(p, &p, 10) == (intmax_t)st->st_size && *p++ == ':' &&
+	    strtoimax(p, &p, 10) == (intmax_t)st->st_mtim.tv_sec &&
+	    *p++ == '.' &&
+	    strtol(p, &p, 10) == (long)st->st_mtim.tv_nsec && *p == '\0';
+}
+
+typedef bool (*mtime_fn)(const char *path, const struct stat *st, void *arg);
+
+/* Call fn for a file and, if it's a directory, everything below it,
+ * skipping dot files. name is relative to dfd as for fstatat and path is
+ * a PATH_MAX buffer holding the full name of the file of length len.
+ * We only open directories and stat each file once, relative to its
+ * directory, so a walk costs one syscall per file.
+ * Stops and returns false as soon as fn does. */
+static bool
+mtime_walk(int dfd, const char *name, char *path, size_t len,
+	   mtime_fn fn, void *arg)
+{
+	struct stat st;
 	DIR *dp;
 	struct dirent *d;
-	char path[PATH_MAX];
-	int serrno = errno;
+	int fd;
+	int l;
+	bool retval = true;
 
-	/* We have to exist */
-	if (stat(source, &buf) != 0)
+	if (fstatat(dfd, name, &st, 0) != 0)
+		return true;
+	if (!fn(path, &st, arg))
 		return false;
-	mtime = buf.st_mtime;
-
-	/* If target does not exist, return true to mimic shell test */
-	if (stat(target, &buf) != 0)
+	if (!S_ISDIR(st.st_mode))
 		return true;
 
-	if (newer) {
-		if (mtime < buf.st_mtime) {
-			if (rel == NULL)
-				return false;
-			retval = false;
-		}
-		if (rel != NULL) {
-			if (*rel < buf.st_mtime) {
-				if (file)
-					strlcpy(file, target, PATH_MAX);
-				*rel = buf.st_mtime;
-			}
-		}
-	} else {
-		if (mtime > buf.st_mtime) {
-			if (rel == NULL)
-				return false;
-			retval = false;
-		}
-		if (rel != NULL) {
-			if (*rel > buf.st_mtime) {
-				if (file)
-					strlcpy(file, target, PATH_MAX);
-				*rel = buf.st_mtime;
-			}
-		}
-	}
-
-	/* If not a dir then reset errno */
-	if (!(dp = opendir(target))) {
-		errno = serrno;
-		return retval;
+	if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return true;
+	if (!(dp = fdopendir(fd))) {
+		close(fd);
+		return true;
 	}
-
-	/* Check all the entries in the dir */
-	while ((d = readdir(dp))) {
+	while (retval && (d = readdir(dp))) {
 		if (d->d_name[0] == '.')
 			continue;
-		snprintf(path, sizeof(path), "%s/%s", target, d->d_name);
-		if (!mtime_check(source, path, newer, rel, file)) {
-			retval = false;
-			if (rel == NULL)
-				break;
-		}
+		l = snprintf(path + len, PATH_MAX - len, "/%s", d->d_name);
+		if (l < 0 || len + l >= PATH_MAX)
+			continue;
+		retval = mtime_walk(fd, d->d_name, path, len + l, fn, arg);
 	}
+	path[len] = '\0';
 	closedir(dp);
 	return retval;
 }
 
+typedef struct mtime_cmp
+{
+	time_t mtime;
+	bool newer;
+	time_t *rel;
+	char *file;
+	bool retval;
+} MTIME_CMP;
+
+static bool
+mtime_cmp(const char *path, const struct stat *st, void *arg)
+{
+	MTIME_CMP *cmp = arg;
+
+	if (cmp->newer ? cmp->mtime < st->st_mtime :
+	    cmp->mtime > st->st_mtime)
+	{
+		cmp->retval = false;
+		if (!cmp->rel)
+			return false;
+	}
+	if (cmp->rel && (cmp->newer ? *cmp->rel < st->st_mtime :
+	    *cmp->rel > st->st_mtime))
+	{
+		if (cmp->file)
+			strlcpy(cmp->file, path, PATH_MAX);
+		*cmp->rel = st->st_mtime;
+	}
+	return true;
+}
+
+static bool
+mtime_check(const char *source, const char *target, bool newer,
+	    time_t *rel, char *file)
+{
+	struct stat buf;
+	MTIME_CMP cmp;
+	char path[PATH_MAX];
+	int serrno = errno;
+
+	/* We have to exist */
+	if (stat(source, &buf) != 0)
+		return false;
+
+	/* If target does not exist, we return true to mimic shell test */
+	cmp.mtime = buf.st_mtime;
+	cmp.newer = newer;
+	cmp.rel = rel;
+	cmp.file = file;
+	cmp.retval = true;
+	strlcpy(path, target, sizeof(path));
+	mtime_walk(AT_FDCWD, target, path, strlen(path), mtime_cmp, &cmp);
+	errno = serrno;
+	return cmp.retval;
+}
+
 bool
 rc_newer_than(const char *source, const char *target,
 	      time_t *newest, char *file)
@@ -645,6 +1809,29 @@ static const DEPPAIR deppairs[] = {
 	{ NULL, NULL }
 };
 
+/* What gendepends.sh prints about a script besides its dependencies, so
+ * rc_service_description and rc_service_extra_commands needn't source it.
+ * None of these are services. */
+static const char *const meta_types[] = {
+	"extra_commands",
+	"extra_started_commands",
+	"extra_stopped_commands",
+	"description",
+	"command_description",
+	NULL
+};
+
+static bool
+meta_type(const char *type)
+{
+	size_t i;
+
+	for (i = 0; meta_types[i]; i++)
+		if (strcmp(type, meta_types[i]) == 0)
+			return true;
+	return false;
+}
+
 static const char *const depdirs[] =
 {
 	RC_SVCDIR,
@@ -659,16 +1846,128 @@ static const char *const depdirs[] =
 	RC_SVCDIR "/options",
 	RC_SVCDIR "/exclusive",
 	RC_SVCDIR "/scheduled",
+	RC_SVCDIR "/state",
 	RC_SVCDIR "/tmp",
 	NULL
 };
 
+/* What the deptree is built from, besides any config files */
+static const char *const depend_roots[] = {
+	RC_INITDIR,
+	RC_CONFDIR,
+#ifdef RC_PKG_INITDIR
+	RC_PKG_INITDIR,
+#endif
+#ifdef RC_PKG_CONFDIR
+	RC_PKG_CONFDIR,
+#endif
+#ifdef RC_LOCAL_INITDIR
+	RC_LOCAL_INITDIR,
+#endif
+#ifdef RC_LOCAL_CONFDIR
+	RC_LOCAL_CONFDIR,
+#endif
+	RC_CONF,
+	NULL
+};
+
+/* The stat manifest.
+ * Walking every directory the deptree depends on costs an opendir and a
+ * few stats per file on every openrc-run call. So when we build the
+ * deptree we record the key of every file and directory we would walk,
+ * and checking the deptree is fresh is then just a stat of each of them
+ * relative to an open fd of its directory.
+ * The first line keys the deptree the manifest belongs to by device,
+ * inode and size, as its mtime can be moved forward on clock skew.
+ * Every other line is the stat_key of a file, or of where one was
+ * missing, in the order we walked them so we rarely reopen a directory. */
+static void
+manifest_header(char *buf, size_t len, const struct stat *st)
+{
+	snprintf(buf, len, "deptree %ju:%ju:%jd",
+	    (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+	    (intmax_t)st->st_size);
+}
+
+/* Check the deptree against its manifest.
+ * Returns -1 if the manifest is missing or not for this deptree,
+ * otherwise whether anything in it changed. */
+static int
+manifest_check(const struct stat *deptree, time_t *newest, char *file)
+{
+	struct stat st;
+	char buf[128];
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+	char *text, *line, *next, *key, *p;
+	const char *base;
+	int dfd = -1;
+	int retval = -1;
+	bool ok;
+
+	/* Read it in one go, it's read far more often than written */
+	if (!(text = file_read(RC_DEPMANIFEST, FILE_MAX_SIZE)))
+		return -1;
+
+	manifest_header(buf, sizeof(buf), deptree);
+	line = text;
+	if ((next = strchr(line, '\n')))
+		*next++ = '\0';
+	if (!next || strcmp(line, buf) != 0)
+		goto out;
+
+	retval = 0;
+	*dir = '\0';
+	for (line = next; line && *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		if (!(key = strrchr(line, ' ')))
+			continue;
+		*key++ = '\0';
+
+		/* Keep each directory open while we stat its files */
+		if ((p = strrchr(line, '/'))) {
+			snprintf(path, sizeof(path), "%.*s",
+			    p == line ? 1 : (int)(p - line), line);
+			base = p + 1;
+		} else {
+			strlcpy(path, ".", sizeof(path));
+			base = line;
+		}
+		if (strcmp(path, dir) != 0) {
+			strlcpy(dir, path, sizeof(dir));
+			if (dfd != -1)
+				close(dfd);
+			dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+
+		ok = dfd != -1 && fstatat(dfd, base, &st, 0) == 0;
+		if (ok && newest && *newest < st.st_mtime) {
+			if (file)
+				strlcpy(file, line, PATH_MAX);
+			*newest = st.st_mtime;
+		}
+		if (!stat_match(key, ok ? &st : NULL)) {
+			retval = 1;
+			if (!newest)
+				break;
+		}
+	}
+
+out:
+	if (dfd != -1)
+		close(dfd);
+	free(text);
+	return retval;
+}
+
 bool
 rc_deptree_update_needed(time_t *newest, char *file)
 {
 	bool newer = false;
 	RC_STRINGLIST *config;
 	RC_STRING *s;
+	struct stat st;
 	int i;
 
 	/* Create base directories if needed */
@@ -678,30 +1977,15 @@ rc_deptree_update_needed(time_t *newest, char *file)
 
 	/* Quick test to see if anything we use has changed and we have
 	 * data in our deptree */
-	if (!existss(RC_DEPTREE_CACHE))
-		return true;
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_INITDIR, newest, file))
-		return true;
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_CONFDIR, newest, file))
-		return true;
-#ifdef RC_PKG_INITDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_PKG_INITDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_PKG_CONFDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_PKG_CONFDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_LOCAL_INITDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_LOCAL_INITDIR, newest, file))
-		return true;
-#endif
-#ifdef RC_LOCAL_CONFDIR
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_LOCAL_CONFDIR, newest, file))
-		return true;
-#endif
-	if (!rc_newer_than(RC_DEPTREE_CACHE, RC_CONF, newest, file))
+	if (stat(RC_DEPTREE_CACHE, &st) != 0)
 		return true;
+	if ((i = manifest_check(&st, newest, file)) != -1)
+		return i == 1;
+
+	for (i = 0; depend_roots[i]; i++)
+		if (!rc_newer_than(RC_DEPTREE_CACHE, depend_roots[i],
+			newest, file))
+			return true;
 
 	/* Some init scripts dependencies change depending on config files
 	 * outside of baselayout, like syslog-ng, so we check those too. */
@@ -717,139 +2001,2321 @@ rc_deptree_update_needed(time_t *newest, char *file)
 }
 librc_hidden_def(rc_deptree_update_needed)
 
-/* This is a 7 phase operation
-   Phase 1 is a shell script which loads each init script and config in turn
-   and echos their dependency info to stdout
-   Phase 2 takes that and populates a depinfo object with that data
-   Phase 3 adds any provided services to the depinfo object
-   Phase 4 scans that depinfo object and puts in backlinks
-   Phase 5 removes broken before dependencies
-   Phase 6 looks for duplicate services indicating a real and virtual service
-   with the same names
-   Phase 7 saves the depinfo object to disk
-   */
-bool
-rc_deptree_update(void)
+/* Per script dependency cache.
+ * gendepends.sh announces each script by its path before looking at it, so
+ * we can save what it printed for that script under RC_DEPCACHE, keyed by
+ * the inode, mode, size and mtime of the script, its conf.d files and any
+ * config files it lists. Scripts which glob, such as local with after *,
+ * are keyed by their directory too, as what they print changes when a
+ * script is added or removed. Scripts with a fresh fragment are announced as
+ * cached instead of being sourced and we read the fragment back in.
+ * Fragment files start with a "path key" line per file we depend on,
+ * followed by the output of gendepends.sh for the script. As service names
+ * cannot contain a slash, no output line can start with one. */
+static void
+depcache_key(RC_STRINGLIST *keys, const char *path)
 {
-	FILE *fp;
-	RC_DEPTREE *deptree, *providers;
-	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
-	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
-	RC_STRINGLIST *config, *dupes, *types, *sorted, *visited;
-	RC_STRING *s, *s2, *s2_np, *s3, *s4;
-	char *line = NULL;
-	size_t len = 0;
-	char *depend, *depends, *service, *type, *nosys, *onosys;
-	size_t i, k, l;
-	bool retval = true;
-	const char *sys = rc_sys();
-	struct utsname uts;
-	int serrno;
+	struct stat st;
+	char buf[PATH_MAX + 128];
 
-	/* Some init scripts need RC_LIBEXECDIR to source stuff
-	   Ideally we should be setting our full env instead */
-	if (!getenv("RC_LIBEXECDIR"))
-		setenv("RC_LIBEXECDIR", RC_LIBEXECDIR, 0);
+	stat_key(buf, sizeof(buf), path, stat(path, &st) == 0 ? &st : NULL);
+	rc_stringlist_add(keys, buf);
+}
 
-	if (uname(&uts) == 0)
-		setenv("RC_UNAME", uts.sysname, 1);
-	/* Phase 1 - source all init scripts and print dependencies */
-	if (!(fp = popen(GENDEP, "r")))
-		return false;
+/* The conf.d files of a script, matching how gendepends.sh finds them */
+static void
+depcache_confd(char paths[2][PATH_MAX], const char *dir, const char *service)
+{
+	const char *p = strchr(service, '.');
 
-	deptree = xmalloc(sizeof(*deptree));
-	TAILQ_INIT(deptree);
-	config = rc_stringlist_new();
-	while ((rc_getline(&line, &len, fp)))
+	*paths[0] = '\0';
+	if (p && p != service)
+		snprintf(paths[0], PATH_MAX, "%s/../conf.d/%.*s",
+		    dir, (int)(p - service), service);
+	snprintf(paths[1], PATH_MAX, "%s/../conf.d/%s", dir, service);
+}
+
+static bool
+file_has_glob(const char *path)
+{
+	FILE *fp;
+	int c;
+
+	if (!(fp = fopen(path, "r")))
+		return false;
+	while ((c = getc(fp)) != EOF && c != '*')
+		;
+	fclose(fp);
+	return c == '*';
+}
+
+/* Can what the script printed depend on which scripts there are?
+ * Only by globbing, so we look for a * in the script, its conf.d files
+ * and what it printed, in case a glob matched nothing. */
+static bool
+depcache_globs(const char *dir, const char *service,
+	       const RC_STRINGLIST *lines)
+{
+	const RC_STRING *s;
+	char paths[2][PATH_MAX];
+	char path[PATH_MAX];
+
+	TAILQ_FOREACH(s, lines, entries)
+		if (strchr(s->value, '*'))
+			return true;
+	snprintf(path, sizeof(path), "%s/%s", dir, service);
+	depcache_confd(paths, dir, service);
+	return file_has_glob(path) ||
+	    (*paths[0] && file_has_glob(paths[0])) ||
+	    file_has_glob(paths[1]);
+}
+
+/* Keys of the files the output of a script depends on */
+static RC_STRINGLIST *
+depcache_keys(const char *dir, const char *service, const RC_STRINGLIST *lines,
+	      bool globs)
+{
+	RC_STRINGLIST *keys = rc_stringlist_new();
+	const RC_STRING *s;
+	char paths[2][PATH_MAX];
+	char path[PATH_MAX];
+	char *line, *p, *token;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, service);
+	depcache_key(keys, path);
+	if (globs)
+		depcache_key(keys, dir);
+
+	depcache_confd(paths, dir, service);
+	if (*paths[0])
+		depcache_key(keys, paths[0]);
+	depcache_key(keys, paths[1]);
+
+	TAILQ_FOREACH(s, lines, entries) {
+		p = line = xstrdup(s->value);
+		strsep(&p, " ");
+		token = strsep(&p, " ");
+		if (token && strcmp(token, "config") == 0)
+			while ((token = strsep(&p, " "))) {
+				if (*token == '\0')
+					continue;
+				if (*token == '/')
+					depcache_key(keys, token);
+				else {
+					snprintf(path, sizeof(path), "%s/%s",
+					    dir, token);
+					depcache_key(keys, path);
+				}
+			}
+		free(line);
+	}
+	return keys;
+}
+
+/* Read a fragment, returning its output lines and setting keys to the
+ * keys it was saved with if asked */
+static RC_STRINGLIST *
+depcache_read(const char *file, RC_STRINGLIST **keys)
+{
+	FILE *fp;
+	RC_STRINGLIST *lines;
+	char *line = NULL;
+	size_t len = 0;
+
+	if (!(fp = fopen(file, "r")))
+		return NULL;
+	lines = rc_stringlist_new();
+	if (keys)
+		*keys = rc_stringlist_new();
+	while ((rc_getline(&line, &len, fp))) {
+		if (*line == '/') {
+			if (keys)
+				rc_stringlist_add(*keys, line);
+		} else
+			rc_stringlist_add(lines, line);
+	}
+	fclose(fp);
+	free(line);
+	return lines;
+}
+
+static bool
+stringlist_equal(const RC_STRINGLIST *a, const RC_STRINGLIST *b)
+{
+	const RC_STRING *s1 = TAILQ_FIRST(a);
+	const RC_STRING *s2 = TAILQ_FIRST(b);
+
+	while (s1 && s2) {
+		if (strcmp(s1->value, s2->value) != 0)
+			return false;
+		s1 = TAILQ_NEXT(s1, entries);
+		s2 = TAILQ_NEXT(s2, entries);
+	}
+	return !s1 && !s2;
+}
+
+/* Files others read are written to a temporary file which is renamed
+ * over the old one, so they see either the old file or all of the new */
+static FILE *
+atomic_open(const char *file, char *tmp, size_t len)
+{
+	FILE *fp;
+	int fd;
+
+	snprintf(tmp, len, "%s.XXXXXX", file);
+	if ((fd = mkstemp(tmp)) == -1)
+		return NULL;
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+	}
+	return fp;
+}
+
+static bool
+atomic_close(FILE *fp, const char *tmp, const char *file)
+{
+	if (fchmod(fileno(fp), 0644) != 0 || ferror(fp)) {
+		fclose(fp);
+		unlink(tmp);
+		return false;
+	}
+	if (fclose(fp) != 0 || rename(tmp, file) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/* Write a file atomically, creating any directories we need */
+static bool
+depcache_write(const char *file, const RC_STRINGLIST *keys,
+	       const RC_STRINGLIST *lines)
+{
+	const RC_STRING *s;
+	char tmp[PATH_MAX];
+	char *p;
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s", file);
+	for (p = strchr(tmp + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+			return false;
+		*p = '/';
+	}
+
+	if (!(fp = atomic_open(file, tmp, sizeof(tmp))))
+		return false;
+	TAILQ_FOREACH(s, keys, entries)
+		fprintf(fp, "%s\n", s->value);
+	if (lines)
+		TAILQ_FOREACH(s, lines, entries)
+			fprintf(fp, "%s\n", s->value);
+	return atomic_close(fp, tmp, file);
+}
+
+/* Save what gendepends.sh printed for a script */
+static void
+depcache_save(const char *script, const RC_STRINGLIST *lines)
+{
+	RC_STRINGLIST *keys;
+	char file[PATH_MAX];
+	char *dir = xstrdup(script);
+	char *p = strrchr(dir, '/');
+
+	*p++ = '\0';
+	keys = depcache_keys(dir, p, lines, depcache_globs(dir, p, lines));
+	snprintf(file, sizeof(file), RC_DEPCACHE "%s", script);
+	depcache_write(file, keys, lines);
+	rc_stringlist_free(keys);
+	free(dir);
+}
+
+/* Remove fragments which are no longer fresh.
+ * Everything is stale if anything that every script sources changes. */
+static void
+depcache_prune(void)
+{
+	RC_STRINGLIST *keys = rc_stringlist_new();
+	RC_STRINGLIST *stored = NULL;
+	RC_STRINGLIST *lines;
+	RC_STRINGLIST *fresh;
+	RC_STRING *s;
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+	size_t i, l;
+	bool stale;
+
+	depcache_key(keys, GENDEP);
+	depcache_key(keys, RC_LIBEXECDIR "/sh/functions.sh");
+	depcache_key(keys, RC_LIBEXECDIR "/sh/rc-functions.sh");
+	depcache_key(keys, RC_CONF);
+	depcache_key(keys, RC_CONF_D);
+	if ((dp = opendir(RC_CONF_D))) {
+		lines = rc_stringlist_new();
+		while ((d = readdir(dp)))
+			if (*d->d_name != '.') {
+				snprintf(path, sizeof(path), RC_CONF_D "/%s",
+				    d->d_name);
+				rc_stringlist_add(lines, path);
+			}
+		closedir(dp);
+		rc_stringlist_sort(&lines);
+		TAILQ_FOREACH(s, lines, entries)
+			depcache_key(keys, s->value);
+		rc_stringlist_free(lines);
+	}
+
+	lines = depcache_read(RC_DEPCACHE "/.global", &stored);
+	stale = !lines || !stringlist_equal(keys, stored);
+	rc_stringlist_free(lines);
+	rc_stringlist_free(stored);
+	if (stale)
+		depcache_write(RC_DEPCACHE "/.global", keys, NULL);
+	rc_stringlist_free(keys);
+
+	for (i = 0; init_dirs[i]; i++) {
+		snprintf(path, sizeof(path), RC_DEPCACHE "%s", init_dirs[i]);
+		if (!(dp = opendir(path)))
+			continue;
+		while ((d = readdir(dp))) {
+			if (*d->d_name == '.')
+				continue;
+			snprintf(path, sizeof(path), RC_DEPCACHE "%s/%s",
+			    init_dirs[i], d->d_name);
+			if (!stale) {
+				stored = NULL;
+				lines = depcache_read(path, &stored);
+				if (lines) {
+					/* Fragments of scripts which glob
+					 * key the directory after the
+					 * script */
+					s = TAILQ_FIRST(stored);
+					s = s ? TAILQ_NEXT(s, entries) : NULL;
+					l = strlen(init_dirs[i]);
+					fresh = depcache_keys(init_dirs[i],
+					    d->d_name, lines, s &&
+					    strncmp(s->value, init_dirs[i],
+						l) == 0 &&
+					    s->value[l] == ' ');
+					if (stringlist_equal(fresh, stored)) {
+						rc_stringlist_free(fresh);
+						rc_stringlist_free(stored);
+						rc_stringlist_free(lines);
+						continue;
+					}
+					rc_stringlist_free(fresh);
+					rc_stringlist_free(stored);
+					rc_stringlist_free(lines);
+				}
+			}
+			unlink(path);
+		}
+		closedir(dp);
+	}
+}
+
+/* Native parser for static depend functions.
+ * Most init scripts only call need, use and friends with plain words, so
+ * forking a shell to source them just to print those words back is
+ * wasted effort. We recognise scripts which cannot do anything else
+ * while gendepends.sh sources them: the top level of the script and its
+ * conf.d files only sets variables and defines functions, and depend only
+ * calls our dependency functions with words which expand to themselves.
+ * Anything we are not sure about, such as variables, conditionals or
+ * config, is left to gendepends.sh. The description and extra commands
+ * the script sets must be plain words or quoted text for the same reason.
+ * What we find is saved in the depcache exactly as gendepends.sh would
+ * have printed it, so the shards see the script as cached and skip it. */
+#define NATIVE_MAX_SIZE (256 * 1024)
+
+extern char **environ;
+
+static const DEPPAIR depend_cmds[] = {
+	{ "need",	"ineed" },
+	{ "use",	"iuse" },
+	{ "want",	"iwant" },
+	{ "after",	"iafter" },
+	{ "before",	"ibefore" },
+	{ "provide",	"iprovide" },
+	{ "keyword",	"keyword" },
+	{ NULL, NULL }
+};
+
+/* Suffixes of the variables _depend in rc-functions.sh looks at */
+static const char *const depend_vars[] = {
+	"_config", "_need", "_use", "_want", "_after", "_before",
+	"_provide", "_keyword", NULL
+};
+
+static bool
+depend_var(const char *name, size_t len)
+{
+	size_t i, l;
+
+	for (i = 0; depend_vars[i]; i++) {
+		l = strlen(depend_vars[i]);
+		if (len >= l &&
+		    strncasecmp(name + len - l, depend_vars[i], l) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Variables _describe in gendepends.sh looks at, besides description_* */
+static const char *const meta_vars[] = {
+	"extra_commands", "extra_started_commands", "extra_stopped_commands",
+	"description", NULL
+};
+
+static bool
+meta_var(const char *name, size_t len)
+{
+	size_t i;
+
+	if (len > 12 && strncmp(name, "description_", 12) == 0)
+		return true;
+	for (i = 0; meta_vars[i]; i++)
+		if (strlen(meta_vars[i]) == len &&
+		    strncmp(name, meta_vars[i], len) == 0)
+			return true;
+	return false;
+}
+
+static size_t
+shell_name_len(const char *p)
+{
+	size_t l = 0;
+
+	if (!isalpha((unsigned char)*p) && *p != '_')
+		return 0;
+	while (isalnum((unsigned char)p[l]) || p[l] == '_')
+		l++;
+	return l;
+}
+
+static bool
+shell_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* Is this the end of a simple command? */
+static bool
+shell_sep(char c)
+{
+	return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ';';
+}
+
+/* Find the end of a word, honouring quotes.
+ * ok is cleared if the word runs a command or could set one of the
+ * variables _depend looks at. */
+static const char *
+shell_word_end(const char *p, bool *ok)
+{
+	char q = '\0';
+	size_t l, o;
+
+	for (; *p; p++) {
+		if (q == '\'') {
+			if (*p == '\'')
+				q = '\0';
+			continue;
+		}
+		if (*p == '\\') {
+			if (*++p == '\0')
+				return NULL;
+			continue;
+		}
+		if (*p == '`' || (p[0] == '$' && p[1] == '('))
+			*ok = false;
+		else if (p[0] == '$' && p[1] == '{') {
+			o = p[2] == '#' || p[2] == '!' ? 3 : 2;
+			if ((l = shell_name_len(p + o)) &&
+			    depend_var(p + o, l))
+				*ok = false;
+		}
+		if (q == '"') {
+			if (*p == '"')
+				q = '\0';
+			continue;
+		}
+		if (*p == '\'' || *p == '"')
+			q = *p;
+		else if (strchr(" \t\n;&|<>()", *p))
+			break;
+	}
+	return q ? NULL : p;
+}
+
+/* The value of a word found by shell_word_end if it expands to itself,
+ * otherwise NULL */
+static char *
+shell_value(const char *p, const char *end)
+{
+	char *value = xmalloc(end - p + 1);
+	char *v = value;
+	char q = '\0';
+
+	if (*p == '~')
+		goto fail;
+	for (; p < end; p++) {
+		if (q == '\'') {
+			if (*p == '\'')
+				q = '\0';
+			else
+				*v++ = *p;
+			continue;
+		}
+		if (*p == '$' || *p == '`')
+			goto fail;
+		if (*p == '\\') {
+			if (*++p == '\n')
+				continue;
+			if (q == '"' && !strchr("$`\"\\", *p))
+				*v++ = '\\';
+			*v++ = *p;
+			continue;
+		}
+		if (q == '"') {
+			if (*p == '"')
+				q = '\0';
+			else
+				*v++ = *p;
+			continue;
+		}
+		if (*p == '\'' || *p == '"')
+			q = *p;
+		else
+			*v++ = *p;
+	}
+	*v = '\0';
+	return value;
+
+fail:
+	free(value);
+	return NULL;
+}
+
+/* Note what a script sets one of the variables _describe looks at to,
+ * as name=value with the last one set winning */
+static bool
+meta_add(RC_STRINGLIST *meta, const char *name, size_t len,
+	 const char *p, const char *end)
+{
+	RC_STRING *s;
+	char *value, *entry;
+
+	if (!meta || !(value = shell_value(p, end)))
+		return false;
+	entry = xmalloc(len + strlen(value) + 2);
+	sprintf(entry, "%.*s=%s", (int)len, name, value);
+	free(value);
+	TAILQ_FOREACH(s, meta, entries)
+		if (strncmp(s->value, entry, len + 1) == 0)
+			break;
+	if (s) {
+		free(s->value);
+		s->value = entry;
+	} else {
+		rc_stringlist_add(meta, entry);
+		free(entry);
+	}
+	return true;
+}
+
+static const char *
+meta_get(const RC_STRINGLIST *meta, const char *name)
+{
+	const RC_STRING *s;
+	size_t l = strlen(name);
+
+	TAILQ_FOREACH(s, meta, entries)
+		if (strncmp(s->value, name, l) == 0 && s->value[l] == '=')
+			return s->value + l + 1;
+	return "";
+}
+
+/* Find the end of a brace group, given the text just after the opening
+ * brace. Braces are only reserved words where a command can start and
+ * the group must not be empty, as the shell fails on "{ need a }".
+ * We give up on here documents as we would have to parse them. */
+static const char *
+shell_block_end(const char *p)
+{
+	int depth = 1;
+	char q = '\0';
+	bool word = true, cmd = true, empty = true;
+
+	for (; *p; p++) {
+		if (q == '\'') {
+			if (*p == '\'')
+				q = '\0';
+			continue;
+		}
+		if (*p == '\\') {
+			if (*++p == '\0')
+				return NULL;
+			if (*p != '\n')
+				word = cmd = empty = false;
+			continue;
+		}
+		if (q == '"') {
+			if (*p == '"')
+				q = '\0';
+			continue;
+		}
+		if (*p == '#' && word) {
+			p += strcspn(p, "\n");
+			if (*p == '\0')
+				return NULL;
+		}
+		if (p[0] == '<' && p[1] == '<')
+			return NULL;
+		if (*p == '{' && cmd && strchr(" \t\n", p[1])) {
+			depth++;
+			empty = true;
+			continue;
+		}
+		if (*p == '}' && cmd && strchr(" \t\n;&|)<>", p[1])) {
+			if (empty)
+				return NULL;
+			if (--depth == 0)
+				return p + 1;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t')
+			word = true;
+		else if (strchr("\n;&|()", *p))
+			word = cmd = true;
+		else {
+			if (*p == '\'' || *p == '"')
+				q = *p;
+			word = cmd = empty = false;
+		}
+	}
+	return NULL;
+}
+
+/* Check the top level of a script or config file only sets variables,
+ * runs : and defines functions. If body is given, it is set to the body
+ * of depend if the text defines it, otherwise defining depend fails.
+ * What the variables _describe looks at are set to is added to meta,
+ * otherwise setting them fails. */
+static bool
+shell_static(const char *p, const char **body, const char **end,
+	     RC_STRINGLIST *meta)
+{
+	const char *q, *start;
+	size_t l;
+	bool ok = true, dep;
+
+	while (*p) {
+		if (shell_sep(*p)) {
+			p++;
+			continue;
+		}
+		if (p[0] == '\\' && p[1] == '\n') {
+			p += 2;
+			continue;
+		}
+		if (*p == '#') {
+			p += strcspn(p, "\n");
+			continue;
+		}
+
+		/* : with words which expand harmlessly */
+		if (*p == ':' && shell_sep(p[1])) {
+			p++;
+			for (;;) {
+				while (shell_blank(*p) ||
+				    (p[0] == '\\' && p[1] == '\n'))
+					p += *p == '\\' ? 2 : 1;
+				if (shell_sep(*p) || *p == '#')
+					break;
+				if (!(p = shell_word_end(p, &ok)) || !ok ||
+				    !shell_sep(*p))
+					return false;
+			}
+			continue;
+		}
+
+		if (!(l = shell_name_len(p)))
+			return false;
+
+		/* name=value */
+		if (p[l] == '=') {
+			if (depend_var(p, l))
+				return false;
+			if (!(q = shell_word_end(p + l + 1, &ok)) || !ok ||
+			    !shell_sep(*q))
+				return false;
+			if (meta_var(p, l) &&
+			    !meta_add(meta, p, l, p + l + 1, q))
+				return false;
+			p = q;
+			continue;
+		}
+
+		/* name() { ... } */
+		for (q = p + l; shell_blank(*q); q++)
+			;
+		if (*q++ != '(')
+			return false;
+		while (shell_blank(*q))
+			q++;
+		if (*q++ != ')')
+			return false;
+		while (shell_blank(*q) || *q == '\n')
+			q++;
+		if (*q++ != '{' || !(shell_blank(*q) || *q == '\n'))
+			return false;
+		dep = l == 6 && strncmp(p, "depend", l) == 0;
+		if (dep && (!body || *body))
+			return false;
+		start = q;
+		if (!(q = shell_block_end(q)) || !shell_sep(*q))
+			return false;
+		if (dep) {
+			*body = start;
+			*end = q - 1;
+		}
+		p = q;
+	}
+	return true;
+}
+
+/* Words we pass on as is, without any expansion */
+static size_t
+depend_word_len(const char *p, const char *end)
+{
+	const char *q;
+
+	for (q = p; q < end; q++)
+		if (!isalnum((unsigned char)*q) && !strchr("-_.,:+=@%!^/", *q))
+			break;
+	return q - p;
+}
+
+/* Turn a static depend body into what gendepends.sh would print */
+static RC_STRINGLIST *
+depend_body(const char *service, const char *p, const char *end)
+{
+	RC_STRINGLIST *lines = rc_stringlist_new();
+	const DEPPAIR *cmd;
+	char *line = NULL;
+	size_t l, len = 0, words = 0;
+
+	rc_stringlist_add(lines, service);
+	while (p < end) {
+		if (shell_blank(*p) || *p == '\n' || *p == ';') {
+			p++;
+			continue;
+		}
+		if (p + 1 < end && p[0] == '\\' && p[1] == '\n') {
+			p += 2;
+			continue;
+		}
+		if (*p == '#') {
+			while (p < end && *p != '\n')
+				p++;
+			continue;
+		}
+
+		l = depend_word_len(p, end);
+		if (!l || (p + l < end && !shell_sep(p[l])))
+			goto fail;
+		if (l == 1 && *p == ':')
+			cmd = NULL;
+		else {
+			for (cmd = depend_cmds; cmd->depend; cmd++)
+				if (strlen(cmd->depend) == l &&
+				    strncmp(p, cmd->depend, l) == 0)
+					break;
+			if (!cmd->depend)
+				goto fail;
+			free(line);
+			line = xmalloc(strlen(service) + 16 + 2 * (end - p));
+			len = sprintf(line, "%s %s", service, cmd->addto);
+			words = 0;
+		}
+		p += l;
+
+		for (;;) {
+			while (p < end && (shell_blank(*p) ||
+			    (p + 1 < end && p[0] == '\\' && p[1] == '\n')))
+				p += *p == '\\' ? 2 : 1;
+			if (p == end || *p == '\n' || *p == ';')
+				break;
+			if (*p == '#') {
+				while (p < end && *p != '\n')
+					p++;
+				break;
+			}
+			l = depend_word_len(p, end);
+			if (!l || (p + l < end && !shell_sep(p[l])))
+				goto fail;
+			if (!cmd) {
+				p += l;
+				continue;
+			}
+			/* keyword expands these from rc.conf at runtime */
+			if (strcmp(cmd->depend, "keyword") == 0 &&
+			    ((l == 11 && strncmp(p, "-containers", l) == 0) ||
+			    (l == 12 && strncmp(p, "!-containers", l) == 0)))
+				goto fail;
+			len += sprintf(line + len, " %.*s", (int)l, p);
+			words++;
+			p += l;
+		}
+
+		/* Nothing is printed without arguments and keyword
+		 * leaves a space after every word */
+		if (cmd && words) {
+			if (strcmp(cmd->depend, "keyword") == 0)
+				strcpy(line + len, " ");
+			rc_stringlist_add(lines, line);
+		}
+		free(line);
+		line = NULL;
+	}
+	return lines;
+
+fail:
+	free(line);
+	rc_stringlist_free(lines);
+	return NULL;
+}
+
+/* Add what _describe in gendepends.sh would print for what the script
+ * sets, or return false if we can't say */
+static bool
+describe_native(const char *service, const RC_STRINGLIST *meta,
+		RC_STRINGLIST *lines)
+{
+	RC_STRINGLIST *cmds = rc_stringlist_new();
+	const RC_STRING *s;
+	const char *value;
+	char *words, *word, *p, *line;
+	size_t i, l, len;
+
+	for (i = 0; meta_types[i] && strncmp(meta_types[i], "extra_", 6) == 0;
+	    i++)
+	{
+		value = meta_get(meta, meta_types[i]);
+		if (!*value)
+			continue;
+		/* Words the shell would glob */
+		if (strpbrk(value, "*?[")) {
+			rc_stringlist_free(cmds);
+			return false;
+		}
+		line = xmalloc(strlen(service) + strlen(meta_types[i]) +
+		    2 * strlen(value) + 3);
+		len = sprintf(line, "%s %s", service, meta_types[i]);
+		p = words = xstrdup(value);
+		while ((word = strsep(&p, " \t\n")))
+			if (*word) {
+				len += sprintf(line + len, " %s", word);
+				rc_stringlist_add(cmds, word);
+			}
+		rc_stringlist_add(lines, line);
+		free(words);
+		free(line);
+	}
+
+	/* Only the first line of a description is used */
+	value = meta_get(meta, "description");
+	if ((l = strcspn(value, "\n"))) {
+		line = xmalloc(strlen(service) + l + 14);
+		sprintf(line, "%s description %.*s", service, (int)l, value);
+		rc_stringlist_add(lines, line);
+		free(line);
+	}
+	TAILQ_FOREACH(s, cmds, entries) {
+		if (shell_name_len(s->value) != strlen(s->value))
+			continue;
+		p = xmalloc(strlen(s->value) + 13);
+		sprintf(p, "description_%s", s->value);
+		value = meta_get(meta, p);
+		free(p);
+		if (!(l = strcspn(value, "\n")))
+			continue;
+		line = xmalloc(strlen(service) + strlen(s->value) + l + 23);
+		sprintf(line, "%s command_description %s %.*s",
+		    service, s->value, (int)l, value);
+		rc_stringlist_add(lines, line);
+		free(line);
+	}
+	rc_stringlist_free(cmds);
+	return true;
+}
+
+/* Is a config file sourced by gendepends.sh only setting variables? */
+static bool
+native_config(const char *path)
+{
+	char *text;
+	bool retval;
+
+	if (!exists(path))
+		return true;
+	if (!(text = file_read(path, NATIVE_MAX_SIZE)))
+		return false;
+	retval = shell_static(text, NULL, NULL, NULL);
+	free(text);
+	return retval;
+}
+
+/* Can anything every script sources add dependencies behind our back? */
+static bool
+native_ok(void)
+{
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+	size_t i, l;
+	bool retval = true;
+
+	for (i = 0; environ && environ[i]; i++)
+		if (depend_var(environ[i], strcspn(environ[i], "=")) ||
+		    meta_var(environ[i], strcspn(environ[i], "=")))
+			return false;
+	if (!native_config(RC_CONF))
+		return false;
+	if ((dp = opendir(RC_CONF_D))) {
+		while (retval && (d = readdir(dp))) {
+			l = strlen(d->d_name);
+			if (*d->d_name == '.' || l < 5 ||
+			    strcmp(d->d_name + l - 5, ".conf") != 0)
+				continue;
+			snprintf(path, sizeof(path), RC_CONF_D "/%s",
+			    d->d_name);
+			retval = native_config(path);
+		}
+		closedir(dp);
+	}
+	return retval;
+}
+
+static bool
+ends_with(const char *s, const char *suffix)
+{
+	size_t l = strlen(s), ls = strlen(suffix);
+
+	return l >= ls && strcmp(s + l - ls, suffix) == 0;
+}
+
+/* Match the interpreter check in gendepends.sh */
+static bool
+native_script(const char *text)
+{
+	char *line = xmalloc(strcspn(text, "\n") + 1);
+	char *p = line, *one = NULL, *two = NULL, *token;
+	bool retval = false;
+
+	memcpy(line, text, strcspn(text, "\n"));
+	line[strcspn(text, "\n")] = '\0';
+	while (!two && (token = strsep(&p, " \t"))) {
+		if (*token == '\0')
+			continue;
+		if (one)
+			two = token;
+		else
+			one = token;
+	}
+	if (!one || strchr(line, '\\'))
+		retval = false;
+	else if (*one == '#' && (ends_with(one + 1, "/openrc-run") ||
+	    ends_with(one + 1, "/runscript")))
+		retval = true;
+	else if (strcmp(one, "#!") == 0 && two)
+		retval = ends_with(two, "/openrc-run") ||
+		    ends_with(two, "/runscript");
+	free(line);
+	return retval;
+}
+
+/* Work out what gendepends.sh would print for a script if we can,
+ * otherwise return NULL */
+static RC_STRINGLIST *
+depend_native(const char *dir, const char *service)
+{
+	RC_STRINGLIST *lines = NULL, *meta;
+	struct stat st;
+	char path[PATH_MAX];
+	char *text;
+	const char *p;
+	const char *body = NULL, *end = NULL;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, service);
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    access(path, X_OK) != 0)
+		return NULL;
+
+	/* Match how gendepends.sh finds conf.d files */
+	p = strchr(service, '.');
+	if (p && p != service) {
+		snprintf(path, sizeof(path), "%s/../conf.d/%.*s",
+		    dir, (int)(p - service), service);
+		if (!native_config(path))
+			return NULL;
+	}
+	snprintf(path, sizeof(path), "%s/../conf.d/%s", dir, service);
+	if (!native_config(path))
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, service);
+	if (!(text = file_read(path, NATIVE_MAX_SIZE)))
+		return NULL;
+	meta = rc_stringlist_new();
+	if (native_script(text) && shell_static(text, &body, &end, meta)) {
+		if (body)
+			lines = depend_body(service, body, end);
+		else {
+			lines = rc_stringlist_new();
+			rc_stringlist_add(lines, service);
+		}
+		if (lines && !describe_native(service, meta, lines)) {
+			rc_stringlist_free(lines);
+			lines = NULL;
+		}
+	}
+	rc_stringlist_free(meta);
+	free(text);
+	return lines;
+}
+
+RC_STRINGLIST *
+rc_deptree_native(const char *script)
+{
+	RC_STRINGLIST *lines = NULL;
+	char *dir = xstrdup(script);
+	char *p = strrchr(dir, '/');
+
+	if (native_ok()) {
+		if (!p)
+			lines = depend_native(".", script);
+		else {
+			*p++ = '\0';
+			lines = depend_native(*dir ? dir : "/", p);
+		}
+	}
+	free(dir);
+	return lines;
+}
+librc_hidden_def(rc_deptree_native)
+
+/* Parse what scripts we can before gendepends.sh runs */
+static void
+depend_natives(void)
+{
+	RC_STRINGLIST *lines;
+	DIR *dp;
+	struct dirent *d;
+	char script[PATH_MAX];
+	char file[sizeof(RC_DEPCACHE) + PATH_MAX];
+	size_t i, j;
+
+	if (!native_ok())
+		return;
+	for (i = 0; init_dirs[i]; i++) {
+		for (j = 0; j < i; j++)
+			if (strcmp(init_dirs[i], init_dirs[j]) == 0)
+				break;
+		if (j < i || !(dp = opendir(init_dirs[i])))
+			continue;
+		while ((d = readdir(dp))) {
+			if (*d->d_name == '.')
+				continue;
+			snprintf(script, sizeof(script), "%s/%s",
+			    init_dirs[i], d->d_name);
+			snprintf(file, sizeof(file), RC_DEPCACHE "%s", script);
+			if (exists(file))
+				continue;
+			if ((lines = depend_native(init_dirs[i], d->d_name)))
+				depcache_save(script, lines);
+			rc_stringlist_free(lines);
+		}
+		closedir(dp);
+	}
+}
+
+/* Add a line of gendepends.sh output to our list.
+ * dip and dtp track the service and type we added to last. */
+static void
+add_depend(RC_DEPLIST *deptree, DEPINDEX *index, RC_STRINGLIST *config,
+	   char *line, RC_DEPINFO **dip, RC_DEPTYPE **dtp)
+{
+	RC_DEPINFO *depinfo = *dip;
+	RC_DEPTYPE *deptype = *dtp, *dt;
+	char *depend, *depends, *service, *type;
+	size_t l;
+
+	depends = line;
+	service = strsep(&depends, " ");
+	if (!service || !*service)
+		return;
+
+	type = strsep(&depends, " ");
+	if (!depinfo || strcmp(depinfo->service, service) != 0) {
+		deptype = NULL;
+		depinfo = get_depinfo(index, service);
+		if (!depinfo) {
+			depinfo = xmalloc(sizeof(*depinfo));
+			TAILQ_INIT(&depinfo->depends);
+			depinfo->service = xstrdup(service);
+			TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+			depindex_add(index, depinfo);
+		}
+	}
+
+	*dip = depinfo;
+	*dtp = deptype;
+
+	/* We may not have any depends */
+	if (!type || !depends)
+		return;
+
+	/* Get the type */
+	if (strcmp(type, "config") != 0) {
+		if (!deptype || strcmp(deptype->type, type) != 0)
+			deptype = get_deptype(depinfo, type);
+		if (!deptype) {
+			deptype = xmalloc(sizeof(*deptype));
+			deptype->type = xstrdup(type);
+			deptype->services = rc_stringlist_new();
+			TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
+		}
+	}
+	*dtp = deptype;
+
+	/* Descriptions are kept whole, as "command text" for commands */
+	if (meta_type(type)) {
+		if (strncmp(type, "extra_", 6) != 0) {
+			if (*depends)
+				rc_stringlist_addu(deptype->services, depends);
+		} else
+			while ((depend = strsep(&depends, " ")))
+				if (depend[0] != 0)
+					rc_stringlist_add(deptype->services,
+					    depend);
+		return;
+	}
+
+	/* Now add each depend to our type.
+	   We do this individually so we handle multiple spaces gracefully */
+	while ((depend = strsep(&depends, " ")))
 	{
-		depends = line;
-		service = strsep(&depends, " ");
-		if (!service || !*service)
+		if (depend[0] == 0)
+			continue;
+
+		if (strcmp(type, "config") == 0) {
+			rc_stringlist_addu(config, depend);
+			continue;
+		}
+
+		/* Don't provide ourself */
+		if (strcmp(type, "iprovide") == 0 &&
+		    strcmp(depend, service) == 0)
+			continue;
+
+		/* .sh files are not init scripts */
+		l = strlen(depend);
+		if (l > 2 &&
+		    depend[l - 3] == '.' &&
+		    depend[l - 2] == 's' &&
+		    depend[l - 1] == 'h')
+			continue;
+
+		/* Remove our dependency if instructed */
+		if (depend[0] == '!') {
+			rc_stringlist_delete(deptype->services, depend + 1);
+			continue;
+		}
+
+		rc_stringlist_add(deptype->services, depend);
+
+		/* We need to allow `after *; before local;` to work.
+		 * Conversely, we need to allow 'before *; after modules' also */
+		/* If we're before something, remove us from the after list */
+		if (strcmp(type, "ibefore") == 0) {
+			if ((dt = get_deptype(depinfo, "iafter")))
+				rc_stringlist_delete(dt->services, depend);
+		}
+		/* If we're after something, remove us from the before list */
+		if (strcmp(type, "iafter") == 0 ||
+		    strcmp(type, "ineed") == 0 ||
+		    strcmp(type, "iwant") == 0 ||
+		    strcmp(type, "iuse") == 0) {
+			if ((dt = get_deptype(depinfo, "ibefore")))
+				rc_stringlist_delete(dt->services, depend);
+		}
+	}
+}
+
+/* How many shards we split gendepends.sh into */
+static long
+depend_jobs(void)
+{
+	const char *value = rc_conf_value("rc_depend_jobs");
+	DIR *dp;
+	struct dirent *d;
+	char *e;
+	long jobs = 0, scripts = 0;
+	size_t i;
+
+	if (value) {
+		jobs = strtol(value, &e, 10);
+		if (*e != '\0')
+			jobs = 0;
+	}
+	if (jobs < 1)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 2)
+		return 1;
+
+	/* No point in having more shards than scripts */
+	for (i = 0; init_dirs[i]; i++) {
+		if (!(dp = opendir(init_dirs[i])))
+			continue;
+		while ((d = readdir(dp)))
+			if (*d->d_name != '.')
+				scripts++;
+		closedir(dp);
+	}
+	if (jobs > scripts)
+		jobs = scripts;
+	return jobs > 1 ? jobs : 1;
+}
+
+/* Run gendepends.sh in shards, using our cached fragments if we can.
+ * Each shard takes every nth script and prints the path of each script
+ * before its output, so we can put the output back into the order of
+ * a serial run no matter which shard finishes first.
+ * Returns -1 if we could not run it, 1 if a cached fragment went missing
+ * and 0 otherwise. */
+static int
+gendepends(RC_DEPLIST *deptree, DEPINDEX *index, RC_STRINGLIST *config,
+	   bool cache)
+{
+	FILE **fp;
+	struct pollfd *pfd;
+	char **buf;
+	size_t *len, *size, *pos;
+	RC_DEPINFO *depinfo = NULL;
+	RC_DEPTYPE *deptype = NULL;
+	RC_STRINGLIST *output;
+	RC_STRINGLIST *lines = NULL;
+	RC_STRING *s, *s2;
+	char *script = NULL;
+	char *line;
+	char *p;
+	char file[PATH_MAX];
+	char num[32];
+	long jobs = depend_jobs();
+	long i, left;
+	ssize_t r;
+	int retval = 0;
+
+	if (cache) {
+		depcache_prune();
+		depend_natives();
+		setenv("RC_DEPCACHE", RC_DEPCACHE, 1);
+	}
+	snprintf(num, sizeof(num), "%ld", jobs);
+	setenv("RC_DEPEND_SHARDS", num, 1);
+
+	fp = xmalloc(sizeof(*fp) * jobs);
+	for (i = 0; i < jobs; i++) {
+		snprintf(num, sizeof(num), "%ld", i);
+		setenv("RC_DEPEND_SHARD", num, 1);
+		if (!(fp[i] = popen(GENDEP, "r")))
+			break;
+	}
+	unsetenv("RC_DEPCACHE");
+	unsetenv("RC_DEPEND_SHARDS");
+	unsetenv("RC_DEPEND_SHARD");
+	if (i < jobs) {
+		while (i-- > 0)
+			pclose(fp[i]);
+		free(fp);
+		return -1;
+	}
+
+	/* Read every shard as it comes so none of them block on a full pipe */
+	pfd = xmalloc(sizeof(*pfd) * jobs);
+	buf = xmalloc(sizeof(*buf) * jobs);
+	len = xmalloc(sizeof(*len) * jobs);
+	size = xmalloc(sizeof(*size) * jobs);
+	pos = xmalloc(sizeof(*pos) * jobs);
+	for (i = 0; i < jobs; i++) {
+		pfd[i].fd = fileno(fp[i]);
+		pfd[i].events = POLLIN;
+		buf[i] = NULL;
+		len[i] = size[i] = pos[i] = 0;
+	}
+	left = jobs;
+	while (left) {
+		if (poll(pfd, jobs, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < jobs; i++) {
+			if (pfd[i].fd == -1 || !pfd[i].revents)
+				continue;
+			if (size[i] - len[i] < BUFSIZ) {
+				size[i] += BUFSIZ * 4;
+				buf[i] = xrealloc(buf[i], size[i] + 1);
+			}
+			r = read(pfd[i].fd, buf[i] + len[i], size[i] - len[i]);
+			if (r > 0)
+				len[i] += r;
+			else if (r == 0 || errno != EINTR) {
+				pfd[i].fd = -1;
+				left--;
+			}
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pclose(fp[i]);
+
+	/* Take a script from each shard in turn */
+	output = rc_stringlist_new();
+	do {
+		left = 0;
+		for (i = 0; i < jobs; i++) {
+			if (pos[i] == len[i])
+				continue;
+			left++;
+			buf[i][len[i]] = '\0';
+			do {
+				line = buf[i] + pos[i];
+				p = strchr(line, '\n');
+				if (p)
+					*p = '\0';
+				pos[i] = p ? (size_t)(p - buf[i]) + 1 : len[i];
+				rc_stringlist_add(output, line);
+			} while (pos[i] < len[i] && buf[i][pos[i]] != '/');
+		}
+	} while (left);
+	for (i = 0; i < jobs; i++)
+		free(buf[i]);
+	free(pfd);
+	free(buf);
+	free(len);
+	free(size);
+	free(pos);
+	free(fp);
+
+	TAILQ_FOREACH(s, output, entries) {
+		line = s->value;
+		if (*line == '\0')
+			continue;
+
+		/* Only script paths start with a slash */
+		if (*line == '/') {
+			if (script)
+				depcache_save(script, lines);
+			free(script);
+			script = NULL;
+			rc_stringlist_free(lines);
+			lines = NULL;
+
+			p = line;
+			strsep(&p, " ");
+			if (!p || strcmp(p, "cached") != 0) {
+				script = xstrdup(line);
+				lines = rc_stringlist_new();
+				continue;
+			}
+
+			snprintf(file, sizeof(file), RC_DEPCACHE "%s", line);
+			if (!(lines = depcache_read(file, NULL))) {
+				retval = 1;
+				continue;
+			}
+			TAILQ_FOREACH(s2, lines, entries)
+				add_depend(deptree, index, config, s2->value,
+					   &depinfo, &deptype);
+			rc_stringlist_free(lines);
+			lines = NULL;
+			continue;
+		}
+
+		if (lines)
+			rc_stringlist_add(lines, line);
+		add_depend(deptree, index, config, line, &depinfo, &deptype);
+	}
+	if (script)
+		depcache_save(script, lines);
+	free(script);
+	rc_stringlist_free(lines);
+	rc_stringlist_free(output);
+	return retval;
+}
+
+/* Our direct dependencies of the given types followed by ourselves,
+ * which is what we need to check before directives against. */
+static void
+direct_depends(const RC_STRINGLIST *types, RC_STRINGLIST *sorted,
+	       const RC_DEPINFO *depinfo)
+{
+	RC_STRING *type;
+	RC_STRING *service;
+	RC_DEPTYPE *dt;
+	const char *svcname;
+
+	TAILQ_FOREACH(type, types, entries) {
+		if (!(dt = get_deptype(depinfo, type->value)))
+			continue;
+		TAILQ_FOREACH(service, dt->services, entries)
+			rc_stringlist_add(sorted, service->value);
+	}
+
+	svcname = getenv("RC_SVCNAME");
+	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
+		if (!get_deptype(depinfo, "providedby"))
+			rc_stringlist_add(sorted, depinfo->service);
+	}
+}
+
+/* Record the manifest rc_deptree_update_needed checks */
+static bool
+manifest_add(const char *path, const struct stat *st, void *arg)
+{
+	char buf[PATH_MAX + 128];
+
+	stat_key(buf, sizeof(buf), path, st);
+	rc_stringlist_add(arg, buf);
+	return true;
+}
+
+static void
+manifest_walk(RC_STRINGLIST *manifest, const char *target)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	/* Note a missing file so we notice it appearing */
+	if (stat(target, &st) != 0) {
+		manifest_add(target, NULL, manifest);
+		return;
+	}
+	strlcpy(path, target, sizeof(path));
+	mtime_walk(AT_FDCWD, target, path, strlen(path), manifest_add,
+	    manifest);
+}
+
+static void
+manifest_save(RC_STRINGLIST *manifest)
+{
+	RC_STRINGLIST *header;
+	struct stat st;
+	char buf[128];
+
+	if (stat(RC_DEPTREE_CACHE, &st) != 0)
+		return;
+	header = rc_stringlist_new();
+	manifest_header(buf, sizeof(buf), &st);
+	rc_stringlist_add(header, buf);
+	depcache_write(RC_DEPMANIFEST, header, manifest);
+	rc_stringlist_free(header);
+}
+
+/* Start plans.
+ * Every time rc changes runlevel it resolves the start order of each
+ * runlevel in the stack, which queries the runlevels and the state of
+ * the same services over and over. As neither change much from boot to
+ * boot, we compile the order into a plan per runlevel, along with the
+ * services earlier in the plan each one depends on. A service can start
+ * as soon as those have, so the rest can start concurrently.
+ * A plan is resolved against a model of the services started by the
+ * time rc gets to the runlevel while booting, which is everything in
+ * the sysinit and boot plans. It records the state of every service the
+ * resolver looked at. When one is started now but was assumed stopped,
+ * and it provides nothing, the resolver would only have added it and
+ * what it needs, which are started too, so we add it to the order.
+ * Any other difference means resolving the order from scratch.
+ * Plans are keyed by the digest of the deptree and the runlevel
+ * directories, so adding or removing a service from a runlevel compiles
+ * them again. */
+
+/* What a plan for the runlevel must be keyed by to be used */
+static RC_STRINGLIST *
+plan_header(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *header = rc_stringlist_new();
+	struct stat st;
+	char path[PATH_MAX];
+	char buf[PATH_MAX + 128];
+
+	snprintf(buf, sizeof(buf), "deptree %08x", deptree->header->digest);
+	rc_stringlist_add(header, buf);
+	snprintf(buf, sizeof(buf), "options %d", options);
+	rc_stringlist_add(header, buf);
+	snprintf(buf, sizeof(buf), "bootlevel %s", bootlevel);
+	rc_stringlist_add(header, buf);
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", runlevel);
+	memcpy(buf, "level ", 6);
+	stat_key(buf + 6, sizeof(buf) - 6, path,
+	    stat(path, &st) == 0 ? &st : NULL);
+	rc_stringlist_add(header, buf);
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", bootlevel);
+	stat_key(buf + 6, sizeof(buf) - 6, path,
+	    stat(path, &st) == 0 ? &st : NULL);
+	rc_stringlist_add(header, buf);
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", RC_LEVEL_SYSINIT);
+	stat_key(buf + 6, sizeof(buf) - 6, path,
+	    stat(path, &st) == 0 ? &st : NULL);
+	rc_stringlist_add(header, buf);
+	return header;
+}
+
+/* Resolve the start order of a runlevel the way rc does */
+static RC_STRINGLIST *
+plan_resolve(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *services = rc_services_in_runlevel(runlevel);
+	RC_STRINGLIST *types = rc_stringlist_new();
+	RC_STRINGLIST *order;
+
+	rc_stringlist_add(types, "ineed");
+	rc_stringlist_add(types, "iwant");
+	rc_stringlist_add(types, "iuse");
+	rc_stringlist_add(types, "iafter");
+	rc_stringlist_sort(&services);
+	order = rc_deptree_depends(deptree, types, services, runlevel,
+	    options | RC_DEP_START);
+	rc_stringlist_free(services);
+	rc_stringlist_free(types);
+	return order;
+}
+
+/* Resolve the start order of a runlevel against a model */
+static RC_STRINGLIST *
+plan_model_resolve(const RC_DEPTREE *deptree, const char *runlevel,
+		   int options, const NAMETAB *started, RC_STRINGLIST *seen)
+{
+	PLAN_MODEL model;
+	RC_STRINGLIST *order;
+
+	memset(&model, 0, sizeof(model));
+	model.started = started;
+	model.seen = seen ? seen : rc_stringlist_new();
+	plan_model = &model;
+	order = plan_resolve(deptree, runlevel, options);
+	plan_model = NULL;
+	nametab_free(&model.seen_index);
+	if (!seen)
+		rc_stringlist_free(model.seen);
+	return order;
+}
+
+static void
+plan_start(RC_STRINGLIST *started, NAMETAB *index,
+	   const RC_STRINGLIST *order)
+{
+	const RC_STRING *s;
+
+	TAILQ_FOREACH(s, order, entries)
+		if (nametab_find(index, s->value, NULL) == DEPTREE_NONE)
+			nametab_add(index,
+			    rc_stringlist_add(started, s->value)->value);
+}
+
+/* Services started by the time rc gets to a runlevel while booting,
+ * indexed in index */
+static RC_STRINGLIST *
+plan_started(const RC_DEPTREE *deptree, const char *runlevel, int options,
+	     NAMETAB *index)
+{
+	RC_STRINGLIST *started = rc_stringlist_new();
+	RC_STRINGLIST *order;
+
+	if (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0)
+		return started;
+	order = plan_model_resolve(deptree, RC_LEVEL_SYSINIT, options,
+	    index, NULL);
+	plan_start(started, index, order);
+	rc_stringlist_free(order);
+	if (strcmp(runlevel, bootlevel) == 0)
+		return started;
+	order = plan_model_resolve(deptree, bootlevel, options, index, NULL);
+	plan_start(started, index, order);
+	rc_stringlist_free(order);
+	return started;
+}
+
+/* List each service in the order followed by the services before it in
+ * the order which it depends on */
+static RC_STRINGLIST *
+plan_after(const RC_DEPTREE *deptree, const RC_STRINGLIST *order)
+{
+	static const char *const types[] = {
+		"ineed", "iwant", "iuse", "iafter", NULL
+	};
+	RC_STRINGLIST *after = rc_stringlist_new();
+	const RC_STRING *s;
+	const uint32_t *dt, *pdt;
+	unsigned char *seen;
+	uint32_t *mark;
+	uint32_t nservices = deptree->header->nservices;
+	uint32_t di, dep, i, j, k, n, pn, type;
+	char *line;
+	size_t len, l;
+
+	seen = xmalloc(nservices + 1);
+	memset(seen, 0, nservices + 1);
+	mark = xmalloc(sizeof(*mark) * (nservices + 1));
+	for (i = 0; i < nservices; i++)
+		mark[i] = DEPTREE_NONE;
+	TAILQ_FOREACH(s, order, entries) {
+		line = xstrdup(s->value);
+		if ((di = get_service(deptree, s->value)) == DEPTREE_NONE) {
+			rc_stringlist_add(after, line);
+			free(line);
 			continue;
+		}
+		len = strlen(line);
+		for (k = 0; types[k]; k++) {
+			if ((type = get_type(deptree, types[k])) == DEPTREE_NONE)
+				continue;
+			dt = get_edges(deptree, di, type, &n);
+			for (i = 0; i < n; i++) {
+				if ((dep = dt[i]) >= nservices)
+					continue;
+				pdt = get_edges(deptree, dep,
+				    deptree->providedby, &pn);
+				for (j = 0; j < (pn ? pn : 1); j++) {
+					if (pn && (dep = pdt[j]) >= nservices)
+						continue;
+					if (!seen[dep] || mark[dep] == di)
+						continue;
+					mark[dep] = di;
+					l = strlen(DT_NAME(deptree, dep));
+					line = xrealloc(line, len + l + 2);
+					line[len++] = ' ';
+					memcpy(line + len,
+					    DT_NAME(deptree, dep), l + 1);
+					len += l;
+				}
+			}
+		}
+		seen[di] = 1;
+		rc_stringlist_add(after, line);
+		free(line);
+	}
+	free(mark);
+	free(seen);
+	return after;
+}
 
-		type = strsep(&depends, " ");
-		if (!depinfo || strcmp(depinfo->service, service) != 0) {
-			deptype = NULL;
-			depinfo = get_depinfo(deptree, service);
-			if (!depinfo) {
-				depinfo = xmalloc(sizeof(*depinfo));
-				TAILQ_INIT(&depinfo->depends);
-				depinfo->service = xstrdup(service);
-				TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+/* Compile the plan of a runlevel, header first */
+static RC_STRINGLIST *
+plan_compile(const RC_DEPTREE *deptree, const char *runlevel, int options,
+	     const RC_STRINGLIST *header)
+{
+	RC_STRINGLIST *plan = rc_stringlist_new();
+	RC_STRINGLIST *seen = rc_stringlist_new();
+	RC_STRINGLIST *started, *order, *after;
+	NAMETAB index;
+	const RC_STRING *s;
+	char buf[PATH_MAX];
+	char *line;
+
+	memset(&index, 0, sizeof(index));
+	started = plan_started(deptree, runlevel, options, &index);
+	order = plan_model_resolve(deptree, runlevel, options, &index, seen);
+	after = plan_after(deptree, order);
+
+	TAILQ_FOREACH(s, header, entries)
+		rc_stringlist_add(plan, s->value);
+	TAILQ_FOREACH(s, seen, entries) {
+		snprintf(buf, sizeof(buf), "state %s %d", s->value,
+		    nametab_find(&index, s->value, NULL) != DEPTREE_NONE ?
+		    RC_SERVICE_STARTED : 0);
+		rc_stringlist_add(plan, buf);
+	}
+	TAILQ_FOREACH(s, after, entries) {
+		line = xmalloc(strlen(s->value) + 7);
+		sprintf(line, "start %s", s->value);
+		rc_stringlist_add(plan, line);
+		free(line);
+	}
+
+	rc_stringlist_free(after);
+	rc_stringlist_free(order);
+	rc_stringlist_free(seen);
+	nametab_free(&index);
+	rc_stringlist_free(started);
+	return plan;
+}
+
+/* Can we use a plan which assumed a service was in one state while it
+ * is in another? If so, note if it has to be added to the order. */
+static bool
+plan_patch(const RC_DEPTREE *deptree, const char *service, int assumed,
+	   RC_STRINGLIST *extra)
+{
+	int state = (int)rc_service_state(service) & PLAN_STATES;
+	uint32_t di, n = 0;
+
+	if (state == assumed)
+		return true;
+	if (assumed != 0 ||
+	    (di = get_service(deptree, service)) == DEPTREE_NONE)
+		return false;
+	get_edges(deptree, di, deptree->iprovide, &n);
+	if (n)
+		return false;
+	if (state & (RC_SERVICE_STARTED | RC_SERVICE_HOTPLUGGED))
+		rc_stringlist_add(extra, service);
+	return true;
+}
+
+/* Return what rc_deptree_plan does from a plan if it matches the header,
+ * setting stale if not. Services started since it was compiled go first,
+ * as nothing waits for them. */
+static RC_STRINGLIST *
+plan_match(const RC_DEPTREE *deptree, const RC_STRINGLIST *plan,
+	   const RC_STRINGLIST *header, bool *stale)
+{
+	RC_STRINGLIST *order = rc_stringlist_new();
+	RC_STRINGLIST *extra = rc_stringlist_new();
+	const RC_STRING *s, *h = TAILQ_FIRST(header);
+	RC_STRING *e;
+	char *line, *p, *word, *svc;
+	bool ok = true;
+
+	*stale = false;
+	TAILQ_FOREACH(s, plan, entries) {
+		if (h) {
+			ok = strcmp(s->value, h->value) == 0;
+			h = TAILQ_NEXT(h, entries);
+			if (!ok) {
+				*stale = true;
+				break;
 			}
+			continue;
 		}
-
-		/* We may not have any depends */
-		if (!type || !depends)
+		if (strncmp(s->value, "start ", 6) == 0) {
+			rc_stringlist_add(order, s->value + 6);
 			continue;
+		}
+		p = line = xstrdup(s->value);
+		word = strsep(&p, " ");
+		svc = strsep(&p, " ");
+		if (svc && p && strcmp(word, "state") == 0)
+			ok = plan_patch(deptree, svc, atoi(p), extra);
+		free(line);
+		if (!ok)
+			break;
+	}
+	if (h)
+		*stale = true;
+	if (!ok || h) {
+		rc_stringlist_free(extra);
+		rc_stringlist_free(order);
+		return NULL;
+	}
+	while ((e = TAILQ_LAST(extra, rc_stringlist))) {
+		TAILQ_REMOVE(extra, e, entries);
+		TAILQ_INSERT_HEAD(order, e, entries);
+	}
+	rc_stringlist_free(extra);
+	return order;
+}
 
-		/* Get the type */
-		if (strcmp(type, "config") != 0) {
-			if (!deptype || strcmp(deptype->type, type) != 0)
-				deptype = get_deptype(depinfo, type);
-			if (!deptype) {
-				deptype = xmalloc(sizeof(*deptype));
-				deptype->type = xstrdup(type);
-				deptype->services = rc_stringlist_new();
-				TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
-			}
+static RC_STRINGLIST *
+plan_read(const char *file)
+{
+	RC_STRINGLIST *plan;
+	char *text, *p, *line;
+
+	if (!(text = file_read(file, FILE_MAX_SIZE)))
+		return NULL;
+	plan = rc_stringlist_new();
+	p = text;
+	while ((line = strsep(&p, "\n")))
+		if (*line)
+			rc_stringlist_add(plan, line);
+	free(text);
+	return plan;
+}
+
+/* Compile and save the plan of a runlevel */
+static RC_STRINGLIST *
+plan_save(const RC_DEPTREE *deptree, const char *runlevel, int options,
+	  const RC_STRINGLIST *header)
+{
+	RC_STRINGLIST *plan = plan_compile(deptree, runlevel, options, header);
+	char file[PATH_MAX];
+
+	snprintf(file, sizeof(file), RC_DEPPLAN "/%s", runlevel);
+	depcache_write(file, plan, NULL);
+	return plan;
+}
+
+/* Compile the plans of every runlevel the way rc will use them */
+static void
+plan_save_all(const RC_DEPTREE *deptree)
+{
+	RC_STRINGLIST *levels = rc_runlevel_list();
+	RC_STRINGLIST *header;
+	RC_STRING *s;
+	const int options = RC_DEP_STRICT | RC_DEP_TRACE;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+	TAILQ_FOREACH(s, levels, entries) {
+		header = plan_header(deptree, s->value, options);
+		rc_stringlist_free(plan_save(deptree, s->value, options,
+		    header));
+		rc_stringlist_free(header);
+	}
+	rc_stringlist_free(levels);
+}
+
+RC_STRINGLIST *
+rc_deptree_plan(const RC_DEPTREE *deptree, const char *runlevel, int options)
+{
+	RC_STRINGLIST *header, *plan, *order = NULL;
+	char file[PATH_MAX];
+	bool stale = true;
+
+	bootlevel = getenv("RC_BOOTLEVEL");
+	if (!bootlevel)
+		bootlevel = RC_LEVEL_BOOT;
+
+	/* The order depends on who is asking */
+	if (!getenv("RC_SVCNAME")) {
+		header = plan_header(deptree, runlevel, options);
+		snprintf(file, sizeof(file), RC_DEPPLAN "/%s", runlevel);
+		if ((plan = plan_read(file))) {
+			order = plan_match(deptree, plan, header, &stale);
+			rc_stringlist_free(plan);
+		}
+		if (stale) {
+			plan = plan_save(deptree, runlevel, options, header);
+			order = plan_match(deptree, plan, header, &stale);
+			rc_stringlist_free(plan);
 		}
+		rc_stringlist_free(header);
+		if (order)
+			return order;
+	}
 
-		/* Now add each depend to our type.
-		   We do this individually so we handle multiple spaces gracefully */
-		while ((depend = strsep(&depends, " ")))
-		{
-			if (depend[0] == 0)
-				continue;
+	/* Things are not as the plan assumed, so resolve it now */
+	order = plan_resolve(deptree, runlevel, options);
+	plan = plan_after(deptree, order);
+	rc_stringlist_free(order);
+	return plan;
+}
+librc_hidden_def(rc_deptree_plan)
+
+/* Dependency cycles.
+ * A cycle of services which start after each other can never start,
+ * they just wait on each other until they time out. So when we build
+ * the deptree we find the strongly connected components of the graph
+ * of what starts after what, and break each cycle for good by dropping
+ * the weakest dependencies we can. Which ones depends only on the names
+ * of the services and what they depend on, so it's always the same for
+ * the same scripts. Each service in a cycle lists all of its members
+ * as its cycle dependency, and the dependencies we dropped from it as
+ * type:service in its cyclebreak dependency. */
+static const char *const cycle_types[] = {
+	"ineed", "iwant", "iuse", "iafter", NULL
+};
+
+typedef struct cycle_edge
+{
+	uint32_t to;
+	uint32_t type;
+	const char *depend;
+} CYCLE_EDGE;
+
+typedef struct cycle_graph
+{
+	const DEPINDEX *index;
+	/* Edges of node n run from first[n] to first[n + 1] */
+	uint32_t *first;
+	CYCLE_EDGE *edges;
+	uint32_t nedges;
+} CYCLE_GRAPH;
+
+/* Return a type of a service, adding it if it has none */
+static RC_DEPTYPE *
+deptype_add(RC_DEPINFO *depinfo, const char *type)
+{
+	RC_DEPTYPE *dt = get_deptype(depinfo, type);
+
+	if (!dt) {
+		dt = xmalloc(sizeof(*dt));
+		dt->type = xstrdup(type);
+		dt->services = rc_stringlist_new();
+		TAILQ_INSERT_TAIL(&depinfo->depends, dt, entries);
+	}
+	return dt;
+}
+
+static uint32_t
+depindex_id(const DEPINDEX *index, const char *service)
+{
+	uint32_t id = nametab_find(&index->names, service, NULL);
 
-			if (strcmp(type, "config") == 0) {
-				rc_stringlist_addu(config, depend);
+	if (id == DEPTREE_NONE || !index->info[id])
+		return DEPTREE_NONE;
+	return id;
+}
+
+static void
+cycle_edge_add(CYCLE_GRAPH *g, uint32_t to, uint32_t type,
+	       const char *depend)
+{
+	if (to == DEPTREE_NONE)
+		return;
+	if (g->edges) {
+		g->edges[g->nedges].to = to;
+		g->edges[g->nedges].type = type;
+		g->edges[g->nedges].depend = depend;
+	}
+	g->nedges++;
+}
+
+/* Services start after what they depend on, or after every provider
+ * of it if it's virtual. We count the edges, then fill them in. */
+static void
+cycle_graph_fill(CYCLE_GRAPH *g)
+{
+	const DEPINDEX *index = g->index;
+	RC_DEPINFO *di, *dep;
+	RC_DEPTYPE *dt, *provided;
+	RC_STRING *s, *p;
+	uint32_t id, t;
+
+	g->nedges = 0;
+	for (id = 0; id < index->names.count; id++) {
+		g->first[id] = g->nedges;
+		if (!(di = index->info[id]))
+			continue;
+		for (t = 0; cycle_types[t]; t++) {
+			if (!(dt = get_deptype(di, cycle_types[t])))
 				continue;
+			TAILQ_FOREACH(s, dt->services, entries) {
+				if (!(dep = get_depinfo(index, s->value)))
+					continue;
+				if (!(provided = get_deptype(dep, "providedby"))) {
+					cycle_edge_add(g, depindex_id(index,
+					    dep->service), t, s->value);
+					continue;
+				}
+				TAILQ_FOREACH(p, provided->services, entries)
+					cycle_edge_add(g, depindex_id(index,
+					    p->value), t, s->value);
 			}
+		}
+	}
+	g->first[id] = g->nedges;
+}
 
-			/* Don't provide ourself */
-			if (strcmp(type, "iprovide") == 0 &&
-			    strcmp(depend, service) == 0)
-				continue;
+static int
+cycle_cmp(const void *a, const void *b)
+{
+	const RC_DEPINFO *const *da = a;
+	const RC_DEPINFO *const *db = b;
 
-			/* .sh files are not init scripts */
-			l = strlen(depend);
-			if (l > 2 &&
-			    depend[l - 3] == '.' &&
-			    depend[l - 2] == 's' &&
-			    depend[l - 1] == 'h')
-				continue;
+	return strcmp((*da)->service, (*db)->service);
+}
+
+/* Find the strongly connected components of the graph with Tarjan's
+ * algorithm, without recursing as the graph can be deep.
+ * Each node gets the number of its component in comp. */
+static uint32_t
+cycle_components(const CYCLE_GRAPH *g, uint32_t nnodes, uint32_t *comp)
+{
+	uint32_t *order = xmalloc(sizeof(*order) * nnodes);
+	uint32_t *low = xmalloc(sizeof(*low) * nnodes);
+	uint32_t *cursor = xmalloc(sizeof(*cursor) * nnodes);
+	uint32_t *stack = xmalloc(sizeof(*stack) * nnodes);
+	uint32_t *calls = xmalloc(sizeof(*calls) * nnodes);
+	uint32_t ncomps = 0, next = 0, sp = 0, cp, root, n, to, m;
 
-			/* Remove our dependency if instructed */
-			if (depend[0] == '!') {
-				rc_stringlist_delete(deptype->services, depend + 1);
+	for (n = 0; n < nnodes; n++) {
+		order[n] = DEPTREE_NONE;
+		comp[n] = DEPTREE_NONE;
+	}
+	for (root = 0; root < nnodes; root++) {
+		if (order[root] != DEPTREE_NONE)
+			continue;
+		cp = 0;
+		calls[cp++] = root;
+		order[root] = low[root] = next++;
+		cursor[root] = g->first[root];
+		stack[sp++] = root;
+		while (cp) {
+			n = calls[cp - 1];
+			if (cursor[n] < g->first[n + 1]) {
+				to = g->edges[cursor[n]++].to;
+				if (order[to] == DEPTREE_NONE) {
+					order[to] = low[to] = next++;
+					cursor[to] = g->first[to];
+					stack[sp++] = to;
+					calls[cp++] = to;
+				} else if (comp[to] == DEPTREE_NONE &&
+				    order[to] < low[n])
+					low[n] = order[to];
 				continue;
 			}
+			cp--;
+			if (cp && low[n] < low[calls[cp - 1]])
+				low[calls[cp - 1]] = low[n];
+			if (low[n] != order[n])
+				continue;
+			do {
+				m = stack[--sp];
+				comp[m] = ncomps;
+			} while (m != n);
+			ncomps++;
+		}
+	}
+	free(order);
+	free(low);
+	free(cursor);
+	free(stack);
+	free(calls);
+	return ncomps;
+}
+
+/* Can we start a service once those marked done in this pass have,
+ * looking at the dependencies kept so far of types up to last? */
+static bool
+cycle_ready(const CYCLE_GRAPH *g, uint32_t n, uint32_t c,
+	    const uint32_t *comp, const unsigned char *state,
+	    const unsigned char *dropped, uint32_t pass, uint32_t last)
+{
+	const CYCLE_EDGE *e;
+	uint32_t i;
+
+	for (i = g->first[n]; i < g->first[n + 1]; i++) {
+		e = g->edges + i;
+		if (!dropped[i] && e->type <= last && comp[e->to] == c &&
+		    state[e->to] != pass)
+			return false;
+	}
+	return true;
+}
+
+/* Drop the dependencies of a type a service has on those not done yet */
+static void
+cycle_drop_type(const CYCLE_GRAPH *g, uint32_t n, uint32_t c,
+		const uint32_t *comp, const unsigned char *state,
+		unsigned char *dropped, uint32_t pass, uint32_t type)
+{
+	RC_DEPINFO *di = g->index->info[n];
+	RC_DEPTYPE *dt;
+	const CYCLE_EDGE *e;
+	uint32_t i, j;
+	size_t l;
+	char *value;
 
-			rc_stringlist_add(deptype->services, depend);
+	for (i = g->first[n]; i < g->first[n + 1]; i++) {
+		e = g->edges + i;
+		if (dropped[i] || e->type != type || comp[e->to] != c ||
+		    state[e->to] == pass)
+			continue;
+		/* Dropping a virtual dependency drops all its providers */
+		for (j = g->first[n]; j < g->first[n + 1]; j++)
+			if (g->edges[j].type == type &&
+			    strcmp(g->edges[j].depend, e->depend) == 0)
+				dropped[j] = 1;
+		l = strlen(cycle_types[type]) + strlen(e->depend) + 2;
+		value = xmalloc(l);
+		snprintf(value, l, "%s:%s", cycle_types[type], e->depend);
+		dt = deptype_add(di, "cyclebreak");
+		if (rc_stringlist_addu(dt->services, value))
+			fprintf(stderr,
+			    "Breaking a dependency cycle at `%s' %s `%s'\n",
+			    di->service, cycle_types[type], e->depend);
+		free(value);
+	}
+}
 
-			/* We need to allow `after *; before local;` to work.
-			 * Conversely, we need to allow 'before *; after modules' also */
-			/* If we're before something, remove us from the after list */
-			if (strcmp(type, "ibefore") == 0) {
-				if ((dt = get_deptype(depinfo, "iafter")))
-					rc_stringlist_delete(dt->services, depend);
+/* Break the cycles in a component by dropping the weakest dependencies
+ * we can. We add the types one at a time, strongest first. What we kept
+ * of the stronger types has no cycles, so we start services in name
+ * order as their dependencies allow and when none can start, we take the
+ * first one which only waits on the type we are adding and drop those
+ * dependencies. So a need is only dropped from a cycle of needs. */
+static void
+cycle_break(const CYCLE_GRAPH *g, RC_DEPINFO **members, uint32_t nmembers,
+	    const uint32_t *comp, unsigned char *state,
+	    unsigned char *dropped)
+{
+	const DEPINDEX *index = g->index;
+	uint32_t c, i, n, pick, left, type;
+	bool started;
+
+	c = comp[depindex_id(index, members[0]->service)];
+	for (type = 0; cycle_types[type]; type++) {
+		/* Services done in this pass are marked with its number */
+		left = nmembers;
+		while (left) {
+			started = false;
+			for (i = 0; i < nmembers; i++) {
+				n = depindex_id(index, members[i]->service);
+				if (state[n] == type + 1 ||
+				    !cycle_ready(g, n, c, comp, state,
+					dropped, type + 1, type))
+					continue;
+				state[n] = type + 1;
+				left--;
+				started = true;
 			}
-			/* If we're after something, remove us from the before list */
-			if (strcmp(type, "iafter") == 0 ||
-			    strcmp(type, "ineed") == 0 ||
-			    strcmp(type, "iwant") == 0 ||
-			    strcmp(type, "iuse") == 0) {
-				if ((dt = get_deptype(depinfo, "ibefore")))
-					rc_stringlist_delete(dt->services, depend);
+			if (started)
+				continue;
+			pick = DEPTREE_NONE;
+			for (i = 0; i < nmembers; i++) {
+				n = depindex_id(index, members[i]->service);
+				if (state[n] == type + 1)
+					continue;
+				if (pick == DEPTREE_NONE)
+					pick = n;
+				if (type == 0 || cycle_ready(g, n, c, comp,
+					state, dropped, type + 1, type - 1))
+				{
+					pick = n;
+					break;
+				}
 			}
+			cycle_drop_type(g, pick, c, comp, state, dropped,
+			    type + 1, type);
+			state[pick] = type + 1;
+			left--;
 		}
 	}
-	free(line);
-	pclose(fp);
+}
+
+/* Drop the dependencies we broke, and their backlinks */
+static void
+cycle_drop(const DEPINDEX *index, RC_DEPINFO *depinfo)
+{
+	RC_DEPTYPE *breaks = get_deptype(depinfo, "cyclebreak");
+	RC_DEPTYPE *dt;
+	RC_DEPINFO *di;
+	RC_STRING *s;
+	char *type, *depend;
+	size_t i;
+
+	if (!breaks)
+		return;
+	TAILQ_FOREACH(s, breaks->services, entries) {
+		depend = xstrdup(s->value);
+		type = strsep(&depend, ":");
+		if (!depend) {
+			free(type);
+			continue;
+		}
+		if ((dt = get_deptype(depinfo, type)))
+			while (rc_stringlist_delete(dt->services, depend))
+				;
+		for (i = 0; deppairs[i].depend; i++)
+			if (strcmp(deppairs[i].depend, type) == 0)
+				break;
+		if (deppairs[i].depend && (di = get_depinfo(index, depend)) &&
+		    (dt = get_deptype(di, deppairs[i].addto)))
+			while (rc_stringlist_delete(dt->services,
+				depinfo->service))
+				;
+		free(type);
+	}
+}
+
+static void
+break_cycles(const DEPINDEX *index)
+{
+	CYCLE_GRAPH g;
+	RC_DEPINFO **members;
+	RC_DEPTYPE *dt;
+	uint32_t nnodes = index->names.count;
+	uint32_t *comp, *start, *calls;
+	unsigned char *state, *dropped;
+	uint32_t ncomps, c, n, i, j;
+
+	if (!nnodes)
+		return;
+	memset(&g, 0, sizeof(g));
+	g.index = index;
+	g.first = xmalloc(sizeof(*g.first) * (nnodes + 1));
+	cycle_graph_fill(&g);
+	g.edges = xmalloc(sizeof(*g.edges) * (g.nedges + 1));
+	cycle_graph_fill(&g);
+
+	comp = xmalloc(sizeof(*comp) * nnodes);
+	ncomps = cycle_components(&g, nnodes, comp);
+
+	/* Group the members of each component together */
+	start = xmalloc(sizeof(*start) * (ncomps + 1));
+	memset(start, 0, sizeof(*start) * (ncomps + 1));
+	for (n = 0; n < nnodes; n++)
+		start[comp[n] + 1]++;
+	for (c = 0; c < ncomps; c++)
+		start[c + 1] += start[c];
+	members = xmalloc(sizeof(*members) * nnodes);
+	calls = xmalloc(sizeof(*calls) * nnodes);
+	memset(calls, 0, sizeof(*calls) * nnodes);
+	for (n = 0; n < nnodes; n++)
+		members[calls[comp[n]]++ + start[comp[n]]] = index->info[n];
+
+	dropped = xmalloc(g.nedges + 1);
+	memset(dropped, 0, g.nedges + 1);
+	state = xmalloc(nnodes);
+	memset(state, 0, nnodes);
+	for (c = 0; c < ncomps; c++) {
+		i = start[c + 1] - start[c];
+		if (i < 2)
+			continue;
+		qsort(members + start[c], i, sizeof(*members), cycle_cmp);
+		/* The first member lists the whole cycle, the others
+		 * just point to it so big cycles stay cheap */
+		dt = deptype_add(members[start[c]], "cycle");
+		for (n = 0; n < i; n++)
+			rc_stringlist_add(dt->services,
+			    members[start[c] + n]->service);
+		for (j = 1; j < i; j++) {
+			dt = deptype_add(members[start[c] + j], "cycle");
+			rc_stringlist_add(dt->services,
+			    members[start[c]]->service);
+		}
+		cycle_break(&g, members + start[c], i, comp, state, dropped);
+	}
+	for (n = 0; n < nnodes; n++)
+		if (start[comp[n] + 1] - start[comp[n]] > 1)
+			cycle_drop(index, index->info[n]);
+
+	free(dropped);
+	free(state);
+	free(calls);
+	free(members);
+	free(start);
+	free(comp);
+	free(g.edges);
+	free(g.first);
+}
+
+RC_STRINGLIST *
+rc_deptree_cycles(const RC_DEPTREE *deptree)
+{
+	RC_STRINGLIST *cycles = rc_stringlist_new();
+	uint32_t type = get_type(deptree, "cycle");
+	const uint32_t *dt;
+	uint32_t i, j, n;
+	size_t l;
+	char *line, *p;
+
+	for (i = 0; i < deptree->header->nservices; i++) {
+		/* Only the first member lists the whole cycle */
+		dt = get_edges(deptree, i, type, &n);
+		if (!n || dt[0] != i)
+			continue;
+		l = 0;
+		for (j = 0; j < n; j++)
+			l += strlen(DT_NAME(deptree, dt[j])) + 1;
+		p = line = xmalloc(l);
+		for (j = 0; j < n; j++)
+			p += sprintf(p, "%s%s", j ? " " : "",
+			    DT_NAME(deptree, dt[j]));
+		rc_stringlist_add(cycles, line);
+		free(line);
+	}
+	rc_stringlist_sort(&cycles);
+	return cycles;
+}
+librc_hidden_def(rc_deptree_cycles)
+
+/* This is an 8 phase operation
+   Phase 1 is a shell script which loads each init script and config in turn
+   and echos their dependency info to stdout
+   Phase 2 takes that and populates a depinfo object with that data
+   Phase 3 adds any provided services to the depinfo object
+   Phase 4 scans that depinfo object and puts in backlinks
+   Phase 5 removes broken before dependencies
+   Phase 6 breaks dependency cycles
+   Phase 7 looks for duplicate services indicating a real and virtual service
+   with the same names
+   Phase 8 saves the depinfo object to disk
+   */
+static bool
+deptree_update(void)
+{
+	FILE *fp;
+	char tmp[PATH_MAX];
+	RC_DEPLIST *deptree, *providers, *removed;
+	RC_DEPTREE *compiled;
+	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
+	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
+	RC_STRINGLIST *config, *types, *sorted, *manifest, *keys;
+	RC_STRING *s, *s_np, *s2;
+	DEPINDEX index;
+	NAMETAB set;
+	size_t len;
+	char *nosys, *onosys;
+	size_t i, k;
+	bool retval = true;
+	const char *sys = rc_sys();
+	struct utsname uts;
+	int gen;
+	time_t since;
+
+	/* Some init scripts need RC_LIBEXECDIR to source stuff
+	   Ideally we should be setting our full env instead */
+	if (!getenv("RC_LIBEXECDIR"))
+		setenv("RC_LIBEXECDIR", RC_LIBEXECDIR, 0);
+
+	if (uname(&uts) == 0)
+		setenv("RC_UNAME", uts.sysname, 1);
+
+	/* Note what we are built from before we look at it, so anything
+	 * changing while we work makes us stale */
+	since = time(NULL);
+	manifest = rc_stringlist_new();
+	for (i = 0; depend_roots[i]; i++)
+		manifest_walk(manifest, depend_roots[i]);
+
+	/* Phase 1 - source all init scripts and print dependencies */
+	deptree = xmalloc(sizeof(*deptree));
+	TAILQ_INIT(deptree);
+	memset(&index, 0, sizeof(index));
+	config = rc_stringlist_new();
+	if ((gen = gendepends(deptree, &index, config, true)) == 1) {
+		/* Someone pulled our cache from under us, so start again */
+		depindex_free(&index);
+		deplist_free(deptree);
+		rc_stringlist_free(config);
+		deptree = xmalloc(sizeof(*deptree));
+		TAILQ_INIT(deptree);
+		config = rc_stringlist_new();
+		gen = gendepends(deptree, &index, config, false);
+	}
+	if (gen != 0) {
+		depindex_free(&index);
+		deplist_free(deptree);
+		rc_stringlist_free(config);
+		rc_stringlist_free(manifest);
+		return false;
+	}
 
 	/* Phase 2 - if we're a special system, remove services that don't
-	 * work for them. This doesn't stop them from being run directly. */
+	 * work for them. This doesn't stop them from being run directly.
+	 * We note what they are and provide, then take that out of
+	 * everything else in one go. */
+	removed = xmalloc(sizeof(*removed));
+	TAILQ_INIT(removed);
+	memset(&set, 0, sizeof(set));
 	if (sys) {
 		len = strlen(sys);
 		nosys = xmalloc(len + 2);
@@ -865,32 +4331,47 @@ rc_deptree_update(void)
 			onosys[i + 2] = (char)tolower((unsigned char)sys[i]);
 		onosys[i + 2] = '\0';
 
-		TAILQ_FOREACH_SAFE(depinfo, deptree, entries, depinfo_np)
-			if ((deptype = get_deptype(depinfo, "keyword")))
-				TAILQ_FOREACH(s, deptype->services, entries)
-					if (strcmp(s->value, nosys) == 0 ||
-					    strcmp(s->value, onosys) == 0)
-					{
-						provide = get_deptype(depinfo, "iprovide");
-						TAILQ_REMOVE(deptree, depinfo, entries);
-						TAILQ_FOREACH(di, deptree, entries) {
-							TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
-								rc_stringlist_delete(dt->services, depinfo->service);
-								if (provide)
-									TAILQ_FOREACH(s2, provide->services, entries)
-										rc_stringlist_delete(dt->services, s2->value);
-								if (!TAILQ_FIRST(dt->services)) {
-									TAILQ_REMOVE(&di->depends, dt, entries);
-									free(dt->type);
-									free(dt->services);
-									free(dt);
-								}
-							}
-						}
-					}
+		TAILQ_FOREACH_SAFE(depinfo, deptree, entries, depinfo_np) {
+			if (!(deptype = get_deptype(depinfo, "keyword")))
+				continue;
+			TAILQ_FOREACH(s, deptype->services, entries)
+				if (strcmp(s->value, nosys) == 0 ||
+				    strcmp(s->value, onosys) == 0)
+					break;
+			if (!s)
+				continue;
+			TAILQ_REMOVE(deptree, depinfo, entries);
+			TAILQ_INSERT_TAIL(removed, depinfo, entries);
+			depindex_del(&index, depinfo);
+			nametab_add(&set, depinfo->service);
+			if ((provide = get_deptype(depinfo, "iprovide")))
+				TAILQ_FOREACH(s, provide->services, entries)
+					nametab_add(&set, s->value);
+		}
 		free(nosys);
 		free(onosys);
 	}
+	if (set.count)
+		TAILQ_FOREACH(di, deptree, entries)
+			TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
+				if (meta_type(dt->type))
+					continue;
+				TAILQ_FOREACH_SAFE(s, dt->services, entries, s_np)
+					if (nametab_find(&set, s->value, NULL) !=
+					    DEPTREE_NONE)
+					{
+						TAILQ_REMOVE(dt->services, s, entries);
+						free(s->value);
+						free(s);
+					}
+				if (!TAILQ_FIRST(dt->services)) {
+					TAILQ_REMOVE(&di->depends, dt, entries);
+					free(dt->type);
+					free(dt->services);
+					free(dt);
+				}
+			}
+	nametab_free(&set);
 
 	/* Phase 3 - add our providers to the tree */
 	providers = xmalloc(sizeof(*providers));
@@ -898,27 +4379,41 @@ rc_deptree_update(void)
 	TAILQ_FOREACH(depinfo, deptree, entries)
 		if ((deptype = get_deptype(depinfo, "iprovide")))
 			TAILQ_FOREACH(s, deptype->services, entries) {
-				TAILQ_FOREACH(di, providers, entries)
-					if (strcmp(di->service, s->value) == 0)
-						break;
-				if (!di) {
-					di = xmalloc(sizeof(*di));
-					TAILQ_INIT(&di->depends);
-					di->service = xstrdup(s->value);
-					TAILQ_INSERT_TAIL(providers, di, entries);
-				}
+				if (nametab_find(&set, s->value, NULL) !=
+				    DEPTREE_NONE)
+					continue;
+				di = xmalloc(sizeof(*di));
+				TAILQ_INIT(&di->depends);
+				di->service = xstrdup(s->value);
+				TAILQ_INSERT_TAIL(providers, di, entries);
+				nametab_add(&set, di->service);
 			}
+	nametab_free(&set);
+	TAILQ_FOREACH(di, providers, entries)
+		depindex_add(&index, di);
 	TAILQ_CONCAT(deptree, providers, entries);
 	free(providers);
 
-	/* Phase 4 - backreference our depends */
+	/* Phase 4 - backreference our depends.
+	 * Note what we already have of the types we add to, so we can add
+	 * each service to them just once without scanning them. */
+	keys = rc_stringlist_new();
+	TAILQ_FOREACH(depinfo, deptree, entries)
+		for (i = 0; deppairs[i].depend; i++) {
+			deptype = get_deptype(depinfo, deppairs[i].addto);
+			if (!deptype)
+				continue;
+			TAILQ_FOREACH(s, deptype->services, entries)
+				depset_add(&set, keys, depinfo->service,
+				    deptype->type, s->value);
+		}
 	TAILQ_FOREACH(depinfo, deptree, entries)
 		for (i = 0; deppairs[i].depend; i++) {
 			deptype = get_deptype(depinfo, deppairs[i].depend);
 			if (!deptype)
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
-				di = get_depinfo(deptree, s->value);
+				di = get_depinfo(&index, s->value);
 				if (!di) {
 					if (strcmp(deptype->type, "ineed") == 0) {
 						fprintf(stderr,
@@ -937,6 +4432,9 @@ rc_deptree_update(void)
 					continue;
 				}
 
+				if (!depset_add(&set, keys, di->service,
+					deppairs[i].addto, depinfo->service))
+					continue;
 				dt = get_deptype(di, deppairs[i].addto);
 				if (!dt) {
 					dt = xmalloc(sizeof(*dt));
@@ -944,12 +4442,15 @@ rc_deptree_update(void)
 					dt->services = rc_stringlist_new();
 					TAILQ_INSERT_TAIL(&di->depends, dt, entries);
 				}
-				rc_stringlist_addu(dt->services, depinfo->service);
+				rc_stringlist_add(dt->services, depinfo->service);
 			}
 		}
+	nametab_free(&set);
+	rc_stringlist_free(keys);
 
-
-	/* Phase 5 - Remove broken before directives */
+	/* Phase 5 - Remove broken before directives.
+	 * We cannot be before anything we depend on directly, or anything
+	 * provided by what we depend on directly. */
 	types = rc_stringlist_new();
 	rc_stringlist_add(types, "ineed");
 	rc_stringlist_add(types, "iwant");
@@ -960,97 +4461,100 @@ rc_deptree_update(void)
 		if (!deptype)
 			continue;
 		sorted = rc_stringlist_new();
-		visited = rc_stringlist_new();
-		visit_service(deptree, types, sorted, visited, depinfo,
-			      NULL, 0);
-		rc_stringlist_free(visited);
-		TAILQ_FOREACH_SAFE(s2, deptype->services, entries, s2_np) {
-			TAILQ_FOREACH(s3, sorted, entries) {
-				di = get_depinfo(deptree, s3->value);
-				if (!di)
-					continue;
-				if (strcmp(s2->value, s3->value) == 0) {
-					dt = get_deptype(di, "iafter");
-					if (dt)
-						rc_stringlist_delete(dt->services, depinfo->service);
-					break;
-				}
-				dt = get_deptype(di, "iprovide");
-				if (!dt)
-					continue;
-				TAILQ_FOREACH(s4, dt->services, entries) {
-					if (strcmp(s4->value, s2->value) == 0)
-						break;
-				}
-				if (s4) {
-					di = get_depinfo(deptree, s4->value);
-					if (di) {
-						dt = get_deptype(di, "iafter");
-						if (dt)
-							rc_stringlist_delete(dt->services, depinfo->service);
-					}
-					break;
-				}
-			}
-			if (s3)
-				rc_stringlist_delete(deptype->services, s2->value);
+		direct_depends(types, sorted, depinfo);
+		TAILQ_FOREACH(s, sorted, entries) {
+			if (!(di = get_depinfo(&index, s->value)))
+				continue;
+			nametab_add(&set, s->value);
+			if ((dt = get_deptype(di, "iprovide")))
+				TAILQ_FOREACH(s2, dt->services, entries)
+					nametab_add(&set, s2->value);
+		}
+		TAILQ_FOREACH_SAFE(s, deptype->services, entries, s_np) {
+			if (nametab_find(&set, s->value, NULL) == DEPTREE_NONE)
+				continue;
+			di = get_depinfo(&index, s->value);
+			if (di && (dt = get_deptype(di, "iafter")))
+				rc_stringlist_delete(dt->services, depinfo->service);
+			TAILQ_REMOVE(deptype->services, s, entries);
+			free(s->value);
+			free(s);
 		}
+		nametab_free(&set);
 		rc_stringlist_free(sorted);
 	}
 	rc_stringlist_free(types);
 
-	/* Phase 6 - Print errors for duplicate services */
-	dupes = rc_stringlist_new();
+	/* Phase 6 - Break dependency cycles */
+	break_cycles(&index);
+
+	/* Phase 7 - Print errors for duplicate services */
 	TAILQ_FOREACH(depinfo, deptree, entries) {
-		serrno = errno;
-		errno = 0;
-		rc_stringlist_addu(dupes,depinfo->service);
-		if (errno == EEXIST) {
+		if (nametab_find(&set, depinfo->service, NULL) == DEPTREE_NONE)
+			nametab_add(&set, depinfo->service);
+		else
 			fprintf(stderr,
 					"Error: %s is the name of a real and virtual service.\n",
 					depinfo->service);
-		}
-		errno = serrno;
 	}
-	rc_stringlist_free(dupes);
+	nametab_free(&set);
 
-	/* Phase 7 - save to disk
+	/* Phase 8 - save to disk
 	   Now that we're purely in C, do we need to keep a shell parseable file?
 	   I think yes as then it stays human readable
 	   This works and should be entirely shell parseable provided that depend
 	   names don't have any non shell variable characters in
+	   We then save the binary image which is what we actually load.
+	   Both are renamed into place so loaders never see half of one, and
+	   the old image goes first so it can't be taken for the new text.
 	   */
-	if ((fp = fopen(RC_DEPTREE_CACHE, "w"))) {
+	unlink(RC_DEPTREE_BIN);
+	unlink(RC_DEPMANIFEST);
+	if ((fp = atomic_open(RC_DEPTREE_CACHE, tmp, sizeof(tmp)))) {
 		i = 0;
 		TAILQ_FOREACH(depinfo, deptree, entries) {
-			fprintf(fp, "depinfo_%zu_service='%s'\n",
-				i, depinfo->service);
+			fprintf(fp, "depinfo_%zu_service=", i);
+			put_shell_value(fp, depinfo->service);
 			TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
 				k = 0;
 				TAILQ_FOREACH(s, deptype->services, entries) {
-					fprintf(fp,
-						"depinfo_%zu_%s_%zu='%s'\n",
-						i, deptype->type, k, s->value);
+					fprintf(fp, "depinfo_%zu_%s_%zu=",
+						i, deptype->type, k);
+					put_shell_value(fp, s->value);
 					k++;
 				}
 			}
 			i++;
 		}
-		fclose(fp);
+		if (!atomic_close(fp, tmp, RC_DEPTREE_CACHE)) {
+			fprintf(stderr, "save `%s': %s\n",
+				RC_DEPTREE_CACHE, strerror(errno));
+			retval = false;
+		}
 	} else {
 		fprintf(stderr, "fopen `%s': %s\n",
 			RC_DEPTREE_CACHE, strerror(errno));
 		retval = false;
 	}
+	if (retval) {
+		compiled = deptree_compile(deptree, since);
+		if (!deptree_save(compiled, RC_DEPTREE_BIN)) {
+			fprintf(stderr, "save `%s': %s\n",
+				RC_DEPTREE_BIN, strerror(errno));
+			retval = false;
+		} else
+			plan_save_all(compiled);
+		rc_deptree_free(compiled);
+	}
+	/* Look at the new paths next time we're asked */
+	rc_deptree_free(paths_tree);
+	paths_tree = NULL;
+	paths_checked = false;
 
 	/* Save our external config files to disk */
 	if (TAILQ_FIRST(config)) {
-		if ((fp = fopen(RC_DEPCONFIG, "w"))) {
-			TAILQ_FOREACH(s, config, entries)
-				fprintf(fp, "%s\n", s->value);
-			fclose(fp);
-		} else {
-			fprintf(stderr, "fopen `%s': %s\n",
+		if (!depcache_write(RC_DEPCONFIG, config, NULL)) {
+			fprintf(stderr, "save `%s': %s\n",
 				RC_DEPCONFIG, strerror(errno));
 			retval = false;
 		}
@@ -1058,8 +4562,41 @@ rc_deptree_update(void)
 		unlink(RC_DEPCONFIG);
 	}
 
+	if (retval) {
+		TAILQ_FOREACH(s, config, entries)
+			manifest_walk(manifest, s->value);
+		manifest_save(manifest);
+	}
+	rc_stringlist_free(manifest);
 	rc_stringlist_free(config);
-	rc_deptree_free(deptree);
+	depindex_free(&index);
+	deplist_free(deptree);
+	deplist_free(removed);
+	return retval;
+}
+
+/* Only one of us rebuilds the deptree at a time. Anyone else waits for
+ * it to be published, which is as new as what they would have built
+ * unless something changed again meanwhile. */
+bool
+rc_deptree_update(void)
+{
+	int fd;
+	int r;
+	bool retval;
+
+	fd = open(RC_DEPLOCK, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		while ((r = flock(fd, LOCK_EX)) == -1 && errno == EINTR)
+			;
+		if (r == 0 && !rc_deptree_update_needed(NULL, NULL)) {
+			close(fd);
+			return true;
+		}
+	}
+	retval = deptree_update();
+	if (fd != -1)
+		close(fd);
 	return retval;
 }
 librc_hidden_def(rc_deptree_update)
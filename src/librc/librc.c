@@ -17,6 +17,17 @@
 
 const char librc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 
+#include <sys/file.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#  include <sys/inotify.h>
+#  include <sys/vfs.h>
+#endif
+
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+
 #include "queue.h"
 #include "librc.h"
 #include <helpers.h>
@@ -25,6 +36,9 @@ const char librc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #endif
 
 #define RC_RUNLEVEL	RC_SVCDIR "/softlevel"
+#define RC_STATETAB	RC_SVCDIR "/statetab"
+#define RC_STATEDIR	RC_SVCDIR "/state"
+#define RC_OPTIONSDIR	RC_SVCDIR "/options"
 
 #ifndef S_IXUGO
 #  define S_IXUGO (S_IXUSR | S_IXGRP | S_IXOTH)
@@ -55,48 +69,60 @@ static const rc_service_state_name_t rc_service_state_names[] = {
 
 #define LS_INITD	0x01
 #define LS_DIR		0x02
+
+/* Check an entry of a directory we're reading exists, following links,
+ * and say if it's a directory. d_type tells us without a stat unless
+ * it's a link or the filesystem doesn't fill it in. */
+static bool
+ls_stat(DIR *dp, const struct dirent *d, bool *isdir)
+{
+	struct stat buf;
+
+#ifdef DT_UNKNOWN
+	if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
+		*isdir = d->d_type == DT_DIR;
+		return true;
+	}
+#endif
+	if (fstatat(dirfd(dp), d->d_name, &buf, 0) != 0)
+		return false;
+	*isdir = S_ISDIR(buf.st_mode);
+	return true;
+}
+
 static RC_STRINGLIST *
 ls_dir(const char *dir, int options)
 {
 	DIR *dp;
 	struct dirent *d;
 	RC_STRINGLIST *list = NULL;
-	struct stat buf;
 	size_t l;
-	char file[PATH_MAX];
-	int r;
+	bool isdir;
 
 	list = rc_stringlist_new();
 	if ((dp = opendir(dir)) == NULL)
 		return list;
 	while (((d = readdir(dp)) != NULL)) {
-		if (d->d_name[0] != '.') {
-			if (options & LS_INITD) {
-				/* Check that our file really exists.
-				 * This is important as a service maybe in a
-				 * runlevel, but could have been removed. */
-				snprintf(file, sizeof(file), "%s/%s",
-				    dir, d->d_name);
-				r = stat(file, &buf);
-				if (r != 0)
-					continue;
-
-				/* .sh files are not init scripts */
-				l = strlen(d->d_name);
-				if (l > 2 && d->d_name[l - 3] == '.' &&
-				    d->d_name[l - 2] == 's' &&
-				    d->d_name[l - 1] == 'h')
-					continue;
-			}
-			if (options & LS_DIR) {
-				snprintf(file, sizeof(file), "%s/%s",
-				    dir, d->d_name);
-				if (stat(file, &buf) != 0 ||
-				    !S_ISDIR(buf.st_mode))
-					continue;
-			}
-			rc_stringlist_add(list, d->d_name);
+		if (d->d_name[0] == '.')
+			continue;
+		if (options & LS_INITD) {
+			/* .sh files are not init scripts */
+			l = strlen(d->d_name);
+			if (l > 2 && d->d_name[l - 3] == '.' &&
+			    d->d_name[l - 2] == 's' &&
+			    d->d_name[l - 1] == 'h')
+				continue;
 		}
+		if (options & (LS_INITD | LS_DIR)) {
+			/* Check that our file really exists.
+			 * This is important as a service maybe in a
+			 * runlevel, but could have been removed. */
+			if (!ls_stat(dp, d, &isdir))
+				continue;
+			if (options & LS_DIR && !isdir)
+				continue;
+		}
+		rc_stringlist_add(list, d->d_name);
 	}
 	closedir(dp);
 	return list;
@@ -364,6 +390,632 @@ rc_parse_service_state(RC_SERVICE state)
 	return NULL;
 }
 
+/* Service state table.
+ * Working out the state of a service from the symlinks in RC_SVCDIR takes
+ * a stat for every state and a scan of the scheduled dirs, and we ask a
+ * lot. When rc_state_table is set, rc creates a table of the states in
+ * RC_STATETAB which we map and update with atomic operations, so asking
+ * is just a read. The symlinks are still kept up to date along with it as
+ * other tools and older versions look at them.
+ * The table is a fixed size open addressed hash of service names, sized
+ * for twice the services we have when it's created. A service whose name
+ * doesn't fit in a slot is only kept in the symlinks, and if we run out
+ * of slots the table is marked full and nobody reads from it.
+ * When the table is replaced or removed it's marked retired first, so
+ * anything which has it mapped knows to look again. */
+#define STATETAB_MAGIC		0x54535243	/* RCST */
+#define STATETAB_VERSION	1
+#define STATETAB_NAMELEN	52
+
+#define SLOT_EMPTY		0
+#define SLOT_CLAIMING		1
+#define SLOT_USED		2
+
+typedef struct statetab_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t full;
+	uint32_t retired;
+	uint32_t pad[3];
+} STATETAB_HEADER;
+
+typedef struct statetab_slot
+{
+	uint32_t used;
+	uint32_t state;
+	/* How many services have scheduled us to start */
+	uint32_t scheduled;
+	char name[STATETAB_NAMELEN];
+} STATETAB_SLOT;
+
+#define STATETAB_SLOTS(h)	((STATETAB_SLOT *)((h) + 1))
+#define STATETAB_SIZE(n)	(sizeof(STATETAB_HEADER) + \
+				 sizeof(STATETAB_SLOT) * (n))
+
+#define atomic_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_cas(p, o, n)	__atomic_compare_exchange_n((p), (o), (n), \
+				    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+static STATETAB_HEADER *statetab = NULL;
+static size_t statetab_size = 0;
+static bool statetab_writable = false;
+static bool statetab_absent = false;
+
+static void
+statetab_unmap(void)
+{
+	if (statetab)
+		munmap(statetab, statetab_size);
+	statetab = NULL;
+	statetab_size = 0;
+}
+
+static STATETAB_HEADER *
+statetab_map(const char *file, bool write, size_t *size)
+{
+	STATETAB_HEADER *tab;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(file, (write ? O_RDWR : O_RDONLY) | O_CLOEXEC)) == -1)
+		return NULL;
+	tab = NULL;
+	if (fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size >= sizeof(STATETAB_HEADER))
+	{
+		tab = mmap(NULL, st.st_size,
+		    write ? PROT_READ | PROT_WRITE : PROT_READ,
+		    MAP_SHARED, fd, 0);
+		if (tab == MAP_FAILED)
+			tab = NULL;
+		else if (tab->magic != STATETAB_MAGIC ||
+		    tab->version != STATETAB_VERSION ||
+		    (size_t)st.st_size < STATETAB_SIZE(tab->nslots))
+		{
+			munmap(tab, st.st_size);
+			tab = NULL;
+		} else
+			*size = st.st_size;
+	}
+	close(fd);
+	return tab;
+}
+
+/* Get the table. Readers remember it's not there, as the symlinks are
+ * always right anyway, but writers must look each time so nothing is
+ * missed when rc creates it. */
+static STATETAB_HEADER *
+statetab_get(bool write)
+{
+	if (statetab && atomic_load(&statetab->retired))
+		statetab_unmap();
+	if (statetab && (statetab_writable || !write))
+		return statetab;
+	if (!write && statetab_absent)
+		return NULL;
+	statetab_unmap();
+	if (!(statetab = statetab_map(RC_STATETAB, true, &statetab_size))) {
+		statetab = statetab_map(RC_STATETAB, false, &statetab_size);
+		statetab_writable = false;
+	} else
+		statetab_writable = true;
+	statetab_absent = statetab == NULL;
+	if (statetab && write && !statetab_writable)
+		return NULL;
+	return statetab;
+}
+
+static uint32_t
+statetab_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	return h;
+}
+
+/* Find the slot for a service, claiming one if asked */
+static STATETAB_SLOT *
+statetab_slot(STATETAB_HEADER *tab, const char *name, bool claim)
+{
+	STATETAB_SLOT *slots = STATETAB_SLOTS(tab);
+	STATETAB_SLOT *slot;
+	uint32_t i, n, used;
+	int spin;
+
+	if (strlen(name) >= STATETAB_NAMELEN)
+		return NULL;
+	i = statetab_hash(name) & (tab->nslots - 1);
+	for (n = 0; n < tab->nslots; n++, i = (i + 1) & (tab->nslots - 1)) {
+		slot = slots + i;
+		used = atomic_load(&slot->used);
+		if (used == SLOT_EMPTY) {
+			if (!claim)
+				return NULL;
+			if (atomic_cas(&slot->used, &used, SLOT_CLAIMING)) {
+				strcpy(slot->name, name);
+				atomic_store(&slot->state, RC_SERVICE_STOPPED);
+				atomic_store(&slot->used, SLOT_USED);
+				return slot;
+			}
+		}
+		/* We can't tell who it's for until it's claimed, which
+		 * is just a copy of the name away. If it never is then
+		 * the claimer died and we can't trust the table. */
+		for (spin = 0; used == SLOT_CLAIMING && spin < 1000; spin++) {
+			if (!claim)
+				return NULL;
+			sched_yield();
+			used = atomic_load(&slot->used);
+		}
+		if (used == SLOT_CLAIMING)
+			break;
+		if (strcmp(slot->name, name) == 0)
+			return slot;
+	}
+	if (claim)
+		atomic_store(&tab->full, 1);
+	return NULL;
+}
+
+/* Look up the state of a service, returning false if the table can't say */
+static bool
+statetab_state(const char *service, RC_SERVICE *state)
+{
+	STATETAB_HEADER *tab = statetab_get(false);
+	STATETAB_SLOT *slot;
+	uint32_t i, n, used;
+	uint32_t st;
+
+	if (!tab || atomic_load(&tab->full) ||
+	    strlen(service) >= STATETAB_NAMELEN)
+		return false;
+	i = statetab_hash(service) & (tab->nslots - 1);
+	for (n = 0; n < tab->nslots; n++, i = (i + 1) & (tab->nslots - 1)) {
+		slot = STATETAB_SLOTS(tab) + i;
+		used = atomic_load(&slot->used);
+		if (used == SLOT_EMPTY)
+			break;
+		if (used == SLOT_CLAIMING)
+			return false;
+		if (strcmp(slot->name, service) == 0) {
+			st = atomic_load(&slot->state);
+			if (st & RC_SERVICE_STOPPED &&
+			    atomic_load(&slot->scheduled))
+				st |= RC_SERVICE_SCHEDULED;
+			*state = st;
+			return true;
+		}
+	}
+	*state = RC_SERVICE_STOPPED;
+	return true;
+}
+
+/* Work out the new state the way rc_service_mark changes the symlinks */
+static uint32_t
+statetab_transition(uint32_t old, RC_SERVICE state)
+{
+	uint32_t new;
+
+	if (state == RC_SERVICE_HOTPLUGGED || state == RC_SERVICE_FAILED)
+		return old | state;
+
+	new = old & RC_SERVICE_HOTPLUGGED;
+	if (state <= RC_SERVICE_INACTIVE)
+		new |= state;
+	else
+		new |= RC_SERVICE_STOPPED | state;
+	if ((state == RC_SERVICE_STARTING || state == RC_SERVICE_STOPPING) &&
+	    old & RC_SERVICE_INACTIVE)
+		new |= RC_SERVICE_WASINACTIVE;
+	return new;
+}
+
+static void
+statetab_mark(const char *service, RC_SERVICE state)
+{
+	STATETAB_HEADER *tab = statetab_get(true);
+	STATETAB_SLOT *slot;
+	uint32_t old;
+
+	if (!tab || !(slot = statetab_slot(tab, service, true)))
+		return;
+	old = atomic_load(&slot->state);
+	while (!atomic_cas(&slot->state, &old, statetab_transition(old, state)))
+		;
+	/* These are final states, so we are no longer scheduled */
+	if (state == RC_SERVICE_STARTED || state == RC_SERVICE_STOPPED)
+		atomic_store(&slot->scheduled, 0);
+}
+
+static void
+statetab_unmark(const char *service, RC_SERVICE state)
+{
+	STATETAB_HEADER *tab = statetab_get(true);
+	STATETAB_SLOT *slot;
+
+	if (!tab || !(slot = statetab_slot(tab, service, true)))
+		return;
+	__atomic_fetch_and(&slot->state, ~(uint32_t)state, __ATOMIC_ACQ_REL);
+}
+
+static void
+statetab_schedule(const char *service, int n)
+{
+	STATETAB_HEADER *tab = statetab_get(true);
+	STATETAB_SLOT *slot;
+	uint32_t old;
+
+	if (!tab || !(slot = statetab_slot(tab, service, true)))
+		return;
+	old = atomic_load(&slot->scheduled);
+	while (!atomic_cas(&slot->scheduled, &old,
+		n < 0 && old < (uint32_t)-n ? 0 : old + n))
+		;
+}
+
+/* Mark the table we have mapped as retired */
+static void
+statetab_retire(void)
+{
+	STATETAB_HEADER *tab;
+	size_t size;
+
+	if ((tab = statetab_map(RC_STATETAB, true, &size))) {
+		atomic_store(&tab->retired, 1);
+		munmap(tab, size);
+	}
+	statetab_unmap();
+	statetab_absent = false;
+}
+
+/* Build a new table from the symlinks */
+static bool
+statetab_create(void)
+{
+	STATETAB_HEADER *tab;
+	STATETAB_SLOT *slot;
+	RC_STRINGLIST *list, *dirs;
+	RC_STRING *s, *d;
+	char tmp[PATH_MAX];
+	char dir[PATH_MAX];
+	uint32_t nslots = 256;
+	size_t size;
+	int fd, i;
+	bool retval = false;
+
+	list = rc_services_in_runlevel(NULL);
+	TAILQ_FOREACH(s, list, entries)
+		if (nslots < UINT32_MAX / 4)
+			nslots++;
+	rc_stringlist_free(list);
+	for (i = 1; (uint32_t)i < nslots * 2 && i < (1 << 30); i <<= 1)
+		;
+	nslots = i;
+	size = STATETAB_SIZE(nslots);
+
+	snprintf(tmp, sizeof(tmp), RC_STATETAB ".XXXXXX");
+	if ((fd = mkstemp(tmp)) == -1)
+		return false;
+	if (fchmod(fd, 0644) != 0 || ftruncate(fd, size) != 0) {
+		close(fd);
+		unlink(tmp);
+		return false;
+	}
+	tab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tab == MAP_FAILED) {
+		unlink(tmp);
+		return false;
+	}
+	tab->magic = STATETAB_MAGIC;
+	tab->version = STATETAB_VERSION;
+	tab->nslots = nslots;
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (rc_service_state_names[i].state == RC_SERVICE_STOPPED)
+			continue;
+		snprintf(dir, sizeof(dir), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		if (rc_service_state_names[i].state == RC_SERVICE_SCHEDULED) {
+			dirs = ls_dir(dir, 0);
+			TAILQ_FOREACH(d, dirs, entries) {
+				snprintf(dir, sizeof(dir),
+				    RC_SVCDIR "/scheduled/%s", d->value);
+				list = ls_dir(dir, LS_INITD);
+				TAILQ_FOREACH(s, list, entries)
+					if ((slot = statetab_slot(tab,
+						    s->value, true)))
+						slot->scheduled++;
+				rc_stringlist_free(list);
+			}
+			rc_stringlist_free(dirs);
+			continue;
+		}
+		list = ls_dir(dir, LS_INITD);
+		TAILQ_FOREACH(s, list, entries) {
+			if (!(slot = statetab_slot(tab, s->value, true)))
+				continue;
+			/* Match the order rc_service_state reads them in */
+			if (rc_service_state_names[i].state <= 0x10)
+				slot->state = (slot->state &
+				    ~(RC_SERVICE_STOPPED | RC_SERVICE_STARTED |
+					RC_SERVICE_STOPPING |
+					RC_SERVICE_STARTING |
+					RC_SERVICE_INACTIVE)) |
+				    rc_service_state_names[i].state;
+			else
+				slot->state |= rc_service_state_names[i].state;
+		}
+		rc_stringlist_free(list);
+	}
+
+	if (!tab->full && msync(tab, size, MS_SYNC) == 0) {
+		statetab_retire();
+		retval = rename(tmp, RC_STATETAB) == 0;
+	}
+	munmap(tab, size);
+	if (!retval)
+		unlink(tmp);
+	return retval;
+}
+
+bool
+rc_service_state_table(bool enable)
+{
+	STATETAB_HEADER *tab;
+	size_t size;
+	bool ok;
+
+	if (!enable) {
+		if (!exists(RC_STATETAB))
+			return true;
+		statetab_retire();
+		return unlink(RC_STATETAB) == 0;
+	}
+
+	if ((tab = statetab_map(RC_STATETAB, false, &size))) {
+		ok = !tab->full && !tab->retired;
+		munmap(tab, size);
+		if (ok)
+			return true;
+	}
+	return statetab_create();
+}
+librc_hidden_def(rc_service_state_table)
+
+/* Open addressed index of names, which are not copied so must outlive it */
+typedef struct nameindex_entry {
+	const char *name;
+	int value;
+} NAMEINDEX_ENTRY;
+
+typedef struct nameindex {
+	NAMEINDEX_ENTRY *entries;
+	size_t size;
+	size_t count;
+} NAMEINDEX;
+
+static NAMEINDEX_ENTRY *
+nameindex_slot(const NAMEINDEX *ni, const char *name)
+{
+	size_t i;
+
+	i = statetab_hash(name) & (ni->size - 1);
+	while (ni->entries[i].name) {
+		if (strcmp(ni->entries[i].name, name) == 0)
+			break;
+		i = (i + 1) & (ni->size - 1);
+	}
+	return ni->entries + i;
+}
+
+static NAMEINDEX_ENTRY *
+nameindex_find(const NAMEINDEX *ni, const char *name)
+{
+	NAMEINDEX_ENTRY *e;
+
+	if (!ni->size)
+		return NULL;
+	e = nameindex_slot(ni, name);
+	return e->name ? e : NULL;
+}
+
+/* Returns the entry for the name, adding it with the value if it's new */
+static NAMEINDEX_ENTRY *
+nameindex_add(NAMEINDEX *ni, const char *name, int value)
+{
+	NAMEINDEX_ENTRY *e;
+	NAMEINDEX_ENTRY *old;
+	size_t i, osize;
+
+	if ((ni->count + 1) * 2 > ni->size) {
+		old = ni->entries;
+		osize = ni->size;
+		ni->size = osize ? osize * 2 : 64;
+		ni->entries = xmalloc(sizeof(*ni->entries) * ni->size);
+		memset(ni->entries, 0, sizeof(*ni->entries) * ni->size);
+		for (i = 0; i < osize; i++)
+			if (old[i].name)
+				*nameindex_slot(ni, old[i].name) = old[i];
+		free(old);
+	}
+
+	e = nameindex_slot(ni, name);
+	if (!e->name) {
+		e->name = name;
+		e->value = value;
+		ni->count++;
+	}
+	return e;
+}
+
+static void
+nameindex_free(NAMEINDEX *ni)
+{
+	free(ni->entries);
+	memset(ni, 0, sizeof(*ni));
+}
+
+/*
+ * What we have read of each runlevel directory, so asking if a service
+ * is in a runlevel or which runlevels are stacked on it doesn't need a
+ * stat or readdir each time.
+ * A directory is read again when its mtime or inode changes, which adding
+ * or removing a service or stacked runlevel does. As the mtime may only
+ * have a resolution of a second, a directory changed in the second it
+ * was read is read again each time until that second has passed.
+ */
+typedef struct runlevel_index {
+	char *name;
+	bool exists;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	time_t read;
+	unsigned int checked;
+	/* Everything in the directory which exists(), for membership */
+	RC_STRINGLIST *names;
+	NAMEINDEX members;
+	/* Services as ls_dir(LS_INITD) lists them */
+	RC_STRINGLIST *services;
+	/* Stacked runlevels as ls_dir(LS_DIR) lists them */
+	RC_STRINGLIST *stacks;
+	TAILQ_ENTRY(runlevel_index) entries;
+} RUNLEVEL_INDEX;
+
+static TAILQ_HEAD(, runlevel_index) runlevel_indexes =
+    TAILQ_HEAD_INITIALIZER(runlevel_indexes);
+static int runlevel_held;
+static unsigned int runlevel_checks = 1;
+
+/* While held, each runlevel directory is only checked for changes the
+ * first time it's used, which suits walks asking about lots of services. */
+void
+librc_runlevel_hold(bool hold)
+{
+	if (hold) {
+		if (runlevel_held++ == 0)
+			runlevel_checks++;
+	} else if (runlevel_held > 0)
+		runlevel_held--;
+}
+
+static void
+runlevel_index_clear(RUNLEVEL_INDEX *ri)
+{
+	rc_stringlist_free(ri->names);
+	rc_stringlist_free(ri->services);
+	rc_stringlist_free(ri->stacks);
+	nameindex_free(&ri->members);
+	ri->names = ri->services = ri->stacks = NULL;
+	ri->exists = false;
+}
+
+/* One readdir tells us everything exists() and ls_dir would */
+static bool
+runlevel_index_read(RUNLEVEL_INDEX *ri, const char *path)
+{
+	DIR *dp;
+	struct dirent *d;
+	RC_STRING *s;
+	size_t l;
+	bool isdir;
+
+	if ((dp = opendir(path)) == NULL)
+		return false;
+	ri->names = rc_stringlist_new();
+	ri->services = rc_stringlist_new();
+	ri->stacks = rc_stringlist_new();
+	while ((d = readdir(dp)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 ||
+		    strcmp(d->d_name, "..") == 0)
+			continue;
+		/* A link to a service which has been removed isn't there */
+		if (!ls_stat(dp, d, &isdir))
+			continue;
+		s = rc_stringlist_add(ri->names, d->d_name);
+		nameindex_add(&ri->members, s->value, 0);
+		if (d->d_name[0] == '.')
+			continue;
+		if (isdir)
+			rc_stringlist_add(ri->stacks, d->d_name);
+		l = strlen(d->d_name);
+		if (l > 2 && strcmp(d->d_name + l - 3, ".sh") == 0)
+			continue;
+		rc_stringlist_add(ri->services, d->d_name);
+	}
+	closedir(dp);
+	return true;
+}
+
+/* Returns the index of the runlevel, or NULL if it's not a name we index
+ * and the caller should look in the directory itself */
+static RUNLEVEL_INDEX *
+runlevel_index(const char *runlevel)
+{
+	RUNLEVEL_INDEX *ri;
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!runlevel || !*runlevel || strchr(runlevel, '/') ||
+	    strcmp(runlevel, ".") == 0 || strcmp(runlevel, "..") == 0)
+		return NULL;
+
+	TAILQ_FOREACH(ri, &runlevel_indexes, entries)
+		if (strcmp(ri->name, runlevel) == 0)
+			break;
+	if (ri && runlevel_held && ri->checked == runlevel_checks)
+		return ri;
+	if (!ri) {
+		ri = xmalloc(sizeof(*ri));
+		memset(ri, 0, sizeof(*ri));
+		ri->name = xstrdup(runlevel);
+		TAILQ_INSERT_TAIL(&runlevel_indexes, ri, entries);
+	}
+	ri->checked = runlevel_checks;
+
+	snprintf(path, sizeof(path), RC_RUNLEVELDIR "/%s", runlevel);
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		runlevel_index_clear(ri);
+		return ri;
+	}
+	if (ri->exists && ri->dev == st.st_dev && ri->ino == st.st_ino &&
+	    ri->mtime.tv_sec == st.st_mtim.tv_sec &&
+	    ri->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+	    st.st_mtim.tv_sec < ri->read)
+		return ri;
+
+	runlevel_index_clear(ri);
+	ri->read = time(NULL);
+	ri->exists = runlevel_index_read(ri, path);
+	ri->dev = st.st_dev;
+	ri->ino = st.st_ino;
+	ri->mtime = st.st_mtim;
+	return ri;
+}
+
+/* We've changed the runlevel, so read it again next time even if held */
+static void
+runlevel_index_drop(const char *runlevel)
+{
+	RUNLEVEL_INDEX *ri;
+
+	if (!runlevel)
+		return;
+	TAILQ_FOREACH(ri, &runlevel_indexes, entries) {
+		if (strcmp(ri->name, runlevel) == 0) {
+			runlevel_index_clear(ri);
+			ri->checked = 0;
+			break;
+		}
+	}
+}
+
 /* Returns a list of all the chained runlevels used by the
  * specified runlevel in dependency order, including the
  * specified runlevel. */
@@ -374,12 +1026,14 @@ get_runlevel_chain(const char *runlevel, RC_STRINGLIST *level_list, RC_STRINGLIS
 	RC_STRINGLIST *dirs;
 	RC_STRING *d, *parent;
 	const char *nextlevel;
+	RUNLEVEL_INDEX *ri = runlevel_index(runlevel);
 
 	/*
 	 * If we haven't been passed a runlevel or a level list, or
 	 * if the passed runlevel doesn't exist then we're done already!
 	 */
-	if (!runlevel || !level_list || !rc_runlevel_exists(runlevel))
+	if (!runlevel || !level_list ||
+	    !(ri ? ri->exists : rc_runlevel_exists(runlevel)))
 		return;
 
 	/*
@@ -395,8 +1049,12 @@ get_runlevel_chain(const char *runlevel, RC_STRINGLIST *level_list, RC_STRINGLIS
 	 * We can now do exactly the above procedure for our chained
 	 * runlevels.
 	 */
-	snprintf(path, sizeof(path), "%s/%s", RC_RUNLEVELDIR, runlevel);
-	dirs = ls_dir(path, LS_DIR);
+	if (ri)
+		dirs = ri->stacks;
+	else {
+		snprintf(path, sizeof(path), "%s/%s", RC_RUNLEVELDIR, runlevel);
+		dirs = ls_dir(path, LS_DIR);
+	}
 	TAILQ_FOREACH(d, dirs, entries) {
 		nextlevel = d->value;
 
@@ -417,7 +1075,8 @@ get_runlevel_chain(const char *runlevel, RC_STRINGLIST *level_list, RC_STRINGLIS
 
 		rc_stringlist_delete(ancestor_list, nextlevel);
 	}
-	rc_stringlist_free(dirs);
+	if (!ri)
+		rc_stringlist_free(dirs);
 }
 
 bool
@@ -504,6 +1163,7 @@ rc_runlevel_stack(const char *dst, const char *src)
 		return false;
 	snprintf(s, sizeof(s), "../%s", src);
 	snprintf(d, sizeof(s), "%s/%s/%s", RC_RUNLEVELDIR, dst, src);
+	runlevel_index_drop(dst);
 	return (symlink(s, d) == 0 ? true : false);
 }
 librc_hidden_def(rc_runlevel_stack)
@@ -514,6 +1174,7 @@ rc_runlevel_unstack(const char *dst, const char *src)
 	char path[PATH_MAX];
 
 	snprintf(path, sizeof(path), "%s/%s/%s", RC_RUNLEVELDIR, dst, src);
+	runlevel_index_drop(dst);
 	return (unlink(path) == 0 ? true : false);
 }
 librc_hidden_def(rc_runlevel_unstack)
@@ -525,43 +1186,21 @@ rc_runlevel_stacks(const char *runlevel)
 	stack = rc_stringlist_new();
 	ancestor_list = rc_stringlist_new();
 	rc_stringlist_add(ancestor_list, runlevel);
+	librc_runlevel_hold(true);
 	get_runlevel_chain(runlevel, stack, ancestor_list);
+	librc_runlevel_hold(false);
 	rc_stringlist_free(ancestor_list);
 	return stack;
 }
 librc_hidden_def(rc_runlevel_stacks)
 
-/* Resolve a service name to its full path */
+/* Find a service in the init directories */
 char *
-rc_service_resolve(const char *service)
+librc_service_find(const char *service)
 {
-	char buffer[PATH_MAX];
 	char file[PATH_MAX];
-	int r;
 	struct stat buf;
 
-	if (!service)
-		return NULL;
-
-	if (service[0] == '/')
-		return xstrdup(service);
-
-	/* First check started services */
-	snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s", "started", service);
-	if (lstat(file, &buf) || ! S_ISLNK(buf.st_mode)) {
-		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
-		    "inactive", service);
-		if (lstat(file, &buf) || ! S_ISLNK(buf.st_mode))
-			*file = '\0';
-	}
-
-	if (*file) {
-		memset(buffer, 0, sizeof(buffer));
-		r = readlink(file, buffer, sizeof(buffer));
-		if (r > 0)
-			return xstrdup(buffer);
-	}
-
 #ifdef RC_LOCAL_INITDIR
 	/* Nope, so lets see if the user has written it */
 	snprintf(file, sizeof(file), RC_LOCAL_INITDIR "/%s", service);
@@ -583,6 +1222,53 @@ rc_service_resolve(const char *service)
 
 	return NULL;
 }
+
+/* Resolve a service name to its full path.
+ * If we know the state of the service from its record we only look for
+ * it in the started and inactive directories when it's in one. */
+static char *
+service_resolve(const char *service, int state)
+{
+	char buffer[PATH_MAX];
+	char file[PATH_MAX];
+	const char *path;
+	ssize_t r = -1;
+
+	if (!service)
+		return NULL;
+
+	if (service[0] == '/')
+		return xstrdup(service);
+
+	/* First check started services.
+	 * readlink fails unless it's a symlink, so we don't lstat first */
+	if (state == -1 || state & RC_SERVICE_STARTED) {
+		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
+		    "started", service);
+		r = readlink(file, buffer, sizeof(buffer) - 1);
+	}
+	if (r == -1 && (state == -1 || state & RC_SERVICE_INACTIVE)) {
+		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
+		    "inactive", service);
+		r = readlink(file, buffer, sizeof(buffer) - 1);
+	}
+	if (r > 0) {
+		buffer[r] = '\0';
+		return xstrdup(buffer);
+	}
+
+	/* The deptree knows where the rest are if nothing has changed */
+	if ((path = librc_deptree_path(service)))
+		return xstrdup(path);
+
+	return librc_service_find(service);
+}
+
+char *
+rc_service_resolve(const char *service)
+{
+	return service_resolve(service, -1);
+}
 librc_hidden_def(rc_service_resolve)
 
 bool
@@ -624,6 +1310,60 @@ rc_service_exists(const char *service)
 }
 librc_hidden_def(rc_service_exists)
 
+/* rc_service_extra_commands and rc_service_description source the script
+ * to find out, unless the deptree knows what it sets already */
+static RC_STRINGLIST *
+meta_commands(const RC_DEPTREE *deptree, const char *service)
+{
+	static const char *const types[] = {
+		"extra_commands", "extra_started_commands",
+		"extra_stopped_commands", NULL
+	};
+	RC_STRINGLIST *commands = rc_stringlist_new();
+	RC_STRINGLIST *list;
+	size_t i;
+
+	for (i = 0; types[i]; i++) {
+		list = rc_deptree_depend(deptree, service, types[i]);
+		TAILQ_CONCAT(commands, list, entries);
+		rc_stringlist_free(list);
+	}
+	return commands;
+}
+
+static char *
+meta_description(const RC_DEPTREE *deptree, const char *service,
+    const char *option)
+{
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	char *desc = NULL;
+	size_t l = strlen(option);
+
+	if (!*option) {
+		list = rc_deptree_depend(deptree, service, "description");
+		s = TAILQ_FIRST(list);
+		desc = xstrdup(s ? s->value : "");
+		rc_stringlist_free(list);
+		return desc;
+	}
+
+	/* We only know about the extra commands */
+	list = meta_commands(deptree, service);
+	if (rc_stringlist_find(list, option)) {
+		rc_stringlist_free(list);
+		list = rc_deptree_depend(deptree, service,
+		    "command_description");
+		TAILQ_FOREACH(s, list, entries)
+			if (strncmp(s->value, option, l) == 0 &&
+			    s->value[l] == ' ')
+				break;
+		desc = xstrdup(s ? s->value + l + 1 : "");
+	}
+	rc_stringlist_free(list);
+	return desc;
+}
+
 #define OPTSTR \
 ". '%s'; echo $extra_commands $extra_started_commands $extra_stopped_commands"
 
@@ -635,6 +1375,7 @@ rc_service_extra_commands(const char *service)
 	char *buffer = NULL;
 	size_t len = 0;
 	RC_STRINGLIST *commands = NULL;
+	const RC_DEPTREE *deptree;
 	char *token;
 	char *p;
 	FILE *fp;
@@ -643,6 +1384,11 @@ rc_service_extra_commands(const char *service)
 	if (!(svc = rc_service_resolve(service)))
 		return NULL;
 
+	if ((deptree = librc_deptree_meta(basename_c(service), svc))) {
+		free(svc);
+		return meta_commands(deptree, basename_c(service));
+	}
+
 	l = strlen(OPTSTR) + strlen(svc) + 1;
 	cmd = xmalloc(sizeof(char) * l);
 	snprintf(cmd, l, OPTSTR, svc);
@@ -674,6 +1420,7 @@ rc_service_description(const char *service, const char *option)
 	char *cmd;
 	char *desc = NULL;
 	size_t len = 0;
+	const RC_DEPTREE *deptree;
 	FILE *fp;
 	size_t l;
 
@@ -683,6 +1430,13 @@ rc_service_description(const char *service, const char *option)
 	if (!option)
 		option = "";
 
+	if ((deptree = librc_deptree_meta(basename_c(service), svc)) &&
+	    (desc = meta_description(deptree, basename_c(service), option)))
+	{
+		free(svc);
+		return desc;
+	}
+
 	l = strlen(DESCSTR) + strlen(svc) + strlen(option) + 2;
 	cmd = xmalloc(sizeof(char) * l);
 	snprintf(cmd, l, DESCSTR, svc, *option ? "_" : "", option);
@@ -700,13 +1454,109 @@ bool
 rc_service_in_runlevel(const char *service, const char *runlevel)
 {
 	char file[PATH_MAX];
+	const char *base = basename_c(service);
+	RUNLEVEL_INDEX *ri;
+
+	if (base && *base && (ri = runlevel_index(runlevel)))
+		return ri->exists && nameindex_find(&ri->members, base);
 
 	snprintf(file, sizeof(file), RC_RUNLEVELDIR "/%s/%s",
-	    runlevel, basename_c(service));
+	    runlevel, base);
 	return exists(file);
 }
 librc_hidden_def(rc_service_in_runlevel)
 
+/*
+ * Each service marked has a state record, a symlink in RC_STATEDIR whose
+ * target lists the names of its state and whether it was inactive, such
+ * as "starting,wasinactive". A new record replaces the old one with a
+ * single rename, so anyone reading it sees either the old state or the
+ * new one, never none or both as the state directories can show.
+ * Hotplugged, failed and scheduled are set by other services, so they
+ * stay in the directories alone.
+ * Services without a record, such as those marked by an older librc,
+ * fall back to the directories.
+ */
+#define RECORD_STATES	(0x1f | RC_SERVICE_WASINACTIVE)
+
+static int
+state_record_read(const char *base)
+{
+	char file[PATH_MAX];
+	char buf[PATH_MAX];
+	char *p, *token;
+	ssize_t len;
+	int i, state = RC_SERVICE_STOPPED;
+
+	snprintf(file, sizeof(file), RC_STATEDIR "/%s", base);
+	if ((len = readlink(file, buf, sizeof(buf) - 1)) <= 0)
+		return -1;
+	buf[len] = '\0';
+	p = buf;
+	while ((token = strsep(&p, ","))) {
+		for (i = 0; rc_service_state_names[i].name; i++)
+			if (strcmp(rc_service_state_names[i].name, token) == 0)
+				break;
+		if (!rc_service_state_names[i].name ||
+		    !(rc_service_state_names[i].state & RECORD_STATES))
+			return -1;
+		if (rc_service_state_names[i].state <= 0x10)
+			state = rc_service_state_names[i].state;
+		else
+			state |= rc_service_state_names[i].state;
+	}
+	return state;
+}
+
+static void
+state_record_write(const char *base, int state)
+{
+	char file[PATH_MAX];
+	char tmp[PATH_MAX];
+	char buf[PATH_MAX];
+	size_t len = 0;
+	int i;
+
+	snprintf(file, sizeof(file), RC_STATEDIR "/%s", base);
+	snprintf(tmp, sizeof(tmp), RC_STATEDIR "/.%s.%d", base, (int)getpid());
+	buf[0] = '\0';
+	for (i = 0; rc_service_state_names[i].name; i++)
+		if (state & rc_service_state_names[i].state & RECORD_STATES)
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+			    len ? "," : "", rc_service_state_names[i].name);
+
+	if (symlink(buf, tmp) != 0 &&
+	    (errno != EEXIST || unlink(tmp) != 0 || symlink(buf, tmp) != 0))
+	{
+		/* Readers must not trust an old record */
+		unlink(file);
+		return;
+	}
+	if (rename(tmp, file) != 0) {
+		unlink(tmp);
+		unlink(file);
+	}
+}
+
+/* Read the states a service has links for, as the record would say */
+static int
+state_links(const char *base)
+{
+	char file[PATH_MAX];
+	int i, state = 0;
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (rc_service_state_names[i].state == RC_SERVICE_STOPPED ||
+		    rc_service_state_names[i].state == RC_SERVICE_SCHEDULED)
+			continue;
+		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
+		    rc_service_state_names[i].name, base);
+		if (exists(file))
+			state |= rc_service_state_names[i].state;
+	}
+	return state;
+}
+
 bool
 rc_service_mark(const char *service, const RC_SERVICE state)
 {
@@ -714,18 +1564,21 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 	int i = 0;
 	int skip_state = -1;
 	const char *base;
-	char *init = rc_service_resolve(service);
+	char *init;
 	bool skip_wasinactive = false;
-	int s;
+	int s, old, record;
 	char was[PATH_MAX];
 	RC_STRINGLIST *dirs;
 	RC_STRING *dir;
 	int serrno;
 
-	if (!init)
+	if (!service)
 		return false;
-
 	base = basename_c(service);
+	record = state_record_read(base);
+	if (!(init = service_resolve(service, record)))
+		return false;
+
 	if (state != RC_SERVICE_STOPPED) {
 		if (!exists(init)) {
 			free(init);
@@ -734,9 +1587,9 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 		    rc_parse_service_state(state), base);
-		if (exists(file))
-			unlink(file);
 		i = symlink(init, file);
+		if (i != 0 && errno == EEXIST && unlink(file) == 0)
+			i = symlink(init, file);
 		if (i != 0) {
 			free(init);
 			return false;
@@ -745,15 +1598,40 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 	}
 
 	if (state == RC_SERVICE_HOTPLUGGED || state == RC_SERVICE_FAILED) {
+		statetab_mark(base, state);
 		free(init);
 		return true;
 	}
 
+	/* Find the old states from the record, or the links if we have no
+	 * record yet. Failed is never in the record, so always look. */
+	if ((old = record) == -1)
+		old = state_links(base);
+	else
+		old |= RC_SERVICE_FAILED;
+
+	if ((state == RC_SERVICE_STARTING || state == RC_SERVICE_STOPPING) &&
+	    old & RC_SERVICE_INACTIVE)
+	{
+		snprintf(was, sizeof(was), RC_SVCDIR "/%s/%s",
+		    rc_parse_service_state(RC_SERVICE_WASINACTIVE), base);
+		if (symlink(init, was) == -1 && errno != EEXIST) {
+			free(init);
+			return false;
+		}
+		skip_wasinactive = true;
+	}
+
+	/* Publish the new state before we clean up after the old one */
+	state_record_write(base, skip_wasinactive ?
+	    state | RC_SERVICE_WASINACTIVE : state);
+
 	/* Remove any old states now */
 	for (i = 0; rc_service_state_names[i].name; i++) {
 		s = rc_service_state_names[i].state;
 
-		if ((s != skip_state &&
+		if ((old & s) &&
+		    (s != skip_state &&
 			s != RC_SERVICE_STOPPED &&
 			s != RC_SERVICE_HOTPLUGGED &&
 			s != RC_SERVICE_SCHEDULED) &&
@@ -761,23 +1639,9 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 		{
 			snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 			    rc_service_state_names[i].name, base);
-			if (exists(file)) {
-				if ((state == RC_SERVICE_STARTING ||
-					state == RC_SERVICE_STOPPING) &&
-				    s == RC_SERVICE_INACTIVE)
-				{
-					snprintf(was, sizeof(was),
-					    RC_SVCDIR "/%s/%s",
-					    rc_parse_service_state(RC_SERVICE_WASINACTIVE),
-					    base);
-					if (symlink(init, was) == -1)
-						return false;
-					skip_wasinactive = true;
-				}
-				if (unlink(file) == -1) {
-					free(init);
-					return false;
-				}
+			if (unlink(file) == -1 && errno != ENOENT) {
+				free(init);
+				return false;
 			}
 		}
 	}
@@ -794,9 +1658,9 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 
 	/* Remove any options and daemons the service may have stored */
 	if (state == RC_SERVICE_STOPPED) {
-		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
-		    "options", base);
-		rm_dir(file, true);
+		snprintf(file, sizeof(file), RC_OPTIONSDIR "/%s", base);
+		if (unlink(file) != 0 && errno != ENOENT)
+			rm_dir(file, true);
 
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 		    "daemons", base);
@@ -822,11 +1686,31 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 		}
 		rc_stringlist_free(dirs);
 	}
+	statetab_mark(base, state);
 	free(init);
 	return true;
 }
 librc_hidden_def(rc_service_mark)
 
+bool
+rc_service_unmark(const char *service, const RC_SERVICE state)
+{
+	char file[PATH_MAX];
+	const char *base = basename_c(service);
+
+	if (state != RC_SERVICE_HOTPLUGGED && state != RC_SERVICE_FAILED) {
+		errno = EINVAL;
+		return false;
+	}
+	snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
+	    rc_parse_service_state(state), base);
+	if (unlink(file) != 0 && errno != ENOENT)
+		return false;
+	statetab_unmark(base, state);
+	return true;
+}
+librc_hidden_def(rc_service_unmark)
+
 RC_SERVICE
 rc_service_state(const char *service)
 {
@@ -836,8 +1720,19 @@ rc_service_state(const char *service)
 	RC_STRINGLIST *dirs;
 	RC_STRING *dir;
 	const char *base = basename_c(service);
+	RC_SERVICE st;
+	int record;
+
+	if (statetab_state(base, &st))
+		return st;
 
+	record = state_record_read(base);
+	if (record != -1)
+		state = record;
 	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (record != -1 &&
+		    rc_service_state_names[i].state & RECORD_STATES)
+			continue;
 		snprintf(file, sizeof(file), RC_SVCDIR "/%s/%s",
 		    rc_service_state_names[i].name, base);
 		if (exists(file)) {
@@ -866,40 +1761,420 @@ rc_service_state(const char *service)
 }
 librc_hidden_def(rc_service_state)
 
-char *
-rc_service_value_get(const char *service, const char *option)
+/*
+ * Waiting for something to change under RC_SVCDIR or elsewhere.
+ * Where we can, inotify tells us when the directory or lock involved
+ * changes and we look again then, otherwise we look every WAIT_INTERVAL.
+ */
+
+#define WAIT_INTERVAL	20	/* msecs between looks without inotify */
+
+#define WAIT_LOCK	0	/* the lock on a file goes */
+#define WAIT_UNLINK	1	/* a name goes from a directory */
+#define WAIT_CREATE	2	/* a name appears in a directory */
+
+#ifdef __linux__
+/* Filesystems which don't tell inotify about every change */
+static const uint32_t wait_nonotify[] = {
+	0x9fa0,		/* proc */
+	0x62656572,	/* sysfs */
+	0x6969,		/* nfs */
+	0xff534d42,	/* cifs */
+	0xfe534d42,	/* smb2 */
+	0x65735546,	/* fuse */
+	0
+};
+#endif
+
+static int
+wait_open(void)
+{
+#ifdef __linux__
+	return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+	return -1;
+#endif
+}
+
+/* Returns false if we have to keep looking for ourselves */
+static bool
+wait_watch(int fd, const char *path, int what)
+{
+#ifdef __linux__
+	struct statfs sfs;
+	uint32_t mask;
+	int i;
+
+	if (fd == -1 || statfs(path, &sfs) == -1)
+		return false;
+	for (i = 0; wait_nonotify[i]; i++)
+		if ((uint32_t)sfs.f_type == wait_nonotify[i]) {
+			errno = EOPNOTSUPP;
+			return false;
+		}
+	switch (what) {
+	case WAIT_LOCK:
+		/* Nobody else holding it open for writing means no lock */
+		mask = IN_CLOSE_WRITE | IN_DELETE_SELF;
+		break;
+	case WAIT_UNLINK:
+		mask = IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF;
+		break;
+	default:
+		mask = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF |
+		    IN_MOVE_SELF;
+		break;
+	}
+	return inotify_add_watch(fd, path, mask) != -1;
+#else
+	(void)fd;
+	(void)path;
+	(void)what;
+	return false;
+#endif
+}
+
+static void
+wait_deadline(struct timespec *deadline, int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Sleep until told something changed, or it's time to look again.
+ * Returns false with errno ETIMEDOUT when the deadline has passed. */
+static bool
+wait_sleep(int fd, bool watched, const struct timespec *deadline)
+{
+	struct timespec now;
+	struct pollfd pfd;
+	char buf[4096];
+	long long left;
+	int ms = -1;
+
+	if (deadline) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = (deadline->tv_sec - now.tv_sec) * 1000LL +
+		    (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		ms = left > INT_MAX ? INT_MAX : (int)left;
+	}
+	if (!watched && (ms == -1 || ms > WAIT_INTERVAL))
+		ms = WAIT_INTERVAL;
+
+	/* poll ignores a negative fd, so just sleeps without a watch */
+	pfd.fd = watched ? fd : -1;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ms) == -1 && errno != EINTR)
+		return false;
+	if (watched)
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+	return true;
+}
+
+static void
+wait_close(int fd)
+{
+	int serrno = errno;
+
+	if (fd != -1)
+		close(fd);
+	errno = serrno;
+}
+
+bool
+rc_service_wait(const char *service, int timeout)
+{
+	char file[PATH_MAX];
+	struct timespec deadline;
+	int fd, lfd;
+	bool dirw, lockw, ok;
+
+	snprintf(file, sizeof(file), RC_SVCDIR "/exclusive/%s",
+	    basename_c(service));
+	if (timeout >= 0)
+		wait_deadline(&deadline, timeout);
+	fd = wait_open();
+	dirw = wait_watch(fd, RC_SVCDIR "/exclusive", WAIT_UNLINK);
+	for (;;) {
+		/* Watch before looking so we can't miss the lock going.
+		 * A new lock file may have replaced the one we watched. */
+		lockw = wait_watch(fd, file, WAIT_LOCK);
+		lfd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (lfd != -1) {
+			ok = flock(lfd, LOCK_SH | LOCK_NB) == 0;
+			close(lfd);
+			if (ok)
+				break;
+		}
+		if (errno == ENOENT) {
+			ok = true;
+			break;
+		}
+		ok = false;
+		if (errno != EWOULDBLOCK ||
+		    !wait_sleep(fd, dirw && lockw,
+			timeout >= 0 ? &deadline : NULL))
+			break;
+	}
+	wait_close(fd);
+	return ok;
+}
+librc_hidden_def(rc_service_wait)
+
+bool
+rc_file_wait(const char *path, int timeout)
+{
+	char dir[PATH_MAX];
+	char *p;
+	struct stat st;
+	struct timespec deadline;
+	int fd;
+	bool watched;
+
+	if (timeout >= 0)
+		wait_deadline(&deadline, timeout);
+	fd = wait_open();
+	for (;;) {
+		/* Watch the nearest directory there is for the next part
+		 * of the path to appear in it, before looking for it. */
+		watched = false;
+		strlcpy(dir, path, sizeof(dir));
+		while (fd != -1) {
+			p = strrchr(dir, '/');
+			if (p == NULL)
+				strlcpy(dir, ".", sizeof(dir));
+			else if (p == dir)
+				p[1] = '\0';
+			else
+				*p = '\0';
+			if (wait_watch(fd, dir, WAIT_CREATE)) {
+				watched = true;
+				break;
+			}
+			if ((errno != ENOENT && errno != ENOTDIR) ||
+			    strcmp(dir, ".") == 0 || strcmp(dir, "/") == 0)
+				break;
+		}
+		if (exists(path))
+			break;
+		/* A dangling symlink points somewhere we don't watch */
+		if (lstat(path, &st) == 0)
+			watched = false;
+		if (!wait_sleep(fd, watched,
+			timeout >= 0 ? &deadline : NULL)) {
+			wait_close(fd);
+			return false;
+		}
+	}
+	wait_close(fd);
+	return true;
+}
+librc_hidden_def(rc_file_wait)
+
+/*
+ * The options a service saves are kept in one record, RC_OPTIONSDIR/<service>,
+ * holding each option and its value as a pair of nul terminated strings.
+ * A new record replaces the old one with a rename so readers always see a
+ * whole one, and writers lock RC_OPTIONSDIR so none of their options are lost.
+ * Older versions kept each option in a file of a directory of the same name,
+ * which we still read and replace on the next write.
+ */
+
+static void
+options_add(RC_STRINGLIST *list, const char *option, const char *value)
 {
+	size_t l = strlen(option) + strlen(value) + 2;
+	char *p = xmalloc(l);
+
+	snprintf(p, l, "%s=%s", option, value);
+	rc_stringlist_add(list, p);
+	free(p);
+}
+
+/* Add the options saved for a service to the list as option=value,
+ * or just the one option if asked. Returns false if there are none. */
+static bool
+options_read(const char *service, const char *only, RC_STRINGLIST *list,
+    bool *legacy)
+{
+	char file[PATH_MAX];
 	char *buffer = NULL;
+	char *p, *end, *value;
 	size_t len = 0;
+	RC_STRINGLIST *names;
+	RC_STRING *s;
+
+	snprintf(file, sizeof(file), RC_OPTIONSDIR "/%s", service);
+	if (!rc_getfile(file, &buffer, &len)) {
+		if (errno != EISDIR)
+			return false;
+		if (legacy)
+			*legacy = true;
+		names = ls_dir(file, 0);
+		TAILQ_FOREACH(s, names, entries) {
+			if (only && strcmp(s->value, only) != 0)
+				continue;
+			snprintf(file, sizeof(file), RC_OPTIONSDIR "/%s/%s",
+			    service, s->value);
+			buffer = NULL;
+			if (!rc_getfile(file, &buffer, &len))
+				continue;
+			options_add(list, s->value, buffer);
+			free(buffer);
+		}
+		rc_stringlist_free(names);
+		return true;
+	}
+
+	end = buffer + len - 1;
+	for (p = buffer; p < end; p = value + strlen(value) + 1) {
+		value = p + strlen(p) + 1;
+		if (value >= end)
+			break;
+		if (!only || strcmp(p, only) == 0)
+			options_add(list, p, value);
+	}
+	free(buffer);
+	return true;
+}
+
+/* Replace the record of a service with the options in the list */
+static bool
+options_write(const char *service, const RC_STRINGLIST *list, bool legacy)
+{
 	char file[PATH_MAX];
+	char tmp[PATH_MAX];
+	const RC_STRING *s;
+	const char *eq;
+	FILE *fp;
+	bool ok;
+
+	snprintf(file, sizeof(file), RC_OPTIONSDIR "/%s", service);
+	snprintf(tmp, sizeof(tmp), RC_OPTIONSDIR "/.%s.%d",
+	    service, (int)getpid());
+	if (!(fp = fopen(tmp, "we")))
+		return false;
+	TAILQ_FOREACH(s, list, entries) {
+		eq = strchr(s->value, '=');
+		fwrite(s->value, 1, eq - s->value, fp);
+		fputc('\0', fp);
+		fwrite(eq + 1, 1, strlen(eq + 1) + 1, fp);
+	}
+	ok = !ferror(fp);
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && legacy)
+		rm_dir(file, true);
+	if (!ok || rename(tmp, file) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+RC_STRINGLIST *
+rc_service_values_get(const char *service, const RC_STRINGLIST *options)
+{
+	RC_STRINGLIST *saved = rc_stringlist_new();
+	RC_STRINGLIST *list;
+	RC_STRING *s, *o;
+	size_t l;
 
-	snprintf(file, sizeof(file), RC_SVCDIR "/options/%s/%s",
-	    service, option);
-	rc_getfile(file, &buffer, &len);
+	options_read(service, NULL, saved, NULL);
+	if (!options)
+		return saved;
 
-	return buffer;
+	list = rc_stringlist_new();
+	TAILQ_FOREACH(o, options, entries) {
+		l = strlen(o->value);
+		TAILQ_FOREACH(s, saved, entries)
+			if (strncmp(s->value, o->value, l) == 0 &&
+			    s->value[l] == '=')
+			{
+				rc_stringlist_add(list, s->value);
+				break;
+			}
+	}
+	rc_stringlist_free(saved);
+	return list;
+}
+librc_hidden_def(rc_service_values_get)
+
+char *
+rc_service_value_get(const char *service, const char *option)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	RC_STRING *s;
+	char *value = NULL;
+
+	options_read(service, option, list, NULL);
+	if ((s = TAILQ_FIRST(list)))
+		value = xstrdup(strchr(s->value, '=') + 1);
+	rc_stringlist_free(list);
+	return value;
 }
 librc_hidden_def(rc_service_value_get)
 
 bool
-rc_service_value_set(const char *service, const char *option,
-    const char *value)
+rc_service_values_set(const char *service, const RC_STRINGLIST *values)
 {
-	FILE *fp;
-	char file[PATH_MAX];
-	char *p = file;
+	RC_STRINGLIST *list = rc_stringlist_new();
+	RC_STRING *s, *v, *sn;
+	size_t l;
+	bool legacy = false;
+	bool retval;
+	int fd;
 
-	p += snprintf(file, sizeof(file), RC_SVCDIR "/options/%s", service);
-	if (mkdir(file, 0755) != 0 && errno != EEXIST)
+	if ((fd = open(RC_OPTIONSDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
 		return false;
+	while (flock(fd, LOCK_EX) != 0 && errno == EINTR)
+		;
+
+	options_read(service, NULL, list, &legacy);
+	TAILQ_FOREACH(v, values, entries) {
+		l = strcspn(v->value, "=");
+		TAILQ_FOREACH_SAFE(s, list, entries, sn)
+			if (strncmp(s->value, v->value, l) == 0 &&
+			    s->value[l] == '=')
+			{
+				TAILQ_REMOVE(list, s, entries);
+				free(s->value);
+				free(s);
+			}
+		if (v->value[l] == '=')
+			rc_stringlist_add(list, v->value);
+		else
+			options_add(list, v->value, "");
+	}
+	retval = options_write(service, list, legacy);
 
-	snprintf(p, sizeof(file) - (p - file), "/%s", option);
-	if (!(fp = fopen(file, "w")))
-		return false;
-	if (value)
-		fprintf(fp, "%s", value);
-	fclose(fp);
-	return true;
+	close(fd);
+	rc_stringlist_free(list);
+	return retval;
+}
+librc_hidden_def(rc_service_values_set)
+
+bool
+rc_service_value_set(const char *service, const char *option,
+    const char *value)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	bool retval;
+
+	options_add(list, option, value ? value : "");
+	retval = rc_service_values_set(service, list);
+	rc_stringlist_free(list);
+	return retval;
 }
 librc_hidden_def(rc_service_value_set)
 
@@ -924,7 +2199,11 @@ rc_service_schedule_start(const char *service, const char *service_to_start)
 	init = rc_service_resolve(service_to_start);
 	snprintf(p, sizeof(file) - (p - file),
 	    "/%s", basename_c(service_to_start));
-	retval = (exists(file) || symlink(init, file) == 0);
+	retval = exists(file);
+	if (!retval && symlink(init, file) == 0) {
+		statetab_schedule(basename_c(service_to_start), 1);
+		retval = true;
+	}
 	free(init);
 	return retval;
 }
@@ -934,12 +2213,20 @@ bool
 rc_service_schedule_clear(const char *service)
 {
 	char dir[PATH_MAX];
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	bool retval;
 
 	snprintf(dir, sizeof(dir), RC_SVCDIR "/scheduled/%s",
 	    basename_c(service));
-	if (!rm_dir(dir, true) && errno == ENOENT)
-		return true;
-	return false;
+	list = statetab_get(true) ? ls_dir(dir, 0) : NULL;
+	retval = !rm_dir(dir, true) && errno == ENOENT;
+	if (list) {
+		TAILQ_FOREACH(s, list, entries)
+			statetab_schedule(s->value, -1);
+		rc_stringlist_free(list);
+	}
+	return retval;
 }
 librc_hidden_def(rc_service_schedule_clear)
 
@@ -948,6 +2235,8 @@ rc_services_in_runlevel(const char *runlevel)
 {
 	char dir[PATH_MAX];
 	RC_STRINGLIST *list = NULL;
+	RUNLEVEL_INDEX *ri;
+	RC_STRING *s;
 
 	if (!runlevel) {
 #ifdef RC_PKG_INITDIR
@@ -972,8 +2261,16 @@ rc_services_in_runlevel(const char *runlevel)
 
 	/* These special levels never contain any services */
 	if (strcmp(runlevel, RC_LEVEL_SINGLE) != 0) {
-		snprintf(dir, sizeof(dir), RC_RUNLEVELDIR "/%s", runlevel);
-		list = ls_dir(dir, LS_INITD);
+		if ((ri = runlevel_index(runlevel))) {
+			list = rc_stringlist_new();
+			if (ri->services)
+				TAILQ_FOREACH(s, ri->services, entries)
+					rc_stringlist_add(list, s->value);
+		} else {
+			snprintf(dir, sizeof(dir), RC_RUNLEVELDIR "/%s",
+			    runlevel);
+			list = ls_dir(dir, LS_INITD);
+		}
 	}
 	if (!list)
 		list = rc_stringlist_new();
@@ -987,6 +2284,7 @@ rc_services_in_runlevel_stacked(const char *runlevel)
 	RC_STRINGLIST *list, *stacks, *sl;
 	RC_STRING *stack;
 
+	librc_runlevel_hold(true);
 	list = rc_services_in_runlevel(runlevel);
 	stacks = rc_runlevel_stacks(runlevel);
 	TAILQ_FOREACH(stack, stacks, entries) {
@@ -994,6 +2292,8 @@ rc_services_in_runlevel_stacked(const char *runlevel)
 		TAILQ_CONCAT(list, sl, entries);
 		free(sl);
 	}
+	librc_runlevel_hold(false);
+	rc_stringlist_free(stacks);
 	return list;
 }
 librc_hidden_def(rc_services_in_runlevel_stacked)
@@ -1032,6 +2332,132 @@ rc_services_in_state(RC_SERVICE state)
 }
 librc_hidden_def(rc_services_in_state)
 
+/* The state of every service, read from RC_SVCDIR in one go */
+struct rc_snapshot {
+	/* Services in each of rc_service_state_names, in readdir order */
+	RC_STRINGLIST *lists[ARRAY_SIZE(rc_service_state_names) - 1];
+	/* Services which have scheduled others */
+	RC_STRINGLIST *schedulers;
+	/* The state of each service in the lists */
+	NAMEINDEX index;
+};
+
+static NAMEINDEX_ENTRY *
+snapshot_add(RC_SNAPSHOT *snap, const char *name, int state)
+{
+	NAMEINDEX_ENTRY *e;
+
+	e = nameindex_add(&snap->index, name, RC_SERVICE_STOPPED);
+	/* Same rules as rc_service_state */
+	if (state & 0x1f)
+		e->value = (e->value & ~0x1f) | state;
+	else
+		e->value |= state;
+	return e;
+}
+
+/* Add the services linked in a state directory to the list */
+static void
+snapshot_read(RC_STRINGLIST *list, const char *path)
+{
+	RC_STRINGLIST *services = ls_dir(path, LS_INITD);
+
+	TAILQ_CONCAT(list, services, entries);
+	free(services);
+}
+
+RC_SNAPSHOT *
+rc_service_state_snapshot(void)
+{
+	RC_SNAPSHOT *snap = xmalloc(sizeof(*snap));
+	NAMEINDEX_ENTRY *e;
+	RC_STRING *s;
+	char path[PATH_MAX];
+	size_t i;
+	int state;
+
+	memset(snap, 0, sizeof(*snap));
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		snap->lists[i] = rc_stringlist_new();
+		snprintf(path, sizeof(path), RC_SVCDIR "/%s",
+		    rc_service_state_names[i].name);
+		if (rc_service_state_names[i].state != RC_SERVICE_SCHEDULED) {
+			snapshot_read(snap->lists[i], path);
+			continue;
+		}
+		snap->schedulers = ls_dir(path, 0);
+		TAILQ_FOREACH(s, snap->schedulers, entries) {
+			snprintf(path, sizeof(path), RC_SVCDIR "/%s/%s",
+			    rc_service_state_names[i].name, s->value);
+			snapshot_read(snap->lists[i], path);
+		}
+	}
+
+	/* rc_service_state finds the directory of the services a service
+	 * has scheduled as well as the services scheduled, and only counts
+	 * the latter while they are stopped */
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		state = rc_service_state_names[i].state;
+		if (state != RC_SERVICE_SCHEDULED) {
+			TAILQ_FOREACH(s, snap->lists[i], entries)
+				snapshot_add(snap, s->value, state);
+			continue;
+		}
+		TAILQ_FOREACH(s, snap->schedulers, entries)
+			snapshot_add(snap, s->value, state);
+		TAILQ_FOREACH(s, snap->lists[i], entries) {
+			e = snapshot_add(snap, s->value, 0);
+			if (e->value & RC_SERVICE_STOPPED)
+				e->value |= state;
+		}
+	}
+	return snap;
+}
+librc_hidden_def(rc_service_state_snapshot)
+
+RC_SERVICE
+rc_snapshot_state(const RC_SNAPSHOT *snap, const char *service)
+{
+	const NAMEINDEX_ENTRY *e;
+
+	e = nameindex_find(&snap->index, basename_c(service));
+	return e ? e->value : RC_SERVICE_STOPPED;
+}
+librc_hidden_def(rc_snapshot_state)
+
+RC_STRINGLIST *
+rc_services_in_state_snapshot(const RC_SNAPSHOT *snap, RC_SERVICE state)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	RC_STRING *s;
+	size_t i;
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (rc_service_state_names[i].state != state)
+			continue;
+		TAILQ_FOREACH(s, snap->lists[i], entries)
+			rc_stringlist_add(list, s->value);
+		break;
+	}
+	return list;
+}
+librc_hidden_def(rc_services_in_state_snapshot)
+
+void
+rc_snapshot_free(RC_SNAPSHOT *snap)
+{
+	size_t i;
+
+	if (!snap)
+		return;
+	for (i = 0; rc_service_state_names[i].name; i++)
+		rc_stringlist_free(snap->lists[i]);
+	rc_stringlist_free(snap->schedulers);
+	nameindex_free(&snap->index);
+	free(snap);
+}
+librc_hidden_def(rc_snapshot_free)
+
 bool
 rc_service_add(const char *runlevel, const char *service)
 {
@@ -1075,6 +2501,7 @@ rc_service_add(const char *runlevel, const char *service)
 	}
 
 	retval = (symlink(i, file) == 0);
+	runlevel_index_drop(runlevel);
 	free(init);
 	return retval;
 }
@@ -1087,6 +2514,7 @@ rc_service_delete(const char *runlevel, const char *service)
 
 	snprintf(file, sizeof(file), RC_RUNLEVELDIR "/%s/%s",
 	    runlevel, basename_c(service));
+	runlevel_index_drop(runlevel);
 	if (unlink(file) == 0)
 		return true;
 	return false;
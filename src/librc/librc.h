@@ -64,14 +64,22 @@ librc_hidden_proto(rc_conf_value)
 librc_hidden_proto(rc_config_list)
 librc_hidden_proto(rc_config_load)
 librc_hidden_proto(rc_config_value)
+librc_hidden_proto(rc_dependlist_free)
+librc_hidden_proto(rc_deptree_closure)
+librc_hidden_proto(rc_deptree_cycles)
 librc_hidden_proto(rc_deptree_depend)
 librc_hidden_proto(rc_deptree_depends)
+librc_hidden_proto(rc_deptree_depends_snapshot)
 librc_hidden_proto(rc_deptree_free)
 librc_hidden_proto(rc_deptree_load)
 librc_hidden_proto(rc_deptree_load_file)
+librc_hidden_proto(rc_deptree_native)
 librc_hidden_proto(rc_deptree_order)
+librc_hidden_proto(rc_deptree_order_snapshot)
+librc_hidden_proto(rc_deptree_plan)
 librc_hidden_proto(rc_deptree_update)
 librc_hidden_proto(rc_deptree_update_needed)
+librc_hidden_proto(rc_file_wait)
 librc_hidden_proto(rc_find_pids)
 librc_hidden_proto(rc_getfile)
 librc_hidden_proto(rc_getline)
@@ -102,12 +110,21 @@ librc_hidden_proto(rc_service_schedule_start)
 librc_hidden_proto(rc_services_in_runlevel)
 librc_hidden_proto(rc_services_in_runlevel_stacked)
 librc_hidden_proto(rc_services_in_state)
+librc_hidden_proto(rc_services_in_state_snapshot)
 librc_hidden_proto(rc_services_scheduled)
 librc_hidden_proto(rc_services_scheduled_by)
 librc_hidden_proto(rc_service_started_daemon)
 librc_hidden_proto(rc_service_state)
+librc_hidden_proto(rc_service_state_snapshot)
+librc_hidden_proto(rc_service_state_table)
+librc_hidden_proto(rc_service_unmark)
 librc_hidden_proto(rc_service_value_get)
 librc_hidden_proto(rc_service_value_set)
+librc_hidden_proto(rc_service_values_get)
+librc_hidden_proto(rc_service_values_set)
+librc_hidden_proto(rc_service_wait)
+librc_hidden_proto(rc_snapshot_free)
+librc_hidden_proto(rc_snapshot_state)
 librc_hidden_proto(rc_stringlist_add)
 librc_hidden_proto(rc_stringlist_addu)
 librc_hidden_proto(rc_stringlist_delete)
@@ -119,4 +136,15 @@ librc_hidden_proto(rc_stringlist_sort)
 librc_hidden_proto(rc_sys)
 librc_hidden_proto(rc_yesno)
 
+/* Trust what we've read of the runlevels until released */
+void librc_runlevel_hold(bool);
+
+/* Find a service in the init directories, or in what rc_deptree_update
+ * found there while they haven't changed since */
+char *librc_service_find(const char *);
+const char *librc_deptree_path(const char *);
+
+/* The deptree if it knows what the script at a path sets for a service */
+const RC_DEPTREE *librc_deptree_meta(const char *, const char *);
+
 #endif
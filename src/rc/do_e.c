@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,11 +29,9 @@
 #include <unistd.h>
 
 #include "einfo.h"
+#include "rc.h"
 #include "helpers.h"
 
-/* usecs to wait while we poll the file existance  */
-#define WAIT_INTERVAL	20000000
-
 const char *applet = NULL;
 
 static int syslog_decode(char *name, CODE *codetab)
@@ -57,7 +56,7 @@ int main(int argc, char **argv)
 	char *message = NULL;
 	char *p;
 	int level = 0;
-	struct timespec ts;
+	int timeout;
 	struct timeval stop, now;
 	int (*e) (const char *, ...) EINFO_PRINTF(1, 2) = NULL;
 	int (*ee) (int, const char *, ...) EINFO_PRINTF(2, 3) = NULL;
@@ -121,22 +120,24 @@ int main(int argc, char **argv)
 		gettimeofday(&stop, NULL);
 		/* retval stores the timeout */
 		stop.tv_sec += retval;
-		ts.tv_sec = 0;
-		ts.tv_nsec = WAIT_INTERVAL;
 		for (i = 0; i < argc; i++) {
 			ebeginv("Waiting for %s", argv[i]);
-			for (;;) {
-				if (exists(argv[i]))
-					break;
-				if (nanosleep(&ts, NULL) == -1)
-					return EXIT_FAILURE;
+			timeout = -1;
+			if (retval > 0) {
 				gettimeofday(&now, NULL);
-				if (retval <= 0)
-					continue;
-				if (timercmp(&now, &stop, <))
-					continue;
-				eendv(EXIT_FAILURE,
-				    "timed out waiting for %s", argv[i]);
+				timersub(&stop, &now, &now);
+				if (now.tv_sec < 0)
+					timeout = 0;
+				else if (now.tv_sec >= INT_MAX / 1000)
+					timeout = INT_MAX;
+				else
+					timeout = now.tv_sec * 1000 +
+					    now.tv_usec / 1000;
+			}
+			if (!rc_file_wait(argv[i], timeout)) {
+				if (errno == ETIMEDOUT)
+					eendv(EXIT_FAILURE,
+					    "timed out waiting for %s", argv[i]);
 				return EXIT_FAILURE;
 			}
 			eendv(EXIT_SUCCESS, NULL);
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #include "einfo.h"
+#include "queue.h"
 #include "rc.h"
 #include "rc-misc.h"
 
@@ -38,6 +39,10 @@ int main(int argc, char **argv)
 	bool ok = false;
 	char *service = getenv("RC_SVCNAME");
 	char *option;
+	RC_STRINGLIST *list, *values;
+	RC_STRING *s;
+	size_t l;
+	int i;
 
 	applet = basename_c(argv[0]);
 	if (service == NULL)
@@ -46,8 +51,8 @@ int main(int argc, char **argv)
 	if (argc < 2 || ! argv[1] || *argv[1] == '\0')
 		eerrorx("%s: no option specified", applet);
 
-	if (strcmp(applet, "service_get_value") == 0 ||
-	    strcmp(applet, "get_options") == 0)
+	if ((strcmp(applet, "service_get_value") == 0 ||
+	    strcmp(applet, "get_options") == 0) && argc == 2)
 	{
 		option = rc_service_value_get(service, argv[1]);
 		if (option) {
@@ -55,10 +60,47 @@ int main(int argc, char **argv)
 			free(option);
 			ok = true;
 		}
+	} else if (strcmp(applet, "service_get_value") == 0 ||
+	    strcmp(applet, "get_options") == 0)
+	{
+		/* Print each value on a line of its own */
+		list = rc_stringlist_new();
+		for (i = 1; i < argc; i++)
+			rc_stringlist_add(list, argv[i]);
+		values = rc_service_values_get(service, list);
+		ok = true;
+		for (i = 1; i < argc; i++) {
+			l = strlen(argv[i]);
+			TAILQ_FOREACH(s, values, entries)
+				if (strncmp(s->value, argv[i], l) == 0 &&
+				    s->value[l] == '=')
+					break;
+			if (s)
+				printf("%s", s->value + l + 1);
+			else
+				ok = false;
+			printf("\n");
+		}
+		rc_stringlist_free(values);
+		rc_stringlist_free(list);
 	} else if (strcmp(applet, "service_set_value") == 0 ||
 	    strcmp(applet, "save_options") == 0)
-		ok = rc_service_value_set(service, argv[1], argv[2]);
-	else
+	{
+		/* Set each option and value pair in one go */
+		list = rc_stringlist_new();
+		for (i = 1; i < argc; i += 2) {
+			l = strlen(argv[i]) + 2;
+			if (i + 1 < argc)
+				l += strlen(argv[i + 1]);
+			option = xmalloc(l);
+			snprintf(option, l, "%s=%s", argv[i],
+			    i + 1 < argc ? argv[i + 1] : "");
+			rc_stringlist_add(list, option);
+			free(option);
+		}
+		ok = rc_service_values_set(service, list);
+		rc_stringlist_free(list);
+	} else
 		eerrorx("%s: unknown applet", applet);
 
 	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -57,7 +57,6 @@
 
 #define PREFIX_LOCK	RC_SVCDIR "/prefix.lock"
 
-#define WAIT_INTERVAL	20000000	/* usecs to poll the lock file */
 #define WAIT_TIMEOUT	60		/* seconds until we timeout */
 #define WARN_TIMEOUT	10		/* warn about this every N seconds */
 
@@ -98,13 +97,15 @@ static pid_t service_pid;
 static int signal_pipe[2] = { -1, -1 };
 
 static RC_STRINGLIST *deptypes_b;	/* broken deps */
-static RC_STRINGLIST *deptypes_n;	/* needed deps */
-static RC_STRINGLIST *deptypes_nw;	/* need+want deps */
-static RC_STRINGLIST *deptypes_nwu;	/* need+want+use deps */
 static RC_STRINGLIST *deptypes_nwua;	/* need+want+use+after deps */
-static RC_STRINGLIST *deptypes_m;	/* needed deps for stopping */
 static RC_STRINGLIST *deptypes_mwua;	/* need+want+use+after deps for stopping */
 
+/* Positions of the types in the lists above */
+#define DEPTYPE_NEED	0
+#define DEPTYPE_WANT	1
+#define DEPTYPE_USE	2
+#define DEPTYPE_AFTER	3
+
 static void
 handle_signal(int sig)
 {
@@ -161,11 +162,9 @@ handle_signal(int sig)
 static void
 unhotplug()
 {
-	char file[PATH_MAX];
-
-	snprintf(file, sizeof(file), RC_SVCDIR "/hotplugged/%s", applet);
-	if (exists(file) && unlink(file) != 0)
-		eerror("%s: unlink `%s': %s", applet, file, strerror(errno));
+	if (!rc_service_unmark(applet, RC_SERVICE_HOTPLUGGED))
+		eerror("%s: unlink `%s/hotplugged/%s': %s",
+		    applet, RC_SVCDIR, applet, strerror(errno));
 }
 
 static void
@@ -248,11 +247,7 @@ cleanup(void)
 	rc_plugin_unload();
 
 	rc_stringlist_free(deptypes_b);
-	rc_stringlist_free(deptypes_n);
-	rc_stringlist_free(deptypes_nw);
-	rc_stringlist_free(deptypes_nwu);
 	rc_stringlist_free(deptypes_nwua);
-	rc_stringlist_free(deptypes_m);
 	rc_stringlist_free(deptypes_mwua);
 	rc_deptree_free(deptree);
 	rc_stringlist_free(restart_services);
@@ -485,11 +480,9 @@ svc_exec(const char *arg1, const char *arg2)
 static bool
 svc_wait(const char *svc)
 {
-	char file[PATH_MAX];
-	int fd;
+	int timeout;
 	bool forever = false;
 	RC_STRINGLIST *keywords;
-	struct timespec interval, timeout, warn;
 
 	/* Some services don't have a timeout, like fsck */
 	keywords = rc_deptree_depend(deptree, svc, "keyword");
@@ -498,45 +491,15 @@ svc_wait(const char *svc)
 		forever = true;
 	rc_stringlist_free(keywords);
 
-	snprintf(file, sizeof(file), RC_SVCDIR "/exclusive/%s",
-	    basename_c(svc));
-
-	interval.tv_sec = 0;
-	interval.tv_nsec = WAIT_INTERVAL;
-	timeout.tv_sec = WAIT_TIMEOUT;
-	timeout.tv_nsec = 0;
-	warn.tv_sec = WARN_TIMEOUT;
-	warn.tv_nsec = 0;
-	for (;;) {
-		fd = open(file, O_RDONLY | O_NONBLOCK);
-		if (fd != -1) {
-			if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
-				close(fd);
-				return true;
-			}
-			close(fd);
-		}
-		if (errno == ENOENT)
+	for (timeout = WAIT_TIMEOUT; timeout > 0; timeout -= WARN_TIMEOUT) {
+		if (rc_service_wait(svc, forever ? -1 : WARN_TIMEOUT * 1000))
 			return true;
-		if (errno != EWOULDBLOCK)
-			eerrorx("%s: open `%s': %s", applet, file,
+		if (errno != ETIMEDOUT)
+			eerrorx("%s: waiting for %s: %s", applet, svc,
 			    strerror(errno));
-		if (nanosleep(&interval, NULL) == -1) {
-			if (errno != EINTR)
-				return false;
-		}
-		if (!forever) {
-			timespecsub(&timeout, &interval, &timeout);
-			if (timeout.tv_sec <= 0)
-				return false;
-			timespecsub(&warn, &interval, &warn);
-			if (warn.tv_sec <= 0) {
-				ewarn("%s: waiting for %s (%d seconds)",
-				    applet, svc, (int)timeout.tv_sec);
-				warn.tv_sec = WARN_TIMEOUT;
-				warn.tv_nsec = 0;
-			}
-		}
+		if (timeout > WARN_TIMEOUT)
+			ewarn("%s: waiting for %s (%d seconds)",
+			    applet, svc, timeout - WARN_TIMEOUT);
 	}
 	return false;
 }
@@ -558,27 +521,12 @@ setup_deptypes(void)
 	deptypes_b = rc_stringlist_new();
 	rc_stringlist_add(deptypes_b, "broken");
 
-	deptypes_n = rc_stringlist_new();
-	rc_stringlist_add(deptypes_n, "ineed");
-
-	deptypes_nw = rc_stringlist_new();
-	rc_stringlist_add(deptypes_nw, "ineed");
-	rc_stringlist_add(deptypes_nw, "iwant");
-
-	deptypes_nwu = rc_stringlist_new();
-	rc_stringlist_add(deptypes_nwu, "ineed");
-	rc_stringlist_add(deptypes_nwu, "iwant");
-	rc_stringlist_add(deptypes_nwu, "iuse");
-
 	deptypes_nwua = rc_stringlist_new();
 	rc_stringlist_add(deptypes_nwua, "ineed");
 	rc_stringlist_add(deptypes_nwua, "iwant");
 	rc_stringlist_add(deptypes_nwua, "iuse");
 	rc_stringlist_add(deptypes_nwua, "iafter");
 
-	deptypes_m = rc_stringlist_new();
-	rc_stringlist_add(deptypes_m, "needsme");
-
 	deptypes_mwua = rc_stringlist_new();
 	rc_stringlist_add(deptypes_mwua, "needsme");
 	rc_stringlist_add(deptypes_mwua, "wantsme");
@@ -586,6 +534,19 @@ setup_deptypes(void)
 	rc_stringlist_add(deptypes_mwua, "beforeme");
 }
 
+/* The services in a closure reached by the types up to the given one */
+static RC_STRINGLIST *
+closure_list(const RC_DEPENDLIST *closure, int type)
+{
+	RC_STRINGLIST *list = rc_stringlist_new();
+	const RC_DEPEND *dep;
+
+	TAILQ_FOREACH(dep, closure, entries)
+		if (dep->type <= type)
+			rc_stringlist_add(list, dep->service);
+	return list;
+}
+
 static void
 svc_start_check(void)
 {
@@ -632,7 +593,8 @@ svc_start_check(void)
 static void
 svc_start_deps(void)
 {
-	bool first;
+	bool first, started;
+	RC_DEPENDLIST *closure;
 	RC_STRING *svc, *svc2;
 	RC_SERVICE state;
 	int depoptions = RC_DEP_TRACE, n;
@@ -667,13 +629,16 @@ svc_start_deps(void)
 	rc_stringlist_free(services);
 	services = NULL;
 
-	need_services = rc_deptree_depends(deptree, deptypes_n,
-	    applet_list, runlevel, depoptions);
-	want_services = rc_deptree_depends(deptree, deptypes_nw,
-	    applet_list, runlevel, depoptions);
-	use_services = rc_deptree_depends(deptree, deptypes_nwu,
-	    applet_list, runlevel, depoptions);
+	/* Walk our dependencies once for everything we need to know */
+	closure = rc_deptree_closure(deptree, deptypes_nwua, applet_list,
+	    runlevel, depoptions);
+	need_services = closure_list(closure, DEPTYPE_NEED);
+	want_services = closure_list(closure, DEPTYPE_WANT);
+	use_services = closure_list(closure, DEPTYPE_USE);
+	services = closure_list(closure, DEPTYPE_AFTER);
+	rc_dependlist_free(closure);
 
+	started = false;
 	if (!rc_runlevel_starting()) {
 		TAILQ_FOREACH(svc, use_services, entries) {
 			state = rc_service_state(svc->value);
@@ -691,16 +656,28 @@ svc_start_deps(void)
 				pid = service_start(svc->value);
 				if (!rc_conf_yesno("rc_parallel"))
 					rc_waitpid(pid);
+				started = true;
 			}
 		}
 	}
 
-	if (dry_run)
+	if (dry_run) {
+		rc_stringlist_free(services);
+		services = NULL;
 		return;
+	}
+
+	/* What we started may provide something we start after, so walk
+	 * our dependencies again to see what to wait for */
+	if (started) {
+		rc_stringlist_free(services);
+		closure = rc_deptree_closure(deptree, deptypes_nwua,
+		    applet_list, runlevel, depoptions);
+		services = closure_list(closure, DEPTYPE_AFTER);
+		rc_dependlist_free(closure);
+	}
 
 	/* Now wait for them to start */
-	services = rc_deptree_depends(deptree, deptypes_nwua, applet_list,
-	    runlevel, depoptions);
 	/* We use tmplist to hold our scheduled by list */
 	tmplist = rc_stringlist_new();
 	TAILQ_FOREACH(svc, services, entries) {
@@ -892,6 +869,8 @@ static void
 svc_stop_deps(RC_SERVICE state)
 {
 	int depoptions = RC_DEP_TRACE;
+	RC_DEPENDLIST *closure;
+	RC_STRINGLIST *wait_services;
 	RC_STRING *svc;
 	pid_t pid;
 
@@ -905,11 +884,15 @@ svc_stop_deps(RC_SERVICE state)
 	if (!deptree && ((deptree = _rc_deptree_load(0, NULL)) == NULL))
 		eerrorx("failed to load deptree");
 
-	if (!deptypes_m)
+	if (!deptypes_mwua)
 		setup_deptypes();
 
-	services = rc_deptree_depends(deptree, deptypes_m, applet_list,
+	/* Walk our dependants once for everything we need to know */
+	closure = rc_deptree_closure(deptree, deptypes_mwua, applet_list,
 	    runlevel, depoptions);
+	services = closure_list(closure, DEPTYPE_NEED);
+	wait_services = closure_list(closure, DEPTYPE_AFTER);
+	rc_dependlist_free(closure);
 	tmplist = rc_stringlist_new();
 	TAILQ_FOREACH_REVERSE(svc, services, rc_stringlist, entries) {
 		state = rc_service_state(svc->value);
@@ -939,9 +922,12 @@ svc_stop_deps(RC_SERVICE state)
 		}
 	}
 	rc_stringlist_free(services);
-	services = NULL;
-	if (dry_run)
+	services = wait_services;
+	if (dry_run) {
+		rc_stringlist_free(services);
+		services = NULL;
 		return;
+	}
 
 	TAILQ_FOREACH(svc, tmplist, entries) {
 		if (rc_service_state(svc->value) & RC_SERVICE_STOPPED)
@@ -968,8 +954,6 @@ svc_stop_deps(RC_SERVICE state)
 
 	/* We now wait for other services that may use us and are
 	 * stopping. This is important when a runlevel stops */
-	services = rc_deptree_depends(deptree, deptypes_mwua, applet_list,
-	    runlevel, depoptions);
 	TAILQ_FOREACH(svc, services, entries) {
 		if (rc_service_state(svc->value) & RC_SERVICE_STOPPED)
 			continue;
@@ -19,6 +19,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -39,38 +40,132 @@
 
 const char *applet = NULL;
 const char *extraopts = NULL;
-const char *getoptstring = "aot:suTF:" getoptstring_COMMON;
+const char *getoptstring = "acot:surTwF:" getoptstring_COMMON;
 const struct option longopts[] = {
 	{ "starting", 0, NULL, 'a'},
+	{ "cycles",   0, NULL, 'c'},
 	{ "stopping", 0, NULL, 'o'},
 	{ "type",     1, NULL, 't'},
 	{ "notrace",  0, NULL, 'T'},
 	{ "strict",   0, NULL, 's'},
 	{ "update",   0, NULL, 'u'},
+	{ "report",   0, NULL, 'r'},
+	{ "waits",    0, NULL, 'w'},
 	{ "deptree-file", 1, NULL, 'F'},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
 	"Order services as if runlevel is starting",
+	"List dependency cycles and the dependencies dropped to break them",
 	"Order services as if runlevel is stopping",
 	"Type(s) of dependency to list",
 	"Don't trace service dependencies",
 	"Only use what is in the runlevels",
-	"Force an update of the dependency tree",
+	"Force an update of the dependency tree from every init script",
+	"Show which init scripts, or the given ones, are parsed natively",
+	"List which of the given services each one waits for to start",
 	"File to load cached deptree from",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
+static void
+print_cycles(const RC_DEPTREE *deptree)
+{
+	RC_STRINGLIST *cycles = rc_deptree_cycles(deptree);
+	RC_STRINGLIST *services, *broken;
+	RC_STRING *s, *s2, *s3;
+	char *type;
+
+	TAILQ_FOREACH(s, cycles, entries) {
+		printf("cycle: %s\n", s->value);
+		services = rc_stringlist_split(s->value, " ");
+		TAILQ_FOREACH(s2, services, entries) {
+			broken = rc_deptree_depend(deptree, s2->value,
+			    "cyclebreak");
+			if (broken)
+				TAILQ_FOREACH(s3, broken, entries) {
+					type = strchr(s3->value, ':');
+					if (!type)
+						continue;
+					*type++ = '\0';
+					printf("\tdropped: %s %s %s\n",
+					    s2->value, s3->value, type);
+				}
+			rc_stringlist_free(broken);
+		}
+		rc_stringlist_free(services);
+	}
+	rc_stringlist_free(cycles);
+}
+
+static const char *const init_dirs[] = {
+	RC_INITDIR,
+#ifdef RC_PKG_INITDIR
+	RC_PKG_INITDIR,
+#endif
+#ifdef RC_LOCAL_INITDIR
+	RC_LOCAL_INITDIR,
+#endif
+	NULL
+};
+
+/* Say if we parse the dependencies of a script natively or source it,
+ * listing what we parsed if asked */
+static void
+report_script(const char *script, bool lines)
+{
+	RC_STRINGLIST *native = rc_deptree_native(script);
+	RC_STRING *s;
+
+	printf("%s %s\n", native ? "native" : "shell", script);
+	if (native && lines)
+		TAILQ_FOREACH(s, native, entries)
+			printf("\t%s\n", s->value);
+	rc_stringlist_free(native);
+}
+
+static void
+report_scripts(void)
+{
+	RC_STRINGLIST *scripts;
+	RC_STRING *s;
+	DIR *dp;
+	struct dirent *d;
+	char path[PATH_MAX];
+	size_t i, j;
+
+	for (i = 0; init_dirs[i]; i++) {
+		for (j = 0; j < i; j++)
+			if (strcmp(init_dirs[i], init_dirs[j]) == 0)
+				break;
+		if (j < i || !(dp = opendir(init_dirs[i])))
+			continue;
+		scripts = rc_stringlist_new();
+		while ((d = readdir(dp)))
+			if (*d->d_name != '.')
+				rc_stringlist_add(scripts, d->d_name);
+		closedir(dp);
+		rc_stringlist_sort(&scripts);
+		TAILQ_FOREACH(s, scripts, entries) {
+			snprintf(path, sizeof(path), "%s/%s",
+			    init_dirs[i], s->value);
+			report_script(path, false);
+		}
+		rc_stringlist_free(scripts);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	RC_STRINGLIST *list;
 	RC_STRINGLIST *types;
 	RC_STRINGLIST *services;
 	RC_STRINGLIST *depends;
-	RC_STRING *s;
+	RC_STRING *s, *s2;
 	RC_DEPTREE *deptree = NULL;
-	int options = RC_DEP_TRACE, update = 0;
+	int options = RC_DEP_TRACE, update = 0, report = 0, cycles = 0;
+	int waits = 0;
 	bool first = true;
 	char *runlevel = xstrdup(getenv("RC_RUNLEVEL"));
 	int opt;
@@ -86,6 +181,9 @@ int main(int argc, char **argv)
 		case 'a':
 			options |= RC_DEP_START;
 			break;
+		case 'c':
+			cycles = 1;
+			break;
 		case 'o':
 			options |= RC_DEP_STOP;
 			break;
@@ -99,6 +197,12 @@ int main(int argc, char **argv)
 		case 'u':
 			update = 1;
 			break;
+		case 'r':
+			report = 1;
+			break;
+		case 'w':
+			waits = 1;
+			break;
 		case 'T':
 			options &= RC_DEP_TRACE;
 			break;
@@ -110,6 +214,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (report) {
+		if (optind == argc)
+			report_scripts();
+		while (optind < argc)
+			report_script(argv[optind++], true);
+		rc_stringlist_free(types);
+		free(runlevel);
+		return EXIT_SUCCESS;
+	}
+
 	if (deptree_file) {
 		if (!(deptree = rc_deptree_load_file(deptree_file)))
 			eerrorx("failed to load deptree");
@@ -118,6 +232,9 @@ int main(int argc, char **argv)
 			eerrorx("failed to load deptree");
 	}
 
+	if (cycles)
+		print_cycles(deptree);
+
 	if (!runlevel)
 		runlevel = rc_runlevel_get();
 
@@ -142,7 +259,7 @@ int main(int argc, char **argv)
 		rc_stringlist_free(types);
 		rc_deptree_free(deptree);
 		free(runlevel);
-		if (update)
+		if (update || cycles)
 			return EXIT_SUCCESS;
 		eerrorx("no services specified");
 	}
@@ -150,7 +267,29 @@ int main(int argc, char **argv)
 	/* If we don't have any types, then supply some defaults */
 	if (!TAILQ_FIRST(types)) {
 		rc_stringlist_add(types, "ineed");
-		rc_stringlist_add(types, "iuse");
+		if (waits) {
+			rc_stringlist_add(types, "iwant");
+			rc_stringlist_add(types, "iuse");
+			rc_stringlist_add(types, "iafter");
+		} else
+			rc_stringlist_add(types, "iuse");
+	}
+
+	/* What rc waits for when it starts the services together */
+	if (waits) {
+		TAILQ_FOREACH(s, services, entries) {
+			printf("%s", s->value);
+			list = waits_for(deptree, types, s->value, services);
+			TAILQ_FOREACH(s2, list, entries)
+			    printf(" %s", s2->value);
+			printf("\n");
+			rc_stringlist_free(list);
+		}
+		rc_stringlist_free(types);
+		rc_stringlist_free(services);
+		rc_deptree_free(deptree);
+		free(runlevel);
+		return EXIT_SUCCESS;
 	}
 
 	depends = rc_deptree_depends(deptree, types, services,
@@ -286,8 +286,9 @@ exec_service(const char *service, const char *arg)
 		sigaction(SIGUSR1, &sa, NULL);
 		sigaction(SIGWINCH, &sa, NULL);
 
-		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
+		/* Unmask signals, including any our caller was holding
+		 * off while it waits for its services */
+		sigprocmask(SIG_SETMASK, &sa.sa_mask, NULL);
 
 		/* Safe to run now */
 		execl(file, file, "--lockfd", sfd, arg, (char *) NULL);
@@ -363,6 +364,11 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 
 		if (regen)
 			*regen = 1;
+		/* When forced, look at every script again rather than
+		 * trust what we cached for those which didn't change, as
+		 * what a script prints may depend on more than its files */
+		if (force != 0)
+			unlink(RC_DEPCACHE "/.global");
 		ebegin("Caching service dependencies");
 		retval = rc_deptree_update() ? 0 : -1;
 		eend (retval, "Failed to update the dependency tree");
@@ -381,6 +387,7 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 				ut.actime = t;
 				ut.modtime = t;
 				utime(RC_DEPTREE_CACHE, &ut);
+				utime(RC_DEPTREE_BIN, &ut);
 			} else {
 				if (exists(RC_DEPTREE_SKEWED))
 					unlink(RC_DEPTREE_SKEWED);
@@ -392,6 +399,39 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 	return rc_deptree_load();
 }
 
+/* Of the given services, those the service depends on by one of the
+ * types, and so waits for while they start. A virtual service is
+ * waited for through each of its providers in the list. */
+RC_STRINGLIST *
+waits_for(const RC_DEPTREE *deptree, const RC_STRINGLIST *types,
+	  const char *service, RC_STRINGLIST *services)
+{
+	RC_STRINGLIST *waits = rc_stringlist_new();
+	RC_STRINGLIST *deps, *providers;
+	RC_STRING *type, *dep, *provider;
+
+	TAILQ_FOREACH(type, types, entries) {
+		deps = rc_deptree_depend(deptree, service, type->value);
+		TAILQ_FOREACH(dep, deps, entries) {
+			if (rc_stringlist_find(services, dep->value)) {
+				if (strcmp(dep->value, service) != 0)
+					rc_stringlist_addu(waits, dep->value);
+				continue;
+			}
+			providers = rc_deptree_depend(deptree, dep->value,
+			    "providedby");
+			TAILQ_FOREACH(provider, providers, entries)
+			    if (strcmp(provider->value, service) != 0 &&
+				rc_stringlist_find(services, provider->value))
+				    rc_stringlist_addu(waits,
+					provider->value);
+			rc_stringlist_free(providers);
+		}
+		rc_stringlist_free(deps);
+	}
+	return waits;
+}
+
 bool _rc_can_find_pids(void)
 {
 	RC_PIDLIST *pids;
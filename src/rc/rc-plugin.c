@@ -186,7 +186,7 @@ rc_plugin_run(RC_HOOK hook, const char *value)
 			sigaction(SIGTERM, &sa, NULL);
 			sigaction(SIGUSR1, &sa, NULL);
 			sigaction(SIGWINCH, &sa, NULL);
-			sigprocmask(SIG_SETMASK, &old, NULL);
+			sigprocmask(SIG_SETMASK, &empty, NULL);
 
 			rc_in_plugin = true;
 			close(pfd[0]);
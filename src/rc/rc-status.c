@@ -60,6 +60,16 @@ static RC_STRINGLIST *types;
 
 static RC_STRINGLIST *levels, *services, *tmp, *alist;
 static RC_STRINGLIST *sservices, *nservices, *needsme;
+static RC_SNAPSHOT *snapshot;
+
+/* We look at the state of most services, so read them all at once */
+static const RC_SNAPSHOT *
+get_snapshot(void)
+{
+	if (!snapshot)
+		snapshot = rc_service_state_snapshot();
+	return snapshot;
+}
 
 static void
 print_level(const char *prefix, const char *level)
@@ -78,10 +88,12 @@ print_level(const char *prefix, const char *level)
 
 static void get_uptime(const char *service, char *uptime, int uptime_size)
 {
-	RC_SERVICE state = rc_service_state(service);
-	char *start_count;
+	RC_SERVICE state = rc_snapshot_state(get_snapshot(), service);
+	RC_STRINGLIST *options, *values;
+	RC_STRING *s;
+	char *start_count = NULL;
 	time_t now;
-	char *start_time_string;
+	char *start_time_string = NULL;
 	time_t start_time;
 	time_t time_diff;
 	time_t diff_days = (time_t) 0;
@@ -91,8 +103,17 @@ static void get_uptime(const char *service, char *uptime, int uptime_size)
 
 	uptime[0] = '\0';
 	if (state & RC_SERVICE_STARTED) {
-		start_count = rc_service_value_get(service, "start_count");
-		start_time_string = rc_service_value_get(service, "start_time");
+		/* Read both in one go */
+		options = rc_stringlist_new();
+		rc_stringlist_add(options, "start_count");
+		rc_stringlist_add(options, "start_time");
+		values = rc_service_values_get(service, options);
+		TAILQ_FOREACH(s, values, entries) {
+			if (strncmp(s->value, "start_count=", 12) == 0)
+				start_count = s->value + 12;
+			else if (strncmp(s->value, "start_time=", 11) == 0)
+				start_time_string = s->value + 11;
+		}
 		if (start_count && start_time_string) {
 			start_time = to_time_t(start_time_string);
 			now = time(NULL);
@@ -120,6 +141,8 @@ static void get_uptime(const char *service, char *uptime, int uptime_size)
 						"%02ld:%02ld:%02ld (%s)",
 						diff_hours, diff_mins, diff_secs, start_count);
 		}
+		rc_stringlist_free(values);
+		rc_stringlist_free(options);
 	}
 }
 
@@ -130,7 +153,7 @@ print_service(const char *service)
 	char uptime [40];
 	int cols =  printf(" %s", service);
 	const char *c = ecolor(ECOLOR_GOOD);
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = rc_snapshot_state(get_snapshot(), service);
 	ECOLOR color = ECOLOR_BAD;
 
 	if (state & RC_SERVICE_STOPPING)
@@ -191,8 +214,10 @@ print_services(const char *runlevel, RC_STRINGLIST *svcs)
 	}
 	if (!runlevel)
 		r = rc_runlevel_get();
-	l = rc_deptree_depends(deptree, types, svcs, r ? r : runlevel,
-			       RC_DEP_STRICT | RC_DEP_TRACE | RC_DEP_START);
+	l = rc_deptree_depends_snapshot(deptree, types, svcs,
+					r ? r : runlevel,
+					RC_DEP_STRICT | RC_DEP_TRACE | RC_DEP_START,
+					get_snapshot());
 	free(r);
 	if (!l)
 		return;
@@ -242,7 +267,8 @@ int main(int argc, char **argv)
 			levels = rc_runlevel_list();
 			break;
 		case 'c':
-			services = rc_services_in_state(RC_SERVICE_STARTED);
+			services = rc_services_in_state_snapshot(get_snapshot(),
+			    RC_SERVICE_STARTED);
 			retval = 1;
 			TAILQ_FOREACH(s, services, entries)
 				if (rc_service_daemons_crashed(s->value)) {
@@ -269,7 +295,7 @@ int main(int argc, char **argv)
 					}
 			}
 			TAILQ_FOREACH_SAFE(s, services, entries, t)
-				if (rc_service_state(s->value) &
+				if (rc_snapshot_state(get_snapshot(), s->value) &
 					(RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)) {
 					TAILQ_REMOVE(services, s, entries);
 					free(s->value);
@@ -340,7 +366,8 @@ int main(int argc, char **argv)
 	if (show_all || argc < 2) {
 		/* Show hotplugged services */
 		print_level("Dynamic", "hotplugged");
-		services = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+		services = rc_services_in_state_snapshot(get_snapshot(),
+		    RC_SERVICE_HOTPLUGGED);
 		print_services(NULL, services);
 		rc_stringlist_free(services);
 		services = NULL;
@@ -364,7 +391,7 @@ int main(int argc, char **argv)
 		}
 		TAILQ_FOREACH_SAFE(s, services, entries, t) {
 			if ((rc_stringlist_find(sservices, s->value) ||
-			    (rc_service_state(s->value) & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
+			    (rc_snapshot_state(get_snapshot(), s->value) & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
 				TAILQ_REMOVE(services, s, entries);
 				free(s->value);
 				free(s);
@@ -381,7 +408,7 @@ int main(int argc, char **argv)
 			TAILQ_FOREACH_SAFE(s, services, entries, t) {
 				l->value = s->value;
 				setenv("RC_SVCNAME", l->value, 1);
-				tmp = rc_deptree_depends(deptree, needsme, alist, level->value, RC_DEP_TRACE);
+				tmp = rc_deptree_depends_snapshot(deptree, needsme, alist, level->value, RC_DEP_TRACE, get_snapshot());
 				if (TAILQ_FIRST(tmp)) {
 					TAILQ_REMOVE(services, s, entries);
 					TAILQ_INSERT_TAIL(nservices, s, entries);
@@ -411,6 +438,7 @@ exit:
 	rc_stringlist_free(types);
 	rc_stringlist_free(levels);
 	rc_deptree_free(deptree);
+	rc_snapshot_free(snapshot);
 
 	return retval;
 }
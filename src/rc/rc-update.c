@@ -343,6 +343,20 @@ int main(int argc, char **argv)
 				ewarnx("%s: service `%s' not found in any"
 				    " of the specified runlevels",
 				    applet, service);
+
+			/* Start plans are keyed by the runlevels, so compile
+			 * them again now rather than when booting */
+			if (num_updated > 0 && !stack &&
+			    (deptree = rc_deptree_load()))
+			{
+				rc_stringlist_free(runlevels);
+				runlevels = rc_runlevel_list();
+				TAILQ_FOREACH(runlevel, runlevels, entries)
+					rc_stringlist_free(rc_deptree_plan(deptree,
+					    runlevel->value,
+					    RC_DEP_STRICT | RC_DEP_TRACE));
+				rc_deptree_free(deptree);
+			}
 		}
 	}
 
@@ -28,13 +28,19 @@ const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#  include <sys/signalfd.h>
+#  include <sys/syscall.h>
+#endif
 
 #include <errno.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -43,6 +49,7 @@ const char rc_copyright[] = "Copyright (c) 2007-2008 Roy Marples";
 #include <string.h>
 #include <strings.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "einfo.h"
@@ -85,11 +92,14 @@ const char *usagestring = ""					\
 
 #define DEVBOOT			"/dev/.rcboot"
 
+#define DURATIONS		RC_SVCDIR "/durations"
+#define DURATION_START		0
+#define DURATION_STOP		1
+
 const char *applet = NULL;
 static RC_STRINGLIST *main_hotplugged_services;
 static RC_STRINGLIST *main_stop_services;
 static RC_STRINGLIST *main_start_services;
-static RC_STRINGLIST *main_types_nw;
 static RC_STRINGLIST *main_types_nwua;
 static RC_DEPTREE *main_deptree;
 static char *runlevel;
@@ -97,15 +107,46 @@ static RC_HOOK hook_out;
 
 struct termios *termios_orig = NULL;
 
-RC_PIDLIST service_pids;
+/* The services we have started and not yet reaped. Where the system
+ * has them, each holds a pidfd which polls readable once it exits. */
+struct service_pid {
+	pid_t pid;
+	int fd;
+	LIST_ENTRY(service_pid) entries;
+};
+static LIST_HEAD(service_pidlist, service_pid) service_pids;
+
+/* How long each service took to start and stop the last times we did,
+ * in milliseconds or -1 if we don't know yet. savecache keeps them over
+ * a reboot. */
+struct duration {
+	char *service;
+	long ms[2];
+	TAILQ_ENTRY(duration) entries;
+};
+TAILQ_HEAD(durationlist, duration);
+static struct durationlist durations = TAILQ_HEAD_INITIALIZER(durations);
+static bool durations_loaded;
+static bool durations_changed;
+
+/* Signals we take in our event loop while running services, and in a
+ * handler otherwise */
+static const int event_signals[] = {
+	SIGCHLD, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGWINCH,
+};
+static int signal_fd = -1;
+#ifdef __linux__
+static sigset_t event_sset;
+#else
+static int signal_pipe = -1;
+static volatile sig_atomic_t events_held;
+#endif
 
 static void
 clean_failed(void)
 {
 	DIR *dp;
 	struct dirent *d;
-	size_t l;
-	char *path;
 
 	/* Clean the failed services state dir now */
 	if ((dp = opendir(RC_SVCDIR "/failed"))) {
@@ -115,16 +156,10 @@ clean_failed(void)
 				(d->d_name[1] == '.' && d->d_name[2] == '\0')))
 				continue;
 
-			l = strlen(RC_SVCDIR "/failed/") +
-			    strlen(d->d_name) + 1;
-			path = xmalloc(sizeof(char) * l);
-			snprintf(path, l, RC_SVCDIR "/failed/%s", d->d_name);
-			if (path) {
-				if (unlink(path))
-					eerror("%s: unlink `%s': %s",
-					    applet, path, strerror(errno));
-				free(path);
-			}
+			if (!rc_service_unmark(d->d_name, RC_SERVICE_FAILED))
+				eerror("%s: unlink `%s/failed/%s': %s",
+				    applet, RC_SVCDIR, d->d_name,
+				    strerror(errno));
 		}
 		closedir(dp);
 	}
@@ -133,8 +168,8 @@ clean_failed(void)
 static void
 cleanup(void)
 {
-	RC_PID *p1 = LIST_FIRST(&service_pids);
-	RC_PID *p2;
+	struct service_pid *p;
+	struct duration *d;
 
 	if (!rc_in_logger && !rc_in_plugin &&
 	    applet && (strcmp(applet, "rc") == 0 || strcmp(applet, "openrc") == 0))
@@ -156,16 +191,23 @@ cleanup(void)
 		rc_logger_close();
 	}
 
-	while (p1) {
-		p2 = LIST_NEXT(p1, entries);
-		free(p1);
-		p1 = p2;
+	while ((p = LIST_FIRST(&service_pids))) {
+		LIST_REMOVE(p, entries);
+		if (p->fd != -1)
+			close(p->fd);
+		free(p);
+	}
+	if (signal_fd != -1)
+		close(signal_fd);
+	while ((d = TAILQ_FIRST(&durations))) {
+		TAILQ_REMOVE(&durations, d, entries);
+		free(d->service);
+		free(d);
 	}
 
 	rc_stringlist_free(main_hotplugged_services);
 	rc_stringlist_free(main_stop_services);
 	rc_stringlist_free(main_start_services);
-	rc_stringlist_free(main_types_nw);
 	rc_stringlist_free(main_types_nwua);
 	rc_deptree_free(main_deptree);
 	free(runlevel);
@@ -258,8 +300,8 @@ run_program(const char *prog)
 		sigaction(SIGUSR1, &sa, NULL);
 		sigaction(SIGWINCH, &sa, NULL);
 
-		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
+		/* Unmask signals, including those our event loop takes */
+		sigprocmask(SIG_SETMASK, &sa.sa_mask, NULL);
 
 		if (termios_orig)
 			tcsetattr(STDIN_FILENO, TCSANOW, termios_orig);
@@ -361,60 +403,75 @@ get_krunlevel(char *buffer, int buffer_len)
 static void
 add_pid(pid_t pid)
 {
-	RC_PID *p = xmalloc(sizeof(*p));
+	struct service_pid *p = xmalloc(sizeof(*p));
 	p->pid = pid;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	p->fd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+	p->fd = -1;
+#endif
 	LIST_INSERT_HEAD(&service_pids, p, entries);
 }
 
-static void
-remove_pid(pid_t pid)
+/* Reap the service if it has finished */
+static bool
+reap_pid(struct service_pid *p)
+{
+	pid_t pid;
+
+	while ((pid = waitpid(p->pid, NULL, WNOHANG)) == -1 && errno == EINTR)
+		;
+	if (pid == 0)
+		return false;
+	LIST_REMOVE(p, entries);
+	if (p->fd != -1)
+		close(p->fd);
+	free(p);
+	return true;
+}
+
+static bool
+pid_running(pid_t pid)
 {
-	RC_PID *p;
+	struct service_pid *p;
 
 	LIST_FOREACH(p, &service_pids, entries)
-	    if (p->pid == pid) {
-		    LIST_REMOVE(p, entries);
-		    free(p);
-		    return;
-	    }
+	    if (p->pid == pid)
+		    return true;
+	return false;
 }
 
-static void
-wait_for_services(void)
+/* The next signal waiting on signal_fd, or 0 if there are none */
+static int
+events_signal(void)
 {
-	for (;;) {
-		while (waitpid(0, 0, 0) != -1)
-			;
-		if (errno != EINTR)
-			break;
-	}
+#ifdef __linux__
+	struct signalfd_siginfo si;
+
+	if (read(signal_fd, &si, sizeof(si)) == sizeof(si))
+		return (int)si.ssi_signo;
+#else
+	unsigned char c;
+
+	if (read(signal_fd, &c, 1) == 1)
+		return c;
+#endif
+	return 0;
 }
 
 static void
 handle_signal(int sig)
 {
-	int serrno = errno;
 	char signame[10] = { '\0' };
-	pid_t pid;
-	RC_PID *pi;
-	int status = 0;
+	struct service_pid *p, *p2;
 	struct winsize ws;
-	sigset_t sset;
 
 	switch (sig) {
 	case SIGCHLD:
-		do {
-			pid = waitpid(-1, &status, WNOHANG);
-			if (pid < 0) {
-				if (errno != ECHILD)
-					eerror("waitpid: %s", strerror(errno));
-				return;
-			}
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-		/* Remove that pid from our list */
-		if (pid > 0)
-			remove_pid(pid);
+		/* Services with a pidfd are reaped when it polls */
+		LIST_FOREACH_SAFE(p, &service_pids, entries, p2)
+		    if (p->fd == -1)
+			    reap_pid(p);
 		break;
 
 	case SIGWINCH:
@@ -440,14 +497,9 @@ handle_signal(int sig)
 	case SIGUSR1:
 		eerror("rc: Aborting!");
 
-		/* Block child signals */
-		sigemptyset(&sset);
-		sigaddset(&sset, SIGCHLD);
-		sigprocmask(SIG_BLOCK, &sset, NULL);
-
 		/* Kill any running services we have started */
-		LIST_FOREACH(pi, &service_pids, entries)
-		    kill(pi->pid, SIGTERM);
+		LIST_FOREACH(p, &service_pids, entries)
+		    kill(p->pid, SIGTERM);
 
 		/* Notify plugins we are aborting */
 		rc_plugin_run(RC_HOOK_ABORT, NULL);
@@ -458,11 +510,126 @@ handle_signal(int sig)
 	default:
 		eerror("%s: caught unknown signal %d", applet, sig);
 	}
+}
 
-	/* Restore errno */
+/* Outside our event loop we deal with signals as they arrive, so we can
+ * be interrupted whatever we are doing */
+static void
+signal_event(int sig)
+{
+	int serrno = errno;
+#ifndef __linux__
+	unsigned char c = (unsigned char)sig;
+
+	if (events_held) {
+		if (write(signal_pipe, &c, 1) == -1)
+			/* Already full of signals for us to read */;
+		errno = serrno;
+		return;
+	}
+#endif
+	handle_signal(sig);
 	errno = serrno;
 }
 
+static void
+events_open(void)
+{
+	size_t i;
+#ifdef __linux__
+	sigemptyset(&event_sset);
+	for (i = 0; i < ARRAY_SIZE(event_signals); i++)
+		sigaddset(&event_sset, event_signals[i]);
+	signal_fd = signalfd(-1, &event_sset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1)
+		eerrorx("%s: signalfd: %s", applet, strerror(errno));
+#else
+	int fds[2];
+
+	if (pipe(fds) == -1)
+		eerrorx("%s: pipe: %s", applet, strerror(errno));
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+	}
+	signal_fd = fds[0];
+	signal_pipe = fds[1];
+#endif
+	for (i = 0; i < ARRAY_SIZE(event_signals); i++)
+		signal_setup(event_signals[i], signal_event);
+}
+
+/* While held, the signals we handle wait on signal_fd for events_wait
+ * so we know our services from the moment we start them. Letting go
+ * deals with any still waiting there. */
+static void
+events_hold(bool hold)
+{
+	int sig;
+
+#ifdef __linux__
+	if (hold) {
+		sigprocmask(SIG_BLOCK, &event_sset, NULL);
+		return;
+	}
+	while ((sig = events_signal()))
+		handle_signal(sig);
+	sigprocmask(SIG_UNBLOCK, &event_sset, NULL);
+#else
+	events_held = hold;
+	if (!hold)
+		while ((sig = events_signal()))
+			handle_signal(sig);
+#endif
+}
+
+/* Wait up to timeout milliseconds, or for ever if negative, for a
+ * signal or a service to finish and deal with what we get */
+static void
+events_wait(int timeout)
+{
+	struct service_pid *p, **pids;
+	struct pollfd *fds;
+	nfds_t i, n = 1;
+	int sig;
+
+	LIST_FOREACH(p, &service_pids, entries)
+	    if (p->fd != -1)
+		    n++;
+	fds = xmalloc(sizeof(*fds) * n);
+	pids = xmalloc(sizeof(*pids) * n);
+	fds[0].fd = signal_fd;
+	fds[0].events = POLLIN;
+	n = 1;
+	LIST_FOREACH(p, &service_pids, entries) {
+		if (p->fd == -1)
+			continue;
+		fds[n].fd = p->fd;
+		fds[n].events = POLLIN;
+		pids[n++] = p;
+	}
+
+	if (poll(fds, n, timeout) > 0) {
+		for (i = 1; i < n; i++)
+			if (fds[i].revents)
+				reap_pid(pids[i]);
+		if (fds[0].revents)
+			while ((sig = events_signal()))
+				handle_signal(sig);
+	}
+	free(pids);
+	free(fds);
+}
+
+static void
+wait_for_services(void)
+{
+	events_hold(true);
+	while (LIST_FIRST(&service_pids))
+		events_wait(-1);
+	events_hold(false);
+}
+
 static void
 do_sysinit()
 {
@@ -526,29 +693,435 @@ runlevel_config(const char *service, const char *level)
 	return retval;
 }
 
+/* A service waiting to be started or stopped, the stacked runlevel which
+ * wanted it and the services in the same plan which have to finish before
+ * it can be. cost is how long we expect it and the longest chain of jobs
+ * waiting on it to take, chain the part of that after it. */
+struct service_job {
+	char *service;
+	const char *level;
+	pid_t pid;
+	struct timespec started;
+	struct timespec deadline;
+	long cost;
+	long chain;
+	bool late;
+	RC_STRINGLIST *after;
+	TAILQ_ENTRY(service_job) entries;
+};
+TAILQ_HEAD(service_jobs, service_job);
+
+/* How many services we start or stop at once, 0 meaning no limit */
+static long
+parallel_jobs(bool parallel)
+{
+	const char *value;
+	char *e;
+	long jobs = 0;
+
+	if (!parallel)
+		return 1;
+	if ((value = rc_conf_value("rc_parallel_jobs"))) {
+		jobs = strtol(value, &e, 10);
+		if (*e != '\0' || jobs < 0)
+			jobs = 0;
+	}
+	return jobs;
+}
+
+/* How many seconds we wait for a service to start before we stop
+ * holding back the services which come after it, 0 meaning for ever */
+static long
+start_timeout(void)
+{
+	const char *value;
+	char *e;
+	long timeout = 0;
+
+	if ((value = rc_conf_value("rc_start_timeout"))) {
+		timeout = strtol(value, &e, 10);
+		if (*e != '\0' || timeout < 0)
+			timeout = 0;
+	}
+	return timeout;
+}
+
+/* Milliseconds from now until the deadline, or 0 if it has passed */
+static int
+ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+	    (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	if (ms < 0)
+		return 0;
+	if (ms > INT_MAX)
+		return INT_MAX;
+	return (int)ms;
+}
+
+/* Milliseconds since the time */
+static long
+ms_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long)((now.tv_sec - then->tv_sec) * 1000LL +
+	    (now.tv_nsec - then->tv_nsec) / 1000000);
+}
+
+static struct duration *
+duration_find(const char *service, bool add)
+{
+	struct duration *d;
+
+	TAILQ_FOREACH(d, &durations, entries)
+	    if (strcmp(d->service, service) == 0)
+		    return d;
+	if (!add)
+		return NULL;
+	d = xmalloc(sizeof(*d));
+	d->service = xstrdup(service);
+	d->ms[DURATION_START] = d->ms[DURATION_STOP] = -1;
+	TAILQ_INSERT_TAIL(&durations, d, entries);
+	return d;
+}
+
+static void
+durations_load(void)
+{
+	FILE *fp;
+	char *line = NULL, *p, *service;
+	size_t len = 0;
+	struct duration *d;
+	long start, stop;
+
+	if (durations_loaded)
+		return;
+	durations_loaded = true;
+	if (!(fp = fopen(DURATIONS, "r")))
+		return;
+	while (rc_getline(&line, &len, fp)) {
+		p = line;
+		service = strsep(&p, " ");
+		if (!*service || !p ||
+		    sscanf(p, "%ld %ld", &start, &stop) != 2)
+			continue;
+		d = duration_find(service, true);
+		d->ms[DURATION_START] = start;
+		d->ms[DURATION_STOP] = stop;
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void
+durations_save(void)
+{
+	FILE *fp;
+	struct duration *d;
+
+	if (!durations_changed)
+		return;
+	durations_changed = false;
+	if (!(fp = fopen(DURATIONS ".new", "w")))
+		return;
+	TAILQ_FOREACH(d, &durations, entries)
+	    fprintf(fp, "%s %ld %ld\n", d->service,
+		d->ms[DURATION_START], d->ms[DURATION_STOP]);
+	if (fclose(fp) == 0)
+		rename(DURATIONS ".new", DURATIONS);
+	else
+		unlink(DURATIONS ".new");
+}
+
+static long
+duration_get(const char *service, int what)
+{
+	struct duration *d;
+
+	durations_load();
+	d = duration_find(service, false);
+	return d ? d->ms[what] : -1;
+}
+
+/* Remember how long it took, smoothing out the odd slow one */
+static void
+duration_set(const char *service, int what, long ms)
+{
+	struct duration *d;
+
+	durations_load();
+	d = duration_find(service, true);
+	if (d->ms[what] < 0)
+		d->ms[what] = ms;
+	else
+		d->ms[what] = (d->ms[what] + ms) / 2;
+	durations_changed = true;
+}
+
+static struct service_job *
+find_job(const struct service_jobs *jobs, const char *service)
+{
+	struct service_job *job;
+
+	TAILQ_FOREACH(job, jobs, entries)
+	    if (strcmp(job->service, service) == 0)
+		    return job;
+	return NULL;
+}
+
+/* Work out the cost of each job from the durations we know, guessing
+ * the average for the services we don't. The jobs which wait on a job
+ * come after it, so we go backwards and know their cost when we get to
+ * the jobs they wait on. With no durations at all, all the costs are
+ * the same and the jobs run in the order they come. */
+static void
+job_costs(struct service_jobs *pending, int what)
+{
+	struct service_job *job, *j;
+	RC_STRING *s;
+	long ms, total = 0, known = 0;
+
+	TAILQ_FOREACH(job, pending, entries) {
+		job->cost = duration_get(job->service, what);
+		job->chain = 0;
+		if (job->cost >= 0) {
+			total += job->cost;
+			known++;
+		}
+	}
+	ms = known ? total / known : 0;
+	TAILQ_FOREACH_REVERSE(job, pending, service_jobs, entries) {
+		if (job->cost < 0)
+			job->cost = ms;
+		job->cost += job->chain;
+		TAILQ_FOREACH(s, job->after, entries)
+		    if ((j = find_job(pending, s->value)) &&
+			j->chain < job->cost)
+			    j->chain = job->cost;
+	}
+}
+
+static struct service_job *
+add_job(struct service_jobs *jobs, const char *service, const char *level)
+{
+	struct service_job *job = xmalloc(sizeof(*job));
+
+	job->service = xstrdup(service);
+	job->level = level;
+	job->pid = 0;
+	job->late = false;
+	job->after = rc_stringlist_new();
+	TAILQ_INSERT_TAIL(jobs, job, entries);
+	return job;
+}
+
+static void
+free_jobs(struct service_jobs *jobs)
+{
+	struct service_job *job;
+
+	while ((job = TAILQ_FIRST(jobs))) {
+		TAILQ_REMOVE(jobs, job, entries);
+		rc_stringlist_free(job->after);
+		free(job->service);
+		free(job);
+	}
+}
+
+/* Nothing has to wait for the service anymore */
+static void
+release_job(struct service_jobs *pending, const struct service_job *job)
+{
+	struct service_job *j;
+
+	TAILQ_FOREACH(j, pending, entries)
+	    rc_stringlist_delete(j->after, job->service);
+}
+
+/* The service has finished, so nothing has to wait for it anymore.
+ * When stacked, say so once the last service of its runlevel is done,
+ * including those we stopped waiting for. */
 static void
-do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
-				 const RC_STRINGLIST *stop_services, const RC_DEPTREE *deptree,
-				 const char *newlevel, bool parallel, bool going_down)
+finish_job(struct service_jobs *pending, const struct service_jobs *running,
+	   struct service_job *job, bool stacked)
 {
+	struct service_job *j;
+	bool last = true;
+
+	release_job(pending, job);
+	TAILQ_FOREACH(j, pending, entries)
+	    if (j->level == job->level)
+		    last = false;
+	TAILQ_FOREACH(j, running, entries)
+	    if (j->level == job->level)
+		    last = false;
+	if (stacked && last)
+		einfo("Runlevel %s has started", job->level);
+	rc_stringlist_free(job->after);
+	free(job->service);
+	free(job);
+}
+
+/* Run the jobs, at most jobs of them at once, each once the jobs it has
+ * to wait for are done. launch returns the pid of the job it runs, 0 if
+ * there is nothing to run or -1 to run no more.
+ * The pending jobs are in an order where the ones a job waits for come
+ * before it, so if nothing is running and nothing is ready, which should
+ * not happen as the deptree has no cycles, we run the first one anyway
+ * rather than wait for ever.
+ * Jobs which time out are late: the others no longer wait for them, but
+ * we do before we are done. */
+static void
+run_jobs(struct service_jobs *pending, long jobs, long timeout, bool stacked,
+	 int what, pid_t (*launch)(struct service_job *, void *), void *arg)
+{
+	struct service_jobs running;
+	struct service_job *job, *job2;
+	bool aborted = false;
+	long nrunning = 0;
 	pid_t pid;
-	RC_STRING *service, *svc1, *svc2;
-	RC_STRINGLIST *deporder, *tmplist, *kwords;
+	int wait;
+
+	if (jobs != 1)
+		job_costs(pending, what);
+	TAILQ_INIT(&running);
+	events_hold(true);
+	while (TAILQ_FIRST(&running) || (!aborted && TAILQ_FIRST(pending))) {
+		/* Collect the services which have finished, and stop
+		 * waiting for those we have waited long enough for */
+		TAILQ_FOREACH_SAFE(job, &running, entries, job2) {
+			if (pid_running(job->pid)) {
+				if (job->late || !timeout ||
+				    ms_until(&job->deadline) > 0)
+					continue;
+				ewarn("%s: %s has not started after %ld seconds,"
+				    " not waiting for it",
+				    applet, job->service, timeout);
+				job->late = true;
+				nrunning--;
+				release_job(pending, job);
+				continue;
+			}
+			duration_set(job->service, what,
+			    ms_since(&job->started));
+			TAILQ_REMOVE(&running, job, entries);
+			if (!job->late)
+				nrunning--;
+			finish_job(pending, &running, job, stacked);
+		}
+
+		/* Of the jobs which are ready, run the one with the
+		 * longest way to go first. One at a time, we keep to the
+		 * order they come in. */
+		job2 = NULL;
+		TAILQ_FOREACH(job, pending, entries) {
+			if (aborted || (jobs > 0 && nrunning >= jobs))
+				break;
+			if (TAILQ_FIRST(job->after) &&
+			    (nrunning > 0 || job != TAILQ_FIRST(pending)))
+				continue;
+			if (!job2 || job->cost > job2->cost)
+				job2 = job;
+			if (jobs == 1)
+				break;
+		}
+		if ((job = job2)) {
+			TAILQ_REMOVE(pending, job, entries);
+			pid = launch(job, arg);
+			if (pid == -1)
+				aborted = true;
+			if (pid > 0) {
+				add_pid(pid);
+				job->pid = pid;
+				clock_gettime(CLOCK_MONOTONIC, &job->started);
+				job->deadline = job->started;
+				job->deadline.tv_sec += timeout;
+				TAILQ_INSERT_TAIL(&running, job, entries);
+				nrunning++;
+			} else
+				finish_job(pending, &running, job, stacked);
+			continue;
+		}
+
+		/* Wait for a service to finish, or the first to time out */
+		wait = -1;
+		if (timeout)
+			TAILQ_FOREACH(job, &running, entries)
+			    if (!job->late && (wait == -1 ||
+				    ms_until(&job->deadline) < wait))
+				    wait = ms_until(&job->deadline);
+		if (TAILQ_FIRST(&running))
+			events_wait(wait);
+	}
+	events_hold(false);
+}
+
+static pid_t
+stop_job(struct service_job *job, _unused void *arg)
+{
+	RC_SERVICE state = rc_service_state(job->service);
+
+	if (state & RC_SERVICE_STOPPED || state & RC_SERVICE_FAILED)
+		return 0;
+	return service_stop(job->service);
+}
+
+/* The names of the services in the jobs */
+static RC_STRINGLIST *
+job_services(const struct service_jobs *jobs)
+{
+	RC_STRINGLIST *services = rc_stringlist_new();
+	struct service_job *job;
+
+	TAILQ_FOREACH(job, jobs, entries)
+	    rc_stringlist_add(services, job->service);
+	return services;
+}
+
+static void
+do_stop_services(RC_STRINGLIST *start_services,
+		 const RC_STRINGLIST *stop_services, const RC_DEPTREE *deptree,
+		 const RC_SNAPSHOT *snapshot,
+		 const char *newlevel, bool parallel, bool going_down)
+{
+	RC_STRING *service, *svc1;
+	RC_STRINGLIST *types_nw, *needed, *kwords, *services, *waits;
 	RC_SERVICE state;
 	RC_STRINGLIST *nostop;
+	struct service_jobs pending;
+	struct service_job *job;
 	bool crashed, nstop;
 
-	if (!types_nw) {
-		types_nw = rc_stringlist_new();
-		rc_stringlist_add(types_nw, "needsme");
-		rc_stringlist_add(types_nw, "wantsme");
-	}
-
 	crashed = rc_conf_yesno("rc_crashed_stop");
 
+	/* Everything the services we are going to start need or want,
+	 * however indirectly, has to keep running. Of the providers of a
+	 * virtual service, only the one picked for the runlevel counts,
+	 * so a provider we don't pick is stopped. This walks the deptree
+	 * once rather than once for each service we might stop. */
+	types_nw = rc_stringlist_new();
+	rc_stringlist_add(types_nw, "ineed");
+	rc_stringlist_add(types_nw, "iwant");
+	needed = rc_deptree_depends_snapshot(deptree, types_nw, start_services,
+	    newlevel ? newlevel : runlevel,
+	    RC_DEP_STRICT | RC_DEP_TRACE, snapshot);
+	rc_stringlist_free(types_nw);
+
+	TAILQ_INIT(&pending);
 	nostop = rc_stringlist_split(rc_conf_value("rc_nostop"), " ");
 	TAILQ_FOREACH_REVERSE(service, stop_services, rc_stringlist, entries)
 	{
+		/* Services only stop as we go, so the snapshot can rule
+		 * them out, but the others may have stopped since */
+		state = rc_snapshot_state(snapshot, service->value);
+		if (state & RC_SERVICE_STOPPED || state & RC_SERVICE_FAILED)
+			continue;
 		state = rc_service_state(service->value);
 		if (state & RC_SERVICE_STOPPED || state & RC_SERVICE_FAILED)
 			continue;
@@ -597,106 +1170,139 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 
 		/* We got this far. Last check is to see if any any service
 		 * that going to be started depends on us */
-		if (!svc1) {
-			tmplist = rc_stringlist_new();
-			rc_stringlist_add(tmplist, service->value);
-			deporder = rc_deptree_depends(deptree, types_nw,
-			    tmplist, newlevel ? newlevel : runlevel,
-			    RC_DEP_STRICT | RC_DEP_TRACE);
-			rc_stringlist_free(tmplist);
-			svc2 = NULL;
-			TAILQ_FOREACH(svc1, deporder, entries) {
-				svc2 = rc_stringlist_find(start_services,
-				    svc1->value);
-				if (svc2)
-					break;
-			}
-			rc_stringlist_free(deporder);
-
-			if (svc2)
-				continue;
-		}
+		if (!svc1 && rc_stringlist_find(needed, service->value))
+			continue;
 
 stop:
 		/* After all that we can finally stop the blighter! */
-		pid = service_stop(service->value);
-		if (pid > 0) {
-			add_pid(pid);
-			if (!parallel) {
-				rc_waitpid(pid);
-				remove_pid(pid);
-			}
-		}
+		add_job(&pending, service->value, NULL);
 	}
-
 	rc_stringlist_free(nostop);
+	rc_stringlist_free(needed);
+
+	/* A service stops once everything which needs, wants, uses or
+	 * starts after it has stopped, so the leaves stop first and
+	 * together. We go through the list in stop order, so those all
+	 * come before the services they wait for. */
+	services = job_services(&pending);
+	TAILQ_FOREACH(job, &pending, entries) {
+		waits = waits_for(deptree, main_types_nwua, job->service,
+		    services);
+		TAILQ_FOREACH(service, waits, entries)
+		    rc_stringlist_addu(find_job(&pending, service->value)->after,
+			job->service);
+		rc_stringlist_free(waits);
+	}
+	rc_stringlist_free(services);
+
+	run_jobs(&pending, parallel_jobs(parallel), 0, false, DURATION_STOP,
+	    stop_job, NULL);
+	free_jobs(&pending);
+	durations_save();
 }
 
-static void
-do_start_services(const RC_STRINGLIST *start_services, bool parallel)
+/* How we go about starting the services */
+struct start_options {
+	bool interactive;
+	bool crashed;
+};
+
+static pid_t
+start_job(struct service_job *job, void *arg)
 {
-	RC_STRING *service;
-	pid_t pid;
-	bool interactive = false;
+	struct start_options *opts = arg;
 	RC_SERVICE state;
-	bool crashed = false;
+	char c;
 
+	state = rc_service_state(job->service);
+	if (state & RC_SERVICE_FAILED)
+		return 0;
+	if (!(state & RC_SERVICE_STOPPED)) {
+		if (opts->crashed &&
+		    rc_service_daemons_crashed(job->service))
+			rc_service_mark(job->service, RC_SERVICE_STOPPED);
+		else
+			return 0;
+	}
+	if (!opts->interactive)
+		opts->interactive = want_interactive();
+
+	if (opts->interactive) {
+interactive_retry:
+		printf("\n");
+		einfo("About to start the service %s", job->service);
+		eindent();
+		einfo("1) Start the service\t\t2) Skip the service");
+		einfo("3) Continue boot process\t\t4) Exit to shell");
+		eoutdent();
+interactive_option:
+		/* Let us be interrupted while we wait for an answer */
+		events_hold(false);
+		c = read_key(true);
+		events_hold(true);
+		switch (c) {
+		case '1': break;
+		case '2': return 0;
+		case '3': opts->interactive = false; break;
+		case '4': open_shell(); goto interactive_retry;
+		default: goto interactive_option;
+		}
+	}
+
+	return service_start(job->service);
+}
+
+static void
+do_start_services(const RC_STRINGLIST *levels, const RC_DEPTREE *deptree,
+		  int options, bool parallel)
+{
+	RC_STRING *level, *service;
+	RC_STRINGLIST *plan, *services;
+	struct service_jobs pending;
+	struct service_job *job;
+	struct start_options opts;
+	bool stacked;
+
+	opts.interactive = false;
 	if (!rc_yesno(getenv("EINFO_QUIET")))
-		interactive = exists(INTERACTIVE);
+		opts.interactive = exists(INTERACTIVE);
 	errno = 0;
-	crashed = rc_conf_yesno("rc_crashed_start");
+	opts.crashed = rc_conf_yesno("rc_crashed_start");
 	if (errno == ENOENT)
-		crashed = true;
-
-	TAILQ_FOREACH(service, start_services, entries) {
-		state = rc_service_state(service->value);
-		if (state & RC_SERVICE_FAILED)
-			continue;
-		if (!(state & RC_SERVICE_STOPPED)) {
-			if (crashed &&
-			    rc_service_daemons_crashed(service->value))
-				rc_service_mark(service->value,
-				    RC_SERVICE_STOPPED);
-			else
-			    continue;
-		}
-		if (!interactive)
-			interactive = want_interactive();
-
-		if (interactive) {
-	interactive_retry:
-			printf("\n");
-			einfo("About to start the service %s",
-			    service->value);
-			eindent();
-			einfo("1) Start the service\t\t2) Skip the service");
-			einfo("3) Continue boot process\t\t4) Exit to shell");
-			eoutdent();
-	interactive_option:
-			switch (read_key(true)) {
-			case '1': break;
-			case '2': continue;
-			case '3': interactive = false; break;
-			case '4': open_shell(); goto interactive_retry;
-			default: goto interactive_option;
-			}
+		opts.crashed = true;
+
+	/* Stacked runlevels start as one plan, lowest first, so only the
+	 * dependencies between their services order them */
+	TAILQ_INIT(&pending);
+	stacked = TAILQ_FIRST(levels) != TAILQ_LAST(levels, rc_stringlist);
+	TAILQ_FOREACH_REVERSE(level, levels, rc_stringlist, entries) {
+		plan = rc_deptree_plan(deptree, level->value, options);
+		TAILQ_FOREACH(service, plan, entries) {
+			service->value[strcspn(service->value, " ")] = '\0';
+			if (!find_job(&pending, service->value))
+				add_job(&pending, service->value,
+				    level->value);
 		}
+		rc_stringlist_free(plan);
+	}
 
-		pid = service_start(service->value);
-		if (pid == -1)
-			break;
-		/* Remember the pid if we're running in parallel */
-		if (pid > 0) {
-			add_pid(pid);
-			if (!parallel) {
-				rc_waitpid(pid);
-				remove_pid(pid);
-			}
-		}
+	/* Each plan only orders the services in its own runlevel, so a
+	 * service waits for any it depends on in the others too */
+	services = job_services(&pending);
+	TAILQ_FOREACH(job, &pending, entries) {
+		rc_stringlist_free(job->after);
+		job->after = waits_for(deptree, main_types_nwua, job->service,
+		    services);
 	}
+	rc_stringlist_free(services);
+
+	run_jobs(&pending, parallel_jobs(parallel), start_timeout(), stacked,
+	    DURATION_START, start_job, &opts);
+	free_jobs(&pending);
+	durations_save();
 
 	/* Store our interactive status for boot */
-	if (interactive &&
+	if (opts.interactive &&
 	    (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0 ||
 		strcmp(runlevel, getenv("RC_BOOTLEVEL")) == 0))
 		mark_interactive();
@@ -738,8 +1344,8 @@ int main(int argc, char **argv)
 	const char *bootlevel = NULL;
 	char *newlevel = NULL;
 	const char *systype = NULL;
-	RC_STRINGLIST *deporder = NULL;
 	RC_STRINGLIST *tmplist;
+	RC_SNAPSHOT *snapshot;
 	RC_STRING *service;
 	bool going_down = false;
 	int depoptions = RC_DEP_STRICT | RC_DEP_TRACE;
@@ -857,12 +1463,9 @@ int main(int argc, char **argv)
 
 	rc_logger_open(newlevel ? newlevel : runlevel);
 
-	/* Setup a signal handler */
-	signal_setup(SIGINT, handle_signal);
-	signal_setup(SIGQUIT, handle_signal);
-	signal_setup(SIGTERM, handle_signal);
-	signal_setup(SIGUSR1, handle_signal);
-	signal_setup(SIGWINCH, handle_signal);
+	/* Take our signals, and know when our children finish, through
+	 * our event loop while we run services */
+	events_open();
 
 	/* Run any special sysinit foo */
 	if (newlevel && strcmp(newlevel, RC_LEVEL_SYSINIT) == 0) {
@@ -873,9 +1476,6 @@ int main(int argc, char **argv)
 
 	rc_plugin_load();
 
-	/* Now we start handling our children */
-	signal_setup(SIGCHLD, handle_signal);
-
 	if (newlevel &&
 	    (strcmp(newlevel, RC_LEVEL_SHUTDOWN) == 0 ||
 		strcmp(newlevel, RC_LEVEL_SINGLE) == 0))
@@ -945,6 +1545,9 @@ int main(int argc, char **argv)
 	if (exists(RC_DEPTREE_SKEWED))
 		ewarn("WARNING: clock skew detected!");
 
+	/* Create or remove the service state table as configured */
+	rc_service_state_table(rc_conf_yesno("rc_state_table"));
+
 	/* Clean the failed services state dir */
 	clean_failed();
 
@@ -962,11 +1565,13 @@ int main(int argc, char **argv)
 	* in the new or current runlevel so we won't actually be stopping
 	* them all.
 	*/
-	main_stop_services = rc_services_in_state(RC_SERVICE_STARTED);
-	tmplist = rc_services_in_state(RC_SERVICE_INACTIVE);
+	snapshot = rc_service_state_snapshot();
+	main_stop_services = rc_services_in_state_snapshot(snapshot,
+	    RC_SERVICE_STARTED);
+	tmplist = rc_services_in_state_snapshot(snapshot, RC_SERVICE_INACTIVE);
 	TAILQ_CONCAT(main_stop_services, tmplist, entries);
 	free(tmplist);
-	tmplist = rc_services_in_state(RC_SERVICE_STARTING);
+	tmplist = rc_services_in_state_snapshot(snapshot, RC_SERVICE_STARTING);
 	TAILQ_CONCAT(main_stop_services, tmplist, entries);
 	free(tmplist);
 	if (main_stop_services)
@@ -979,8 +1584,9 @@ int main(int argc, char **argv)
 	rc_stringlist_add(main_types_nwua, "iafter");
 
 	if (main_stop_services) {
-		tmplist = rc_deptree_depends(main_deptree, main_types_nwua, main_stop_services,
-		    runlevel, depoptions | RC_DEP_STOP);
+		tmplist = rc_deptree_depends_snapshot(main_deptree, main_types_nwua,
+		    main_stop_services, runlevel, depoptions | RC_DEP_STOP,
+		    snapshot);
 		rc_stringlist_free(main_stop_services);
 		main_stop_services = tmplist;
 	}
@@ -990,7 +1596,8 @@ int main(int argc, char **argv)
 	 * runlevels.  Clearly, some of these will already be started so we
 	 * won't actually be starting them all.
 	 */
-	main_hotplugged_services = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+	main_hotplugged_services = rc_services_in_state_snapshot(snapshot,
+	    RC_SERVICE_HOTPLUGGED);
 	main_start_services = rc_services_in_runlevel_stacked(newlevel ?
 	    newlevel : runlevel);
 	if (strcmp(newlevel ? newlevel : runlevel, RC_LEVEL_SHUTDOWN) != 0 &&
@@ -1024,7 +1631,8 @@ int main(int argc, char **argv)
 
 	/* Now stop the services that shouldn't be running */
 	if (main_stop_services && !nostop)
-		do_stop_services(main_types_nw, main_start_services, main_stop_services, main_deptree, newlevel, parallel, going_down);
+		do_stop_services(main_start_services, main_stop_services, main_deptree, snapshot, newlevel, parallel, going_down);
+	rc_snapshot_free(snapshot);
 
 	/* Wait for our services to finish */
 	wait_for_services();
@@ -1077,26 +1685,13 @@ int main(int argc, char **argv)
 		/* Get a list of the chained runlevels which compose the target runlevel */
 		RC_STRINGLIST *runlevel_chain = rc_runlevel_stacks(runlevel);
 
-		/* Loop through them in reverse order. */
-		RC_STRING *rlevel;
-		TAILQ_FOREACH_REVERSE(rlevel, runlevel_chain, rc_stringlist, entries)
-		{
-			/* Get a list of all the services in that runlevel */
-			RC_STRINGLIST *run_services = rc_services_in_runlevel(rlevel->value);
-
-			/* Start those services. */
-			rc_stringlist_sort(&run_services);
-			deporder = rc_deptree_depends(main_deptree, main_types_nwua, run_services, rlevel->value, depoptions | RC_DEP_START);
-			rc_stringlist_free(run_services);
-			run_services = deporder;
-			do_start_services(run_services, parallel);
+		/* Start the services in all of them together */
+		do_start_services(runlevel_chain, main_deptree, depoptions,
+		    parallel);
 
-			/* Wait for our services to finish */
-			wait_for_services();
+		/* Wait for our services to finish */
+		wait_for_services();
 
-			/* Free the list of services, we're done with it. */
-			rc_stringlist_free(run_services);
-		}
 		rc_stringlist_free(runlevel_chain);
 	}
 
@@ -1119,9 +1714,13 @@ int main(int argc, char **argv)
 	/* If we're in the boot runlevel and we regenerated our dependencies
 	 * we need to delete them so that they are regenerated again in the
 	 * default runlevel as they may depend on things that are now
-	 * available */
-	if (regen && strcmp(runlevel, bootlevel) == 0)
+	 * available. Dropping the global key of the depcache makes
+	 * every script get sourced again too. */
+	if (regen && strcmp(runlevel, bootlevel) == 0) {
 		unlink(RC_DEPTREE_CACHE);
+		unlink(RC_DEPTREE_BIN);
+		unlink(RC_DEPCACHE "/.global");
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -187,6 +187,8 @@ static void child_process(char *exec, char **argv, char *svcname,
 	time_t start_time;
 	char start_count_string[20];
 	char start_time_string[20];
+	char value[40];
+	RC_STRINGLIST *values;
 
 #ifdef HAVE_PAM
 	pam_handle_t *pamh = NULL;
@@ -199,9 +201,17 @@ static void child_process(char *exec, char **argv, char *svcname,
 	if (svcname) {
 start_time = time(NULL);
 from_time_t(start_time_string, start_time);
-		rc_service_value_set(svcname, "start_time", start_time_string);
 sprintf(start_count_string, "%i", start_count);
-		rc_service_value_set(svcname, "start_count", start_count_string);
+		/* Save both in one go */
+		values = rc_stringlist_new();
+		snprintf(value, sizeof(value), "start_time=%s",
+		    start_time_string);
+		rc_stringlist_add(values, value);
+		snprintf(value, sizeof(value), "start_count=%s",
+		    start_count_string);
+		rc_stringlist_add(values, value);
+		rc_service_values_set(svcname, values);
+		rc_stringlist_free(values);
 	}
 
 	if (nicelevel) {